@@ -6,549 +6,8082 @@
 #include <stack>
 #include <cmath>
 #include <cstring>
+#include <cstdint>
 #include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#endif
 using namespace std;
 
+// ID returned when a station name is not in the graph
+const uint32_t NO_STATION = UINT32_MAX;
+
+// Edge cost marking a connection that searches must not use
+const int CLOSED_EDGE = INT_MAX;
+
+// Heap allocations are counted only in builds that report them
+#if defined(DELHIMETRO_BENCH) || defined(DELHIMETRO_STATS)
+#define DELHIMETRO_COUNT_ALLOCATIONS
+#endif
+
 /**
- * Graph_M class represents the Delhi Metro map as a graph
- * with stations as vertices and connections as edges.
+ * AllocationCounter counts the heap allocations made by the current
+ * thread, through the replacement global operator new below, so
+ * benchmarks can report allocations per query. The replacement is built
+ * only with -DDELHIMETRO_BENCH or -DDELHIMETRO_STATS; otherwise the
+ * counts stay zero and allocation costs nothing extra.
  */
-class Graph_M {
+class AllocationCounter {
 public:
-    /**
-     * Vertex class represents a station in the metro map
-     * with its neighboring stations and distances.
-     */
-    class Vertex {
+    static thread_local uint64_t count;     // Calls to operator new
+    static thread_local uint64_t bytes;     // Bytes requested
+};
+
+thread_local uint64_t AllocationCounter::count = 0;
+thread_local uint64_t AllocationCounter::bytes = 0;
+
+#ifdef DELHIMETRO_COUNT_ALLOCATIONS
+void* operator new(size_t size) {
+    AllocationCounter::count++;
+    AllocationCounter::bytes += size;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+// Kept out of line so the compiler never pairs an inlined free with operator new
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+#endif
+
+/**
+ * NameIndex resolves what people type to station IDs. Names are compared
+ * in normalised form: letters and digits only, lower-cased, without the
+ * ~line suffix, so "janak puri west" finds Janak_Puri_West~BO. The
+ * normalised names form a trie stored breadth-first, CSR-style: the
+ * children of node v are nodes childOffsets[v] up to childOffsets[v + 1],
+ * sorted by letter, and the names below a node are one range of the
+ * sorted name list, so a prefix lookup is a walk down the trie and a
+ * slice of that list. Every station also has a unique short code, found
+ * through a perfect hash of the codes.
+ */
+class NameIndex {
+public:
+    // A station found by fuzzy lookup and the edits from the text to its name
+    class Match {
     public:
-        unordered_map<string, int> neighbours; // Station name -> distance
+        uint32_t id;
+        int edits;
     };
 
-    static unordered_map<string, Vertex> vtces; // All stations in the graph
+    // Buffers reused from lookup to lookup
+    class Scratch {
+    public:
+        string key;             // Normalised text
+        vector<int> rows;       // Edit distance rows, one per trie depth
+        vector<pair<uint32_t, uint32_t>> stack;     // Nodes to visit, with their depth
+    };
 
-    Graph_M() {
-        vtces.clear();
+    vector<string> codes;       // Station ID -> short code, upper case
+
+    // Appends the normalised form of text to key
+    static void normalise(const string& text, string& key) {
+        for (char c : text) {
+            if (c == '~') break;
+            if (isalnum((unsigned char)c)) key += tolower((unsigned char)c);
+        }
     }
 
-    // Returns the number of stations in the graph
-    int numVetex() {
-        return vtces.size();
+    // Builds the trie and the codes of the given station names
+    static NameIndex build(const vector<string>& names) {
+        NameIndex ix;
+        uint32_t n = names.size();
+        vector<string> keys(n);
+        for (uint32_t i = 0; i < n; i++) {
+            normalise(names[i], keys[i]);
+            ix.depth = max(ix.depth, (uint32_t)keys[i].size());
+        }
+        ix.order.resize(n);
+        iota(ix.order.begin(), ix.order.end(), 0);
+        stable_sort(ix.order.begin(), ix.order.end(), [&](uint32_t a, uint32_t b) {
+            return keys[a] < keys[b];
+        });
+
+        // Breadth-first, so the children of each node are numbered consecutively;
+        // names ending at a node sort before the longer names below it
+        ix.label.push_back(0);
+        ix.rangeBegin.push_back(0);
+        ix.rangeEnd.push_back(n);
+        ix.childOffsets.push_back(1);
+        vector<uint32_t> nodeDepth(1, 0);
+        for (uint32_t v = 0; v < ix.label.size(); v++) {
+            uint32_t d = nodeDepth[v];
+            uint32_t i = ix.rangeBegin[v], end = ix.rangeEnd[v];
+            while (i < end && keys[ix.order[i]].size() == d) i++;
+            ix.terminalEnd.push_back(i);
+            while (i < end) {
+                char c = keys[ix.order[i]][d];
+                uint32_t j = i;
+                while (j < end && keys[ix.order[j]][d] == c) j++;
+                ix.label.push_back(c);
+                ix.rangeBegin.push_back(i);
+                ix.rangeEnd.push_back(j);
+                nodeDepth.push_back(d + 1);
+                i = j;
+            }
+            ix.childOffsets.push_back(ix.label.size());
+        }
+
+        ix.assignCodes(names);
+        ix.buildCodeHash();
+        return ix;
     }
 
-    // Checks if a station exists in the graph
-    bool containsVertex(string vname) {
-        return vtces.count(vname) > 0;
+    /**
+     * Finds the station whose normalised name is the normalised text, or
+     * else whose code is the text in any case.
+     * @return NO_STATION if there is none, or several names match
+     */
+    uint32_t resolve(const string& text, Scratch& s) const {
+        s.key.clear();
+        normalise(text, s.key);
+        uint32_t v = walk(s.key);
+        if (v != NO_STATION && terminalEnd[v] - rangeBegin[v] == 1) return order[rangeBegin[v]];
+        if (v != NO_STATION && terminalEnd[v] > rangeBegin[v]) return NO_STATION;
+        return findCode(text);
     }
 
-    // Adds a new station to the graph
-    void addVertex(string vname) {
-        Vertex vtx;
-        vtces[vname] = vtx;
+    // Lists up to limit stations whose normalised names start with the normalised prefix, in name order
+    void complete(const string& prefix, size_t limit, vector<uint32_t>& out, Scratch& s) const {
+        out.clear();
+        s.key.clear();
+        normalise(prefix, s.key);
+        uint32_t v = walk(s.key);
+        if (v == NO_STATION) return;
+        for (uint32_t i = rangeBegin[v]; i < rangeEnd[v] && out.size() < limit; i++) {
+            out.push_back(order[i]);
+        }
     }
 
-    // Removes a station from the graph and all its connections
-    void removeVertex(string vname) {
-        if (!containsVertex(vname)) return;
+    /**
+     * Lists up to limit stations whose normalised names are at most
+     * maxEdits insertions, deletions or substitutions from the normalised
+     * text, closest first. The trie is searched depth-first with one row
+     * of the edit distance table per level, and a branch is dropped as
+     * soon as every entry of its row exceeds maxEdits.
+     */
+    void fuzzy(const string& text, int maxEdits, size_t limit, vector<Match>& out, Scratch& s) const {
+        out.clear();
+        s.key.clear();
+        normalise(text, s.key);
+        uint32_t m = s.key.size();
+        s.rows.resize((size_t)(depth + 1) * (m + 1));
+        for (uint32_t j = 0; j <= m; j++) {
+            s.rows[j] = min((int)j, maxEdits + 1);
+        }
+        if ((int)m <= maxEdits) addMatches(0, m, out);
 
-        // Remove all edges connected to this station
-        Vertex vtx = vtces[vname];
-        for (auto& neighbour : vtx.neighbours) {
-            vtces[neighbour.first].neighbours.erase(vname);
+        s.stack.clear();
+        for (uint32_t c = childOffsets[0]; c < childOffsets[1]; c++) {
+            s.stack.push_back({c, 1});
+        }
+        while (!s.stack.empty()) {
+            auto [v, d] = s.stack.back();
+            s.stack.pop_back();
+            const int* prev = s.rows.data() + (size_t)(d - 1) * (m + 1);
+            int* row = s.rows.data() + (size_t)d * (m + 1);
+            // Only cells within maxEdits of the diagonal can stay within maxEdits; the
+            // cells either side of that band hold maxEdits + 1 for the next row to read
+            int lo = max(1, (int)d - maxEdits), hi = min((int)m, (int)d + maxEdits);
+            if (lo > hi + 1) continue;
+            row[lo - 1] = lo == 1 ? min((int)d, maxEdits + 1) : maxEdits + 1;
+            if (hi < (int)m) row[hi + 1] = maxEdits + 1;
+            int best = row[lo - 1];
+            for (int j = lo; j <= hi; j++) {
+                int sub = prev[j - 1] + (s.key[j - 1] != label[v]);
+                row[j] = min(sub, min(prev[j], row[j - 1]) + 1);
+                best = min(best, row[j]);
+            }
+            if (best > maxEdits) continue;
+            if (hi == (int)m && row[m] <= maxEdits) addMatches(v, row[m], out);
+            for (uint32_t c = childOffsets[v]; c < childOffsets[v + 1]; c++) {
+                s.stack.push_back({c, d + 1});
+            }
         }
 
-        vtces.erase(vname);
+        // Matches carry their position in name order until sorted
+        sort(out.begin(), out.end(), [](const Match& a, const Match& b) {
+            return a.edits != b.edits ? a.edits < b.edits : a.id < b.id;
+        });
+        if (out.size() > limit) out.resize(limit);
+        for (Match& mt : out) {
+            mt.id = order[mt.id];
+        }
     }
 
-    // Returns the number of connections in the graph
-    int numEdges() {
-        int count = 0;
-        for (auto& station : vtces) {
-            count += station.second.neighbours.size();
+    // Returns the station with the given code in any case, or NO_STATION
+    uint32_t findCode(const string& code) const {
+        if (slots.empty()) return NO_STATION;
+        uint64_t h = hashCode(code);
+        uint64_t b = h % displace.size();
+        uint32_t id = slots[slotOf(h, displace[b])];
+        if (id == NO_STATION || codes[id].size() != code.size()) return NO_STATION;
+        for (size_t i = 0; i < code.size(); i++) {
+            if (toupper((unsigned char)code[i]) != codes[id][i]) return NO_STATION;
         }
-        return count / 2; // Each edge is counted twice
+        return id;
     }
 
-    // Checks if a direct connection exists between two stations
-    bool containsEdge(string vname1, string vname2) {
-        if (!containsVertex(vname1) return false;
-        if (!containsVertex(vname2)) return false;
-        return vtces[vname1].neighbours.count(vname2) > 0;
-    }
+private:
+    vector<char> label;             // Node -> letter on the edge from its parent
+    vector<uint32_t> childOffsets;  // Children of node v: [childOffsets[v], childOffsets[v + 1])
+    vector<uint32_t> rangeBegin;    // Names below node v: order[rangeBegin[v]] up to order[rangeEnd[v]]
+    vector<uint32_t> rangeEnd;
+    vector<uint32_t> terminalEnd;   // Names ending at node v: order[rangeBegin[v]] up to order[terminalEnd[v]]
+    vector<uint32_t> order;         // Station IDs sorted by normalised name
+    uint32_t depth = 0;             // Length of the longest normalised name
 
-    // Adds a connection between two stations with given distance
-    void addEdge(string vname1, string vname2, int value) {
-        if (!containsVertex(vname1) return;
-        if (!containsVertex(vname2)) return;
-        if (containsEdge(vname1, vname2)) return;
+    uint64_t seed = 0;
+    vector<uint32_t> displace;      // Per hash bucket, the displacement that places its codes
+    vector<uint32_t> slots;         // Slot -> station ID, NO_STATION if empty
 
-        vtces[vname1].neighbours[vname2] = value;
-        vtces[vname2].neighbours[vname1] = value;
+    // Returns the trie node spelling key, or NO_STATION if no name starts with it
+    uint32_t walk(const string& key) const {
+        uint32_t v = 0;
+        for (char c : key) {
+            uint32_t next = NO_STATION;
+            for (uint32_t ch = childOffsets[v]; ch < childOffsets[v + 1]; ch++) {
+                if (label[ch] == c) {
+                    next = ch;
+                    break;
+                }
+            }
+            if (next == NO_STATION) return NO_STATION;
+            v = next;
+        }
+        return v;
     }
 
-    // Removes a connection between two stations
-    void removeEdge(string vname1, string vname2) {
-        if (!containsEdge(vname1, vname2)) return;
-
-        vtces[vname1].neighbours.erase(vname2);
-        vtces[vname2].neighbours.erase(vname1);
+    // Adds the names ending at node v, by their position in name order
+    void addMatches(uint32_t v, int edits, vector<Match>& out) const {
+        for (uint32_t i = rangeBegin[v]; i < terminalEnd[v]; i++) {
+            out.push_back({i, edits});
+        }
     }
 
-    // Displays the complete metro map
-    void display_Map() {
-        cout << "\t Delhi Metro Map" << endl;
-        cout << "\t------------------" << endl;
-        cout << "----------------------------------------------------" << endl;
-        
-        for (auto& station : vtces) {
-            string key = station.first;
-            string str = key + " =>\n";
-            Vertex vtx = station.second;
-            
-            for (auto& neighbour : vtx.neighbours) {
-                str += "\t" + neighbour.first + "\t";
-                if (neighbour.first.length() < 16) str += "\t";
-                if (neighbour.first.length() < 8) str += "\t";
-                str += to_string(neighbour.second) + "\n";
+    /**
+     * Gives each station the initials of its words and the digits in its
+     * name (Noida_Sector_62 is NS62), at least two characters long. A code
+     * already taken grows by the next letters of the name, up to two, and
+     * then by a number until it is unique.
+     */
+    void assignCodes(const vector<string>& names) {
+        codes.resize(names.size());
+        // Open-addressed set of the stations whose codes are assigned
+        size_t size = 1;
+        while (size < names.size() * 2) size <<= 1;
+        vector<uint32_t> taken(size, NO_STATION);
+        size_t mask = size - 1;
+        auto slot = [&](const string& code) {
+            size_t i = hashCode(code) & mask;
+            while (taken[i] != NO_STATION && codes[taken[i]] != code) i = (i + 1) & mask;
+            return i;
+        };
+
+        string code, digits, rest, candidate;
+        for (uint32_t id = 0; id < names.size(); id++) {
+            const string& name = names[id];
+            size_t end = min(name.find('~'), name.size());
+            code.clear();
+            digits.clear();
+            rest.clear();
+            bool wordStart = true;
+            for (size_t i = 0; i < end; i++) {
+                unsigned char c = name[i];
+                if (isdigit(c)) digits += c;
+                if (isalpha(c)) {
+                    if (wordStart) {
+                        code += toupper(c);
+                    } else {
+                        rest += toupper(c);
+                    }
+                }
+                wordStart = !isalnum(c);
             }
-            cout << str << endl;
+            if (code.empty() && digits.empty()) code = "S";
+            size_t next = 0;    // Next letter of rest to add
+            while (code.size() + digits.size() < 2 && next < rest.size()) {
+                code += rest[next++];
+            }
+            candidate = code + digits;
+            for (size_t extra = 0; taken[slot(candidate)] != NO_STATION && extra < 2 && next < rest.size(); extra++) {
+                code += rest[next++];
+                candidate = code + digits;
+            }
+            for (uint32_t k = 2; taken[slot(candidate)] != NO_STATION; k++) {
+                candidate = code + digits + to_string(k);
+            }
+            codes[id] = candidate;
+            taken[slot(candidate)] = id;
         }
-        
-        cout << "\t------------------" << endl;
-        cout << "---------------------------------------------------" << endl;
     }
 
-    // Displays all stations in the metro
-    void display_Stations() {
-        cout << "\n***********************************************************************\n";
-        cout << "*                      STATIONS IN THE MAP                            *\n";
-        cout << "***********************************************************************\n";
-        
-        int i = 1;
-        for (auto& station : vtces) {
-            cout << i << ". " << station.first << endl;
-            i++;
+    // FNV-1a of the upper-cased code, from the seed
+    uint64_t hashCode(const string& code) const {
+        uint64_t h = 0xCBF29CE484222325ull ^ seed;
+        for (char c : code) {
+            h = (h ^ (unsigned char)toupper((unsigned char)c)) * 0x100000001B3ull;
         }
-        
-        cout << "***********************************************************************\n";
+        return h ^ (h >> 31);
     }
 
-    // Checks if a path exists between two stations using DFS
-    bool hasPath(string vname1, string vname2, unordered_map<string, bool>& processed) {
-        if (containsEdge(vname1, vname2)) {
-            return true;
-        }
+    // Slot of a code with hash h in a bucket displaced by d
+    uint32_t slotOf(uint64_t h, uint32_t d) const {
+        uint64_t x = h + (d + 1) * 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return (x ^ (x >> 31)) % slots.size();
+    }
 
-        processed[vname1] = true;
-        Vertex vtx = vtces[vname1];
-        
-        for (auto& neighbour : vtx.neighbours) {
-            string nbr = neighbour.first;
-            if (!processed.count(nbr) {
-                if (hasPath(nbr, vname2, processed)) {
-                    return true;
+    /**
+     * Builds a perfect hash of the codes by hash and displace: codes are
+     * hashed into about n / 4 buckets, and the buckets, largest first,
+     * each get the first displacement that puts all their codes in free
+     * slots. A seed that leaves a bucket without one is replaced.
+     */
+    void buildCodeHash() {
+        uint32_t n = codes.size();
+        if (n == 0) return;
+        vector<uint64_t> hashes(n);
+        vector<uint32_t> offsets, members(n), bySize, chosen;
+        for (seed = 0;; seed++) {
+            slots.assign(n + n / 4 + 1, NO_STATION);
+            displace.assign(n / 4 + 1, 0);
+            uint32_t buckets = displace.size();
+
+            // Codes grouped by bucket, CSR-style
+            offsets.assign(buckets + 1, 0);
+            for (uint32_t id = 0; id < n; id++) {
+                hashes[id] = hashCode(codes[id]);
+                offsets[hashes[id] % buckets + 1]++;
+            }
+            for (uint32_t b = 0; b < buckets; b++) {
+                offsets[b + 1] += offsets[b];
+            }
+            vector<uint32_t> pos(offsets.begin(), offsets.end() - 1);
+            for (uint32_t id = 0; id < n; id++) {
+                members[pos[hashes[id] % buckets]++] = id;
+            }
+            bySize.resize(buckets);
+            iota(bySize.begin(), bySize.end(), 0);
+            stable_sort(bySize.begin(), bySize.end(), [&](uint32_t a, uint32_t b) {
+                return offsets[a + 1] - offsets[a] > offsets[b + 1] - offsets[b];
+            });
+
+            bool placed = true;
+            for (uint32_t b : bySize) {
+                uint32_t first = offsets[b], last = offsets[b + 1];
+                if (first == last) break;
+                uint32_t d = 0;
+                for (; d < (1u << 16); d++) {
+                    chosen.clear();
+                    for (uint32_t k = first; k < last; k++) {
+                        uint32_t slot = slotOf(hashes[members[k]], d);
+                        if (slots[slot] != NO_STATION || find(chosen.begin(), chosen.end(), slot) != chosen.end()) break;
+                        chosen.push_back(slot);
+                    }
+                    if (chosen.size() == last - first) break;
+                }
+                if (d == (1u << 16)) {
+                    placed = false;
+                    break;
+                }
+                displace[b] = d;
+                for (uint32_t k = first; k < last; k++) {
+                    slots[chosen[k - first]] = members[k];
                 }
             }
+            if (placed) return;
         }
+    }
+};
 
-        return false;
+/**
+ * StationIndex holds the station names of a network and their IDs. It
+ * never changes once built, so versions of a network that differ only in
+ * their connections share one.
+ */
+class StationIndex {
+public:
+    vector<string> names;                   // Station ID -> name
+    unordered_map<string, uint32_t> ids;    // Station name -> ID
+
+    StationIndex() = default;
+
+    StationIndex(vector<string> names, unordered_map<string, uint32_t> ids)
+        : names(std::move(names)), ids(std::move(ids)) {}
+
+    // Returns the normalised names and short codes, building them on first use from any thread
+    const NameIndex& search() const {
+        call_once(searchBuilt, [this]() { searchIndex = NameIndex::build(names); });
+        return searchIndex;
+    }
+
+private:
+    mutable once_flag searchBuilt;
+    mutable NameIndex searchIndex;
+};
+
+/**
+ * FrozenGraph is the read-only form of the metro map that every search runs on.
+ * Station names are interned to dense IDs 0..n-1 and connections are stored
+ * CSR-style: the neighbours of station u are targets[offsets[u]] up to
+ * targets[offsets[u + 1]], with the matching distances in weights.
+ */
+class FrozenGraph {
+public:
+    shared_ptr<const StationIndex> stations;    // Names and IDs, shared between versions
+    vector<uint32_t> offsets;               // Start of each station's edges (size n + 1)
+    vector<uint32_t> targets;               // Neighbouring station IDs, sorted per station
+    vector<int> weights;                    // Distance in km, parallel to targets
+    vector<uint32_t> component;             // Connected component label per station
+    vector<uint32_t> lineMask;              // One bit per line letter in the name suffix
+    array<string, 26> lineNames;            // Display name per line letter, empty for the default
+
+    FrozenGraph() : stations(make_shared<StationIndex>()), offsets(1, 0) {}
+
+    // Returns the number of stations in the graph
+    uint32_t numStations() const {
+        return stations->names.size();
+    }
+
+    // Returns the name of a station
+    const string& name(uint32_t id) const {
+        return stations->names[id];
+    }
+
+    // Returns the number of connections in the graph
+    uint32_t numEdges() const {
+        return targets.size() / 2; // Each edge is stored twice
+    }
+
+    // Returns the ID of a station, or NO_STATION if it does not exist
+    uint32_t findId(const string& vname) const {
+        auto it = stations->ids.find(vname);
+        return it == stations->ids.end() ? NO_STATION : it->second;
     }
 
     /**
-     * DijkstraPair class used for Dijkstra's algorithm implementation
-     * to find shortest path (distance or time).
+     * Returns the ID of the station named by text: its exact name, its
+     * name in any case or spacing without the line suffix, or its code.
+     * @return NO_STATION if nothing or more than one station matches
      */
-    class DijkstraPair {
-    public:
-        string vname;   // Station name
-        string psf;     // Path so far
-        int cost;       // Total cost (distance or time)
+    uint32_t resolve(const string& text) const {
+        uint32_t id = findId(text);
+        if (id != NO_STATION) return id;
+        static thread_local NameIndex::Scratch s;
+        return stations->search().resolve(text, s);
+    }
+
+    // Returns the distance between two adjacent stations, or -1 if not adjacent
+    int edgeWeight(uint32_t u, uint32_t v) const {
+        const uint32_t* first = targets.data() + offsets[u];
+        const uint32_t* last = targets.data() + offsets[u + 1];
+        const uint32_t* it = lower_bound(first, last, v);
+        if (it == last || *it != v) return -1;
+        return weights[it - targets.data()];
+    }
+
+    // Checks in O(1) if two stations are connected by some path
+    bool connected(uint32_t u, uint32_t v) const {
+        return component[u] == component[v];
+    }
+
+    // Returns true if the station lies on more than one line
+    bool isInterchange(uint32_t u) const {
+        return __builtin_popcount(lineMask[u]) > 1;
+    }
+
+    /**
+     * Returns a 64-bit FNV-1a hash of the station names and CSR arrays.
+     * Files derived from a network (such as route tables) store it so
+     * they can be rejected when the network changes.
+     */
+    uint64_t fingerprint() const {
+        uint64_t h = 14695981039346656037ull;
+        auto mix = [&h](const void* data, size_t len) {
+            const uint8_t* p = (const uint8_t*)data;
+            for (size_t i = 0; i < len; i++) {
+                h = (h ^ p[i]) * 1099511628211ull;
+            }
+        };
+        for (const string& name : stations->names) {
+            mix(name.data(), name.size() + 1);
+        }
+        mix(offsets.data(), offsets.size() * sizeof(uint32_t));
+        mix(targets.data(), targets.size() * sizeof(uint32_t));
+        mix(weights.data(), weights.size() * sizeof(int));
+        return h;
+    }
 
-        // Operator overloading for priority queue
-        bool operator<(const DijkstraPair& other) const {
-            return cost > other.cost; // Min-heap based on cost
+    // Returns the display name of a line letter
+    string lineName(char line) const {
+        if (isupper(line) && !lineNames[line - 'A'].empty()) return lineNames[line - 'A'];
+        switch (line) {
+            case 'B': return "Blue";
+            case 'Y': return "Yellow";
+            case 'O': return "Orange";
+            case 'P': return "Pink";
+            case 'R': return "Red";
+            default: return string("Line ") + line;
         }
-    };
+    }
 
+    // Returns the line bits encoded in a suffix such as "~BY" (B and Y)
+    static uint32_t parseLineMask(const string& vname) {
+        uint32_t mask = 0;
+        size_t index = vname.find('~');
+        if (index == string::npos) return mask;
+        for (size_t i = index + 1; i < vname.size(); i++) {
+            if (isupper(vname[i])) mask |= 1u << (vname[i] - 'A');
+        }
+        return mask;
+    }
+};
+
+/**
+ * GraphBuilder collects stations and connections and freezes them into a
+ * FrozenGraph. Names are interned to IDs as they are added; duplicate
+ * connections are resolved once at freeze time by a single sort.
+ */
+class GraphBuilder {
+public:
     /**
-     * Dijkstra's algorithm to find shortest distance or time between stations
-     * @param src Source station
-     * @param des Destination station
-     * @param nan If true, calculates time; if false, calculates distance
-     * @return Minimum cost (distance in km or time in minutes)
+     * Connection class represents an undirected edge between two
+     * interned stations.
      */
-    int dijkstra(string src, string des, bool nan) {
-        unordered_map<string, DijkstraPair> map;
-        priority_queue<DijkstraPair> pq;
+    class Connection {
+    public:
+        uint32_t u, v;  // Station IDs
+        int km;         // Distance
+    };
 
-        // Initialize all stations with infinity cost
-        for (auto& station : vtces) {
-            DijkstraPair np;
-            np.vname = station.first;
-            np.cost = INT_MAX;
+    vector<string> names;                   // Station ID -> name
+    unordered_map<string, uint32_t> ids;    // Station name -> ID
+    vector<Connection> edges;               // Connections in insertion order
+    array<string, 26> lineNames;            // Display name per line letter, empty for the default
 
-            if (station.first == src) {
-                np.cost = 0;
-                np.psf = station.first;
+    // Returns a builder holding the stations and connections of g, which it freezes back to
+    static GraphBuilder thaw(const FrozenGraph& g) {
+        GraphBuilder b;
+        b.names = g.stations->names;
+        b.ids = g.stations->ids;
+        b.lineNames = g.lineNames;
+        for (uint32_t u = 0; u < g.numStations(); u++) {
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                if (u < g.targets[e]) b.edges.push_back({u, g.targets[e], g.weights[e]});
             }
+        }
+        return b;
+    }
+
+    // Reserves room for a network of known size before a bulk load
+    void reserve(size_t stations, size_t connections) {
+        names.reserve(stations);
+        ids.reserve(stations);
+        edges.reserve(connections);
+    }
+
+    // Adds a station (if new) and returns its ID
+    uint32_t addStation(const string& vname) {
+        auto it = ids.find(vname);
+        if (it != ids.end()) return it->second;
+
+        uint32_t id = names.size();
+        names.push_back(vname);
+        ids.emplace(vname, id);
+        return id;
+    }
+
+    // Returns the ID of a station, or NO_STATION if it does not exist
+    uint32_t findId(const string& vname) const {
+        auto it = ids.find(vname);
+        return it == ids.end() ? NO_STATION : it->second;
+    }
+
+    // Adds a connection between two stations by ID
+    void addConnection(uint32_t u, uint32_t v, int km) {
+        edges.push_back({u, v, km});
+    }
+
+    // Adds a connection between two stations by name; ignored if either is unknown
+    bool addConnection(const string& vname1, const string& vname2, int km) {
+        uint32_t u = findId(vname1);
+        uint32_t v = findId(vname2);
+        if (u == NO_STATION || v == NO_STATION) return false;
+        addConnection(u, v, km);
+        return true;
+    }
+
+    // Removes every connection between two stations
+    bool removeConnection(uint32_t u, uint32_t v) {
+        size_t before = edges.size();
+        edges.erase(remove_if(edges.begin(), edges.end(), [&](const Connection& c) {
+            return (c.u == u && c.v == v) || (c.u == v && c.v == u);
+        }), edges.end());
+        return edges.size() != before;
+    }
+
+    // Removes a station and its connections; later IDs shift down by one
+    bool removeStation(uint32_t id) {
+        if (id >= names.size()) return false;
+
+        edges.erase(remove_if(edges.begin(), edges.end(), [&](const Connection& c) {
+            return c.u == id || c.v == id;
+        }), edges.end());
+        for (auto& c : edges) {
+            if (c.u > id) c.u--;
+            if (c.v > id) c.v--;
+        }
+
+        ids.erase(names[id]);
+        names.erase(names.begin() + id);
+        for (uint32_t i = id; i < names.size(); i++) {
+            ids[names[i]] = i;
+        }
+        return true;
+    }
+
+    /**
+     * Freezes the stations and connections into CSR arrays.
+     * Self loops are dropped and, as with the old addEdge, the first
+     * connection added between two stations wins over later duplicates.
+     */
+    FrozenGraph freeze() const {
+        FrozenGraph g;
+        g.stations = make_shared<StationIndex>(names, ids);
+        g.lineNames = lineNames;
+
+        // Normalise to u < v and dedup with one stable sort
+        vector<Connection> sorted;
+        sorted.reserve(edges.size());
+        for (const auto& c : edges) {
+            if (c.u == c.v) continue;
+            sorted.push_back({min(c.u, c.v), max(c.u, c.v), c.km});
+        }
+        stable_sort(sorted.begin(), sorted.end(), [](const Connection& a, const Connection& b) {
+            return a.u != b.u ? a.u < b.u : a.v < b.v;
+        });
+        sorted.erase(unique(sorted.begin(), sorted.end(), [](const Connection& a, const Connection& b) {
+            return a.u == b.u && a.v == b.v;
+        }), sorted.end());
+
+        uint32_t n = names.size();
+        g.offsets.assign(n + 1, 0);
+        for (const auto& c : sorted) {
+            g.offsets[c.u + 1]++;
+            g.offsets[c.v + 1]++;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            g.offsets[i + 1] += g.offsets[i];
+        }
 
-            pq.push(np);
-            map[station.first] = np;
+        // Filling in sorted edge order leaves every adjacency list sorted by target
+        g.targets.resize(sorted.size() * 2);
+        g.weights.resize(sorted.size() * 2);
+        vector<uint32_t> pos(g.offsets.begin(), g.offsets.end() - 1);
+        for (const auto& c : sorted) {
+            g.targets[pos[c.u]] = c.v;
+            g.weights[pos[c.u]++] = c.km;
+            g.targets[pos[c.v]] = c.u;
+            g.weights[pos[c.v]++] = c.km;
         }
 
-        while (!pq.empty()) {
-            DijkstraPair rp = pq.top();
-            pq.pop();
+        g.lineMask.resize(n);
+        for (uint32_t i = 0; i < n; i++) {
+            g.lineMask[i] = FrozenGraph::parseLineMask(names[i]);
+        }
+        labelComponents(g);
+        return g;
+    }
 
-            if (rp.vname == des) {
-                return rp.cost;
+    /**
+     * Returns base with some connections added or removed, as freeze()
+     * would after the same edits to a builder: edits apply in order, a
+     * negative km removes a connection and adding an existing one keeps
+     * the first. The station index is shared with base and only the
+     * adjacency lists of stations named in edits are rebuilt.
+     */
+    static FrozenGraph patch(const FrozenGraph& base, const vector<Connection>& edits) {
+        // Final length of every edited pair, -1 if absent
+        map<pair<uint32_t, uint32_t>, int> pairs;
+        for (const Connection& c : edits) {
+            if (c.u == c.v) continue;
+            pair<uint32_t, uint32_t> key(min(c.u, c.v), max(c.u, c.v));
+            auto it = pairs.find(key);
+            if (it == pairs.end()) it = pairs.emplace(key, base.edgeWeight(key.first, key.second)).first;
+            if (c.km < 0) {
+                it->second = -1;
+            } else if (it->second < 0) {
+                it->second = c.km;
             }
+        }
+
+        // Changes per station, sorted by neighbour since pairs is ordered
+        uint32_t n = base.numStations();
+        map<uint32_t, vector<pair<uint32_t, int>>> changes;
+        bool topology = false;
+        for (const auto& p : pairs) {
+            int before = base.edgeWeight(p.first.first, p.first.second);
+            if (before == p.second) continue;
+            topology = topology || before < 0 || p.second < 0;
+            changes[p.first.first].push_back({p.first.second, p.second});
+            changes[p.first.second].push_back({p.first.first, p.second});
+        }
+        for (auto& c : changes) {
+            sort(c.second.begin(), c.second.end());
+        }
 
-            if (map.count(rp.vname) == 0) continue;
-            map.erase(rp.vname);
+        FrozenGraph g;
+        g.stations = base.stations;
+        g.lineNames = base.lineNames;
+        g.lineMask = base.lineMask;
+        g.offsets.resize(n + 1);
+        g.offsets[0] = 0;
+        auto next = changes.begin();
+        for (uint32_t u = 0; u < n; u++) {
+            uint32_t degree = base.offsets[u + 1] - base.offsets[u];
+            if (next != changes.end() && next->first == u) {
+                for (const pair<uint32_t, int>& c : next->second) {
+                    bool had = base.edgeWeight(u, c.first) >= 0;
+                    degree += (c.second >= 0) - had;
+                }
+                ++next;
+            }
+            g.offsets[u + 1] = g.offsets[u] + degree;
+        }
 
-            Vertex v = vtces[rp.vname];
-            for (auto& neighbour : v.neighbours) {
-                string nbr = neighbour.first;
-                if (map.count(nbr)) {
-                    int oc = map[nbr].cost;
-                    int nc;
-                    
-                    // Calculate new cost based on distance or time
-                    if (nan) {
-                        // Time calculation: 2 minutes per km + 2 minutes per station
-                        nc = rp.cost + 120 + 40 * v.neighbours[nbr];
-                    } else {
-                        // Distance calculation
-                        nc = rp.cost + v.neighbours[nbr];
+        g.targets.resize(g.offsets[n]);
+        g.weights.resize(g.offsets[n]);
+        next = changes.begin();
+        for (uint32_t u = 0; u < n; u++) {
+            uint32_t from = base.offsets[u], to = base.offsets[u + 1], at = g.offsets[u];
+            if (next == changes.end() || next->first != u) {
+                copy(base.targets.begin() + from, base.targets.begin() + to, g.targets.begin() + at);
+                copy(base.weights.begin() + from, base.weights.begin() + to, g.weights.begin() + at);
+                continue;
+            }
+            // Merge the old list with the changes, both sorted by neighbour
+            const vector<pair<uint32_t, int>>& ch = next->second;
+            size_t k = 0;
+            for (uint32_t e = from; e < to || k < ch.size();) {
+                if (k < ch.size() && (e == to || ch[k].first <= base.targets[e])) {
+                    if (e < to && ch[k].first == base.targets[e]) e++;
+                    if (ch[k].second >= 0) {
+                        g.targets[at] = ch[k].first;
+                        g.weights[at++] = ch[k].second;
                     }
+                    k++;
+                } else {
+                    g.targets[at] = base.targets[e];
+                    g.weights[at++] = base.weights[e];
+                    e++;
+                }
+            }
+            ++next;
+        }
+
+        if (topology) {
+            labelComponents(g);
+        } else {
+            g.component = base.component;
+        }
+        return g;
+    }
 
-                    if (nc < oc) {
-                        DijkstraPair& gp = map[nbr];
-                        gp.psf = rp.psf + " " + nbr;
-                        gp.cost = nc;
-                        pq.push(gp);
+    // Labels connected components once so reachability is a comparison
+    static void labelComponents(FrozenGraph& g) {
+        uint32_t n = g.numStations();
+        g.component.assign(n, NO_STATION);
+        vector<uint32_t> st;
+        for (uint32_t root = 0; root < n; root++) {
+            if (g.component[root] != NO_STATION) continue;
+            g.component[root] = root;
+            st.push_back(root);
+            while (!st.empty()) {
+                uint32_t u = st.back();
+                st.pop_back();
+                for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                    if (g.component[g.targets[e]] == NO_STATION) {
+                        g.component[g.targets[e]] = root;
+                        st.push_back(g.targets[e]);
                     }
                 }
             }
         }
-        return INT_MAX;
+    }
+};
+
+/**
+ * Cost policies for the search engine. Each one maps the distance of a
+ * connection (km) to the cost of travelling it, so that every metric
+ * compiles to its own branch-free search loop.
+ */
+class DistanceCost {
+public:
+    static int edge(int km) {
+        return km;
+    }
+};
+
+class TimeCost {
+public:
+    // 2 minutes per station + 40 seconds per km, in seconds
+    static int edge(int km) {
+        return 120 + 40 * km;
+    }
+};
+
+// Returns the cost of every CSR edge of g under a cost policy
+template <class Cost>
+vector<int> edgeCosts(const FrozenGraph& g) {
+    vector<int> cost(g.weights.size());
+    for (size_t e = 0; e < cost.size(); e++) {
+        cost[e] = Cost::edge(g.weights[e]);
+    }
+    return cost;
+}
+
+// Hooks for QueryStats; compiled out unless built with -DDELHIMETRO_STATS
+#ifdef DELHIMETRO_STATS
+#define QUERY_STATS(...) __VA_ARGS__
+#else
+#define QUERY_STATS(...)
+#endif
+
+/**
+ * QueryStats collects per-query counters and latency histograms from the
+ * search loops when built with -DDELHIMETRO_STATS. Each thread records
+ * into its own counters with relaxed atomic stores and no lock, and
+ * snapshot() merges every thread's counters into one view.
+ * Latencies go into log-linear buckets, 16 per power of two (about 6%
+ * resolution), like an HDR histogram.
+ */
+class QueryStats {
+public:
+    static constexpr int SUB_BUCKETS = 16;
+    static constexpr int BUCKETS = 64 * SUB_BUCKETS;
+    static constexpr size_t SLOWEST = 8;    // Slowest queries kept per thread
+
+    enum Counter {
+        QUERIES, HEAP_PUSHES, DECREASE_KEYS, HEAP_POPS, RELAXATIONS, SETTLED, CONNECTIONS_SCANNED,
+        LABELS, LABELS_DOMINATED, LABELS_PRUNED, ALLOCATIONS, BYTES_ALLOCATED, WALL_NS, NUM_COUNTERS
+    };
+
+    static const char* counterName(int c) {
+        static const char* names[NUM_COUNTERS] = {
+            "queries", "heap_pushes", "decrease_keys", "heap_pops", "relaxations", "settled", "connections_scanned",
+            "labels", "labels_dominated", "labels_pruned", "allocations", "bytes_allocated", "wall_ns"
+        };
+        return names[c];
     }
 
     /**
-     * Pair class used for path finding algorithms
-     * to store path information.
+     * SlowQuery class identifies one slow query so it can be traced back
+     * to a part of the network.
      */
-    class Pair {
+    class SlowQuery {
     public:
-        string vname;       // Station name
-        string psf;         // Path so far
-        int min_dis;        // Minimum distance
-        int min_time;       // Minimum time
+        uint64_t ns;
+        uint32_t src, dst;
+        uint64_t settled;
     };
 
     /**
-     * Finds the path with minimum distance between two stations
-     * using a stack-based DFS approach.
+     * ThreadStats class holds one thread's counters. Only the owning
+     * thread writes them; the slowest list has its own lock, taken only
+     * by queries slower than every query already in it.
      */
-    string Get_Minimum_Distance(string src, string dst) {
-        int min = INT_MAX;
-        string ans = "";
-        unordered_map<string, bool> processed;
-        stack<Pair> st;
+    class ThreadStats {
+    public:
+        atomic<uint64_t> counters[NUM_COUNTERS] = {};
+        atomic<uint64_t> histogram[BUCKETS] = {};
+        atomic<uint64_t> slowThreshold{0};
+        mutex slowLock;
+        vector<SlowQuery> slowest;
 
-        // Initialize with source station
-        Pair sp;
-        sp.vname = src;
-        sp.psf = src + "  ";
-        sp.min_dis = 0;
-        sp.min_time = 0;
-        st.push(sp);
+        void add(int c, uint64_t v) {
+            counters[c].store(counters[c].load(memory_order_relaxed) + v, memory_order_relaxed);
+        }
 
-        while (!st.empty()) {
-            Pair rp = st.top();
-            st.pop();
+        void record(uint64_t ns, uint32_t src, uint32_t dst, uint64_t settled) {
+            atomic<uint64_t>& b = histogram[bucket(ns)];
+            b.store(b.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            if (ns <= slowThreshold.load(memory_order_relaxed)) return;
 
-            if (processed.count(rp.vname)) continue;
-            processed[rp.vname] = true;
+            lock_guard<mutex> lock(slowLock);
+            slowest.push_back({ns, src, dst, settled});
+            sort(slowest.begin(), slowest.end(), [](const SlowQuery& a, const SlowQuery& b) {
+                return a.ns > b.ns;
+            });
+            if (slowest.size() > SLOWEST) slowest.pop_back();
+            if (slowest.size() == SLOWEST) slowThreshold.store(slowest.back().ns, memory_order_relaxed);
+        }
+    };
 
-            // If destination reached, check if it's the shortest path
-            if (rp.vname == dst) {
-                if (rp.min_dis < min) {
-                    ans = rp.psf;
-                    min = rp.min_dis;
-                }
-                continue;
+    /**
+     * Snapshot class is a merged copy of every thread's counters.
+     */
+    class Snapshot {
+    public:
+        uint64_t counters[NUM_COUNTERS] = {};
+        vector<uint64_t> histogram = vector<uint64_t>(BUCKETS);
+        vector<SlowQuery> slowest;
+
+        // Returns the latency in ns below which a fraction p of queries fall
+        uint64_t percentile(double p) const {
+            uint64_t total = 0;
+            for (uint64_t c : histogram) total += c;
+            uint64_t rank = (uint64_t)ceil(p * total), seen = 0;
+            for (int b = 0; b < BUCKETS; b++) {
+                seen += histogram[b];
+                if (seen >= rank && seen > 0) return bucketValue(b + 1) - 1;
             }
+            return 0;
+        }
+    };
 
-            Vertex rpvtx = vtces[rp.vname];
-            for (auto& neighbour : rpvtx.neighbours) {
-                string nbr = neighbour.first;
-                if (!processed.count(nbr)) {
-                    Pair np;
-                    np.vname = nbr;
-                    np.psf = rp.psf + nbr + "  ";
-                    np.min_dis = rp.min_dis + rpvtx.neighbours[nbr];
-                    st.push(np);
-                }
+    // Returns the calling thread's counters, registering them on first use
+    static ThreadStats& local() {
+        thread_local ThreadStats* mine = nullptr;
+        if (!mine) {
+            lock_guard<mutex> lock(registryLock());
+            registry().emplace_back(new ThreadStats());
+            mine = registry().back().get();
+        }
+        return *mine;
+    }
+
+    // Merges the counters of every thread that has recorded a query
+    static Snapshot snapshot() {
+        Snapshot snap;
+        lock_guard<mutex> lock(registryLock());
+        for (const auto& t : registry()) {
+            for (int c = 0; c < NUM_COUNTERS; c++) {
+                snap.counters[c] += t->counters[c].load(memory_order_relaxed);
             }
+            for (int b = 0; b < BUCKETS; b++) {
+                snap.histogram[b] += t->histogram[b].load(memory_order_relaxed);
+            }
+            lock_guard<mutex> slow(t->slowLock);
+            snap.slowest.insert(snap.slowest.end(), t->slowest.begin(), t->slowest.end());
         }
-        ans = ans + to_string(min);
-        return ans;
+        sort(snap.slowest.begin(), snap.slowest.end(), [](const SlowQuery& a, const SlowQuery& b) {
+            return a.ns > b.ns;
+        });
+        if (snap.slowest.size() > SLOWEST) snap.slowest.resize(SLOWEST);
+        return snap;
+    }
+
+    // Returns the histogram bucket of a latency
+    static int bucket(uint64_t ns) {
+        if (ns < SUB_BUCKETS) return ns;
+        int e = 63 - __builtin_clzll(ns);
+        return (e - 3) * SUB_BUCKETS + ((ns >> (e - 4)) & (SUB_BUCKETS - 1));
+    }
+
+    // Returns the smallest latency that falls in bucket b
+    static uint64_t bucketValue(int b) {
+        if (b < SUB_BUCKETS) return b;
+        int e = b / SUB_BUCKETS + 3;
+        if (e > 63) return UINT64_MAX;
+        return (uint64_t)(SUB_BUCKETS + b % SUB_BUCKETS) << (e - 4);
     }
 
     /**
-     * Finds the path with minimum time between two stations
-     * using a stack-based DFS approach.
+     * Scope class times one query from construction to destruction and
+     * records it with the allocations made meanwhile. Nested scopes on the
+     * same thread count once, at the outermost.
      */
-    string Get_Minimum_Time(string src, string dst) {
-        int min = INT_MAX;
-        string ans = "";
-        unordered_map<string, bool> processed;
-        stack<Pair> st;
+    class Scope {
+    public:
+        Scope(uint32_t src, uint32_t dst) : src(src), dst(dst) {
+            if (depth()++ > 0) return;
+            ThreadStats& t = local();
+            settled = t.counters[SETTLED].load(memory_order_relaxed);
+            allocations = AllocationCounter::count;
+            bytes = AllocationCounter::bytes;
+            start = chrono::steady_clock::now();
+        }
+
+        ~Scope() {
+            if (--depth() > 0) return;
+            uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            ThreadStats& t = local();
+            t.add(QUERIES, 1);
+            t.add(WALL_NS, ns);
+            t.add(ALLOCATIONS, AllocationCounter::count - allocations);
+            t.add(BYTES_ALLOCATED, AllocationCounter::bytes - bytes);
+            t.record(ns, src, dst, t.counters[SETTLED].load(memory_order_relaxed) - settled);
+        }
+
+    private:
+        uint32_t src, dst;
+        uint64_t settled = 0, allocations = 0, bytes = 0;
+        chrono::steady_clock::time_point start;
 
-        // Initialize with source station
-        Pair sp;
-        sp.vname = src;
-        sp.psf = src + "  ";
-        sp.min_dis = 0;
-        sp.min_time = 0;
-        st.push(sp);
+        static int& depth() {
+            thread_local int d = 0;
+            return d;
+        }
+    };
+
+    // Writes a human-readable summary of a snapshot
+    static void printText(ostream& out, const Snapshot& snap, const FrozenGraph& g) {
+        uint64_t queries = max<uint64_t>(1, snap.counters[QUERIES]);
+        out << "Query statistics\n";
+        for (int c = 0; c < NUM_COUNTERS; c++) {
+            out << "  " << left << setw(16) << counterName(c) << right << setw(14) << snap.counters[c];
+            if (c != QUERIES) out << "  (" << (double)snap.counters[c] / queries << " per query)";
+            out << "\n";
+        }
+        out << "  latency ns       p50 " << snap.percentile(0.5) << "  p90 " << snap.percentile(0.9)
+            << "  p99 " << snap.percentile(0.99) << "  p99.9 " << snap.percentile(0.999)
+            << "  max " << snap.percentile(1.0) << "\n";
+        out << "  slowest queries\n";
+        for (const SlowQuery& q : snap.slowest) {
+            out << "    " << q.ns << " ns  " << stationName(g, q.src) << " -> " << stationName(g, q.dst)
+                << "  (" << q.settled << " settled)\n";
+        }
+    }
+
+    // Writes a snapshot as one JSON object
+    static void printJson(ostream& out, const Snapshot& snap, const FrozenGraph& g) {
+        out << "{\"counters\": {";
+        for (int c = 0; c < NUM_COUNTERS; c++) {
+            out << (c ? ", " : "") << '"' << counterName(c) << "\": " << snap.counters[c];
+        }
+        out << "}, \"latency_ns\": {\"p50\": " << snap.percentile(0.5) << ", \"p90\": " << snap.percentile(0.9)
+            << ", \"p99\": " << snap.percentile(0.99) << ", \"p999\": " << snap.percentile(0.999)
+            << ", \"max\": " << snap.percentile(1.0) << "}, \"histogram\": [";
+        bool first = true;
+        for (int b = 0; b < BUCKETS; b++) {
+            if (!snap.histogram[b]) continue;
+            out << (first ? "" : ", ") << '[' << bucketValue(b) << ", " << snap.histogram[b] << ']';
+            first = false;
+        }
+        out << "], \"slowest\": [";
+        for (size_t i = 0; i < snap.slowest.size(); i++) {
+            const SlowQuery& q = snap.slowest[i];
+            out << (i ? ", " : "") << "{\"ns\": " << q.ns << ", \"source\": \"" << stationName(g, q.src)
+                << "\", \"destination\": \"" << stationName(g, q.dst) << "\", \"settled\": " << q.settled << '}';
+        }
+        out << "]}\n";
+    }
+
+private:
+    static vector<unique_ptr<ThreadStats>>& registry() {
+        static vector<unique_ptr<ThreadStats>> threads;
+        return threads;
+    }
+
+    static mutex& registryLock() {
+        static mutex m;
+        return m;
+    }
+
+    static string stationName(const FrozenGraph& g, uint32_t id) {
+        return id < g.numStations() ? g.name(id) : "-";
+    }
+};
+
+/**
+ * IndexedHeap is a 4-ary min-heap of station IDs keyed by cost, with a
+ * position index so that a station's key can be decreased in place
+ * instead of pushing a duplicate entry.
+ */
+class IndexedHeap {
+public:
+    /**
+     * Entry class stores a station and its key next to each other so
+     * that sifting only touches the heap array.
+     */
+    class Entry {
+    public:
+        int key;
+        uint32_t id;
+    };
+
+    vector<Entry> heap;
+    vector<uint32_t> pos;   // Station ID -> index in heap, or NO_STATION
+
+    // Makes room for n stations; must be called before use
+    void resize(uint32_t n) {
+        heap.reserve(n);
+        pos.assign(n, NO_STATION);
+    }
+
+    bool empty() const {
+        return heap.empty();
+    }
+
+    // Returns the smallest key; the heap must not be empty
+    int topKey() const {
+        return heap[0].key;
+    }
+
+    bool contains(uint32_t id) const {
+        return pos[id] != NO_STATION;
+    }
+
+    // Inserts a station, or lowers its key if it is already queued
+    void pushOrDecrease(uint32_t id, int key) {
+        uint32_t i = pos[id];
+        if (i == NO_STATION) {
+            i = heap.size();
+            heap.push_back({key, id});
+        } else {
+            heap[i].key = key;
+        }
+        siftUp(i);
+    }
+
+    // Removes and returns the entry with the smallest key
+    Entry pop() {
+        Entry top = heap[0];
+        pos[top.id] = NO_STATION;
+        Entry last = heap.back();
+        heap.pop_back();
+        if (!heap.empty()) {
+            heap[0] = last;
+            siftDown(0);
+        }
+        return top;
+    }
+
+    // Empties the heap in O(size)
+    void clear() {
+        for (const auto& e : heap) {
+            pos[e.id] = NO_STATION;
+        }
+        heap.clear();
+    }
+
+private:
+    void siftUp(uint32_t i) {
+        Entry e = heap[i];
+        while (i > 0) {
+            uint32_t p = (i - 1) / 4;
+            if (heap[p].key <= e.key) break;
+            heap[i] = heap[p];
+            pos[heap[i].id] = i;
+            i = p;
+        }
+        heap[i] = e;
+        pos[e.id] = i;
+    }
+
+    void siftDown(uint32_t i) {
+        Entry e = heap[i];
+        uint32_t n = heap.size();
+        while (true) {
+            uint32_t c = 4 * i + 1;
+            if (c >= n) break;
+            uint32_t best = c;
+            uint32_t end = min(c + 4, n);
+            for (uint32_t j = c + 1; j < end; j++) {
+                if (heap[j].key < heap[best].key) best = j;
+            }
+            if (heap[best].key >= e.key) break;
+            heap[i] = heap[best];
+            pos[heap[i].id] = i;
+            i = best;
+        }
+        heap[i] = e;
+        pos[e.id] = i;
+    }
+};
+
+/**
+ * SearchScratch holds the per-search arrays of the Dijkstra engine.
+ * It is sized once per graph and reset in O(stations touched), so one
+ * scratch can serve any number of queries on the same thread.
+ */
+class SearchScratch {
+public:
+    vector<int> dist;           // Best known cost, INT_MAX if unreached
+    vector<uint32_t> parent;    // Predecessor on the best path, NO_STATION at the source
+    vector<uint32_t> touched;   // Stations whose dist/parent were written
+    IndexedHeap heap;
+    uint32_t settled = 0;       // Stations settled by the last search
+
+    // Sizes the arrays for a graph with n stations
+    void prepare(uint32_t n) {
+        if (dist.size() != n) {
+            dist.assign(n, INT_MAX);
+            parent.assign(n, NO_STATION);
+            heap.resize(n);
+            touched.clear();
+            return;
+        }
+        for (uint32_t id : touched) {
+            dist[id] = INT_MAX;
+            parent[id] = NO_STATION;
+        }
+        touched.clear();
+        heap.clear();
+    }
+};
+
+/**
+ * DijkstraEngine runs shortest path searches on a FrozenGraph.
+ * The search keeps only distance and predecessor arrays; the path is
+ * rebuilt once at the end by following parent pointers.
+ */
+class DijkstraEngine {
+public:
+    /**
+     * Runs Dijkstra's algorithm from src, stopping once des is settled.
+     * @param des Target station, or NO_STATION to build the full tree
+     * @return Cost to des, or INT_MAX if unreachable (0 when des is NO_STATION)
+     */
+    template <class Cost>
+    static int run(const FrozenGraph& g, uint32_t src, uint32_t des, SearchScratch& s) {
+        const int* weights = g.weights.data();
+        return search(g, src, des, s, [weights](uint32_t e) {
+            return Cost::edge(weights[e]);
+        });
+    }
+
+    // Same search with an explicit cost for every CSR edge
+    static int runCosts(const FrozenGraph& g, const int* cost, uint32_t src, uint32_t des,
+                        SearchScratch& s) {
+        return search(g, src, des, s, [cost](uint32_t e) {
+            return cost[e];
+        });
+    }
+
+    /**
+     * The point-to-point search shared by run and runCosts; edgeCost(e)
+     * returns the cost of CSR edge e and is inlined into each instantiation.
+     */
+    template <class EdgeCost>
+    static int search(const FrozenGraph& g, uint32_t src, uint32_t des, SearchScratch& s,
+                      EdgeCost edgeCost) {
+        int result = des == NO_STATION ? 0 : INT_MAX;
+        explore(g, src, INT_MAX, s, edgeCost, [des, &result](uint32_t id, int key) {
+            if (id != des) return true;
+            result = key;
+            return false;
+        });
+        return result;
+    }
+
+    /**
+     * The search loop itself. Stations are settled in order of cost up to
+     * and including bound; settle(id, cost) is called for each before its
+     * edges are relaxed, and returning false ends the search there.
+     */
+    template <class EdgeCost, class Settle>
+    static void explore(const FrozenGraph& g, uint32_t src, int bound, SearchScratch& s,
+                        EdgeCost edgeCost, Settle settle) {
+        s.prepare(g.numStations());
+        s.settled = 0;
+        s.dist[src] = 0;
+        s.touched.push_back(src);
+        s.heap.pushOrDecrease(src, 0);
+
+        const uint32_t* offsets = g.offsets.data();
+        const uint32_t* targets = g.targets.data();
+        QUERY_STATS(uint64_t pushes = 1, decreases = 0, relaxations = 0;)
+
+        while (!s.heap.empty() && s.heap.topKey() <= bound) {
+            IndexedHeap::Entry rp = s.heap.pop();
+            s.settled++;
+            if (!settle(rp.id, rp.key)) break;
+
+            for (uint32_t e = offsets[rp.id]; e < offsets[rp.id + 1]; e++) {
+                uint32_t nbr = targets[e];
+                int c = edgeCost(e);
+                if (c == CLOSED_EDGE) continue;
+                QUERY_STATS(relaxations++;)
+                int nc = rp.key + c;
+                if (nc < s.dist[nbr]) {
+                    if (s.dist[nbr] == INT_MAX) {
+                        s.touched.push_back(nbr);
+                        QUERY_STATS(pushes++;)
+                    } else {
+                        QUERY_STATS(decreases++;)
+                    }
+                    s.dist[nbr] = nc;
+                    s.parent[nbr] = rp.id;
+                    s.heap.pushOrDecrease(nbr, nc);
+                }
+            }
+        }
+
+        QUERY_STATS(
+            QueryStats::ThreadStats& stats = QueryStats::local();
+            stats.add(QueryStats::HEAP_PUSHES, pushes);
+            stats.add(QueryStats::DECREASE_KEYS, decreases);
+            stats.add(QueryStats::HEAP_POPS, s.settled);
+            stats.add(QueryStats::RELAXATIONS, relaxations);
+            stats.add(QueryStats::SETTLED, s.settled);
+        )
+    }
+
+    // Returns the station IDs from the search source to des, empty if unreached
+    static vector<uint32_t> path(const SearchScratch& s, uint32_t des) {
+        vector<uint32_t> ids;
+        path(s, des, ids);
+        return ids;
+    }
+
+    // Same, written into ids so its storage can be reused
+    static void path(const SearchScratch& s, uint32_t des, vector<uint32_t>& ids) {
+        ids.clear();
+        if (s.dist[des] == INT_MAX) return;
+        for (uint32_t v = des; v != NO_STATION; v = s.parent[v]) {
+            ids.push_back(v);
+        }
+        reverse(ids.begin(), ids.end());
+    }
+};
+
+/**
+ * RouteLeg class is one ride on a single line within a route.
+ */
+class RouteLeg {
+public:
+    char line;          // Line letter, as in the ~B / ~Y name suffixes
+    uint32_t board;     // Station ID where the leg starts
+    uint32_t alight;    // Station ID where the leg ends
+    uint32_t stops;     // Number of stations ridden
+    int depart = -1;    // Seconds after midnight, only from timetable routing
+    int arrive = -1;
+};
+
+/**
+ * RouteResult class holds the structured answer to one route query:
+ * both totals, the ordered stations, where the line changes and the fare.
+ */
+class RouteResult {
+public:
+    bool found = false;
+    int distance = 0;                   // Total distance in km
+    int time = 0;                       // Total time in seconds
+    vector<uint32_t> stations;          // Station IDs from source to destination
+    vector<uint32_t> interchanges;      // Indices i where stations[i] ==> stations[i + 1],
+                                        // or where the line changes when legs is set
+    vector<RouteLeg> legs;              // Rides per line, only from line-aware routing
+    int fare = 0;                       // Fare in Rs.
+
+    // Returns the number of stations used for the fare
+    int numStations() const {
+        return stations.size();
+    }
+
+    // Calculates the fare based on number of stations traveled
+    static int fareForStations(int stations) {
+        if (stations <= 3) return 10;
+        if (stations <= 7) return 20;
+        if (stations <= 11) return 30;
+        if (stations <= 20) return 40;
+        return 40 + (stations - 20) * 10;
+    }
+
+    /**
+     * Fills the totals, interchanges and fare from a station sequence.
+     * A station on two lines is an interchange when the lines of the
+     * stations before and after it differ; the next station is then the
+     * other half of the interchange and is not checked itself.
+     */
+    void fill(const FrozenGraph& g, vector<uint32_t> path) {
+        stations = std::move(path);
+        fill(g);
+    }
+
+    // Same, for a station sequence already in stations; reuses the buffers
+    void fill(const FrozenGraph& g) {
+        found = !stations.empty();
+        distance = 0;
+        time = 0;
+        interchanges.clear();
+        legs.clear();
+
+        for (size_t i = 1; i < stations.size(); i++) {
+            int km = g.edgeWeight(stations[i - 1], stations[i]);
+            distance += DistanceCost::edge(km);
+            time += TimeCost::edge(km);
+        }
+
+        for (size_t i = 1; i + 1 < stations.size(); i++) {
+            if (g.isInterchange(stations[i]) &&
+                g.lineMask[stations[i - 1]] != g.lineMask[stations[i + 1]]) {
+                interchanges.push_back(i);
+                i++;
+            }
+        }
+
+        fare = found ? fareForStations(numStations()) : 0;
+    }
+};
+
+/**
+ * Isochrone answers one-to-all questions, such as every station within
+ * 30 minutes of a source, with a single bounded search. Stations are
+ * streamed in order of the chosen metric as they are settled, each with
+ * the distance, time, interchanges and fare of its best route, which are
+ * carried along the search tree instead of rebuilt per destination.
+ */
+class Isochrone {
+public:
+    enum Metric { DISTANCE, TIME, FARE };
+
+    /**
+     * Reach class holds the totals of the best route to one station, the
+     * same values RouteResult::fill gives for that route.
+     */
+    class Reach {
+    public:
+        uint32_t station;
+        int distance;               // Total distance in km
+        int time;                   // Total time in seconds
+        int stations;               // Stations on the route, both ends included
+        int interchanges;
+        int fare;                   // Fare in Rs.
+        bool changed;               // The station before this one was counted as an interchange
+    };
+
+    /**
+     * Searches from src and calls visit(const Reach&) for every station
+     * whose metric is within budget, the source first and the rest in
+     * order of the metric; visit returns false to stop early. A FARE
+     * budget is in Rs. and the search minimises stations. Routes can be
+     * rebuilt with DijkstraEngine::path(s, station) until s is reused.
+     * @param reach Per-station storage, resized to the graph as needed
+     * @return Number of stations visited
+     */
+    template <class Visit>
+    static uint32_t run(const FrozenGraph& g, uint32_t src, Metric metric, int budget,
+                        SearchScratch& s, vector<Reach>& reach, Visit visit) {
+        reach.resize(g.numStations());
+        uint32_t visited = 0;
+        auto settle = [&](uint32_t id, int) {
+            Reach& r = reach[id];
+            r.station = id;
+            uint32_t p = s.parent[id];
+            if (p == NO_STATION) {
+                r.distance = r.time = r.interchanges = 0;
+                r.stations = 1;
+                r.changed = false;
+            } else {
+                const Reach& pr = reach[p];
+                int km = g.edgeWeight(p, id);
+                r.distance = pr.distance + DistanceCost::edge(km);
+                r.time = pr.time + TimeCost::edge(km);
+                r.stations = pr.stations + 1;
+                r.interchanges = pr.interchanges;
+
+                // p is an interchange of this route when the lines either side of it differ
+                r.changed = pr.stations > 1 && !pr.changed && g.isInterchange(p) &&
+                            g.lineMask[s.parent[p]] != g.lineMask[id];
+                r.interchanges += r.changed;
+            }
+            r.fare = RouteResult::fareForStations(r.stations);
+            visited++;
+            return visit(r);
+        };
+
+        const int* weights = g.weights.data();
+        if (metric == DISTANCE) {
+            DijkstraEngine::explore(g, src, budget, s, [weights](uint32_t e) {
+                return DistanceCost::edge(weights[e]);
+            }, settle);
+        } else if (metric == TIME) {
+            DijkstraEngine::explore(g, src, budget, s, [weights](uint32_t e) {
+                return TimeCost::edge(weights[e]);
+            }, settle);
+        } else {
+            // The fare only grows with the stations, so the budget becomes a hop limit
+            int stations = 0;
+            while (stations < (int)g.numStations() && RouteResult::fareForStations(stations + 1) <= budget) {
+                stations++;
+            }
+            if (stations == 0) return 0;
+            DijkstraEngine::explore(g, src, stations - 1, s, [](uint32_t) {
+                return 1;
+            }, settle);
+        }
+        return visited;
+    }
+};
+
+/**
+ * Arena is a monotonic allocator for per-query output. Allocation bumps
+ * an offset into one block and reset() frees everything at once. A query
+ * that overflows the block gets its overflow from the heap, and the block
+ * grows at the next reset to cover it, so a steady stream of queries
+ * stops allocating after warmup.
+ */
+class Arena {
+public:
+    // Returns uninitialised room for n values of T, valid until reset()
+    template <class T>
+    T* alloc(size_t n) {
+        static_assert(alignof(T) <= alignof(max_align_t), "arena blocks are max_align_t aligned");
+        size_t at = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+        size_t bytes = n * sizeof(T);
+        if (at + bytes <= block.size()) {
+            used = at + bytes;
+            return (T*)(block.data() + at);
+        }
+        overflowBytes += bytes + alignof(max_align_t);
+        overflow.emplace_back(bytes);
+        return (T*)overflow.back().data();
+    }
+
+    // Frees every allocation, growing the block if the last round overflowed it
+    void reset() {
+        if (!overflow.empty()) {
+            size_t need = used + overflowBytes;
+            overflow.clear();
+            block.assign(max<size_t>(2 * need, 4096), 0);
+            overflowBytes = 0;
+        }
+        used = 0;
+    }
+
+    // Returns the bytes handed out since the last reset
+    size_t size() const {
+        return used + overflowBytes;
+    }
+
+private:
+    vector<char> block;
+    size_t used = 0;
+    vector<vector<char>> overflow;
+    size_t overflowBytes = 0;
+};
+
+/**
+ * QueryContext holds everything one thread needs to answer route queries:
+ * search scratch sized once per graph and reset in O(stations touched),
+ * a result whose buffers are reused, and an arena for formatted output.
+ * After warmup a query through it makes no heap allocations.
+ */
+class QueryContext {
+public:
+    SearchScratch forward;      // Scratch of one-way searches and the forward half of two-way ones
+    SearchScratch backward;     // Backward half of bidirectional searches
+    RouteResult result;         // Answer of the last route() call
+    vector<Isochrone::Reach> reach;     // Per-station totals of the last one-to-all search
+    Arena arena;                // Output of the last query, freed by the next one
+
+    // Answers a Dijkstra route query into result, reusing its buffers
+    template <class Cost>
+    const RouteResult& route(const FrozenGraph& g, uint32_t src, uint32_t dst) {
+        arena.reset();
+        result.stations.clear();
+        if (g.connected(src, dst)) {
+            DijkstraEngine::run<Cost>(g, src, dst, forward);
+            DijkstraEngine::path(forward, dst, result.stations);
+        }
+        result.fill(g);
+        return result;
+    }
+
+    // Same, minimising time if nan is true and distance otherwise
+    const RouteResult& route(const FrozenGraph& g, uint32_t src, uint32_t dst, bool nan) {
+        return nan ? route<TimeCost>(g, src, dst) : route<DistanceCost>(g, src, dst);
+    }
+
+    // Formats the stations of result joined by two spaces, in the arena
+    string_view pathText(const FrozenGraph& g) {
+        size_t len = 0;
+        for (uint32_t id : result.stations) {
+            len += g.name(id).size() + 2;
+        }
+        char* text = arena.alloc<char>(len);
+        char* p = text;
+        for (uint32_t id : result.stations) {
+            const string& name = g.name(id);
+            memcpy(p, name.data(), name.size());
+            p += name.size();
+            *p++ = ' ';
+            *p++ = ' ';
+        }
+        return string_view(text, len);
+    }
+};
+
+/**
+ * BufferedWriter collects output in one large buffer and writes it to
+ * the file in big blocks, flushing only when full or when asked.
+ * Formatters can also append to data() directly and call endRecord()
+ * after each record, which is the only point where it writes.
+ */
+class BufferedWriter {
+public:
+    explicit BufferedWriter(FILE* out, size_t capacity = 1 << 20) : out(out), capacity(capacity) {
+        buf.reserve(capacity);
+    }
+
+    ~BufferedWriter() {
+        flush();
+    }
+
+    void write(const char* data, size_t len) {
+        if (buf.size() + len > capacity) drain();
+        if (len >= capacity) {
+            fwrite(data, 1, len, out);
+            return;
+        }
+        buf.append(data, len);
+    }
+
+    void write(const string& s) {
+        write(s.data(), s.size());
+    }
+
+    // The buffer to append a record to
+    string& data() {
+        return buf;
+    }
+
+    // Ends a record appended to data(), writing the buffer out once it is full
+    void endRecord() {
+        if (buf.size() >= capacity) drain();
+    }
+
+    void flush() {
+        drain();
+        fflush(out);
+    }
+
+private:
+    FILE* out;
+    size_t capacity;
+    string buf;
+
+    void drain() {
+        if (!buf.empty()) {
+            fwrite(buf.data(), 1, buf.size(), out);
+            buf.clear();
+        }
+    }
+};
+
+/**
+ * Renderer formats maps, station lists and route results, appending to a
+ * caller's buffer: a BufferedWriter's, or a batch chunk that is written
+ * later in order. Nothing is flushed per line. Formats:
+ *
+ *   TEXT    the menu's layout for maps and station lists, CSV rows for routes
+ *   JSONL   one JSON object per station or route
+ *   BINARY  a header (4-byte magic, version, station count, network
+ *           fingerprint) then fixed-layout records that refer to stations
+ *           by ID, in native byte order like the other binary files
+ *
+ * Binary records: a map station is its ID, name length, name, degree and
+ * (target ID, km) per connection; a station is its ID, name length and
+ * name; a route is source and destination IDs (NO_STATION if invalid),
+ * rank (0 if not ranked), a status byte and, if found, distance, time, interchanges, fare,
+ * station count and the station IDs.
+ */
+class Renderer {
+public:
+    enum Format { TEXT, JSONL, BINARY };
+    enum Status : uint8_t { FOUND, UNREACHABLE, INVALID };
+    static constexpr uint32_t VERSION = 1;
+
+    Format format;
+    bool ranked;    // Routes carry their rank among alternatives
+
+    explicit Renderer(Format format = TEXT, bool ranked = false) : format(format), ranked(ranked) {}
+
+    // Parses "text", "jsonl" or "binary"
+    static bool parseFormat(const string& name, Format& f) {
+        if (name == "text") f = TEXT;
+        else if (name == "jsonl") f = JSONL;
+        else if (name == "binary") f = BINARY;
+        else return false;
+        return true;
+    }
+
+    void mapHeader(string& out, const FrozenGraph& g) const {
+        if (format == TEXT) {
+            out += "\t Delhi Metro Map\n\t------------------\n----------------------------------------------------\n";
+        } else if (format == BINARY) {
+            header(out, "DMMP", g);
+        }
+    }
+
+    // One station of the map with its connections and their distances
+    void mapStation(string& out, const FrozenGraph& g, uint32_t u) const {
+        if (format == TEXT) {
+            out += g.name(u);
+            out += " =>\n";
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                const string& nbr = g.name(g.targets[e]);
+                out += '\t';
+                out += nbr;
+                out += '\t';
+                if (nbr.length() < 16) out += '\t';
+                if (nbr.length() < 8) out += '\t';
+                appendInt(out, g.weights[e]);
+                out += '\n';
+            }
+            out += '\n';
+        } else if (format == JSONL) {
+            out += "{\"id\":";
+            appendInt(out, u);
+            out += ",\"station\":";
+            appendJson(out, g.name(u));
+            out += ",\"connections\":[";
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                out += e == g.offsets[u] ? "{\"to\":" : ",{\"to\":";
+                appendJson(out, g.name(g.targets[e]));
+                out += ",\"km\":";
+                appendInt(out, g.weights[e]);
+                out += '}';
+            }
+            out += "]}\n";
+        } else {
+            appendRaw(out, u);
+            appendName(out, g.name(u));
+            appendRaw(out, g.offsets[u + 1] - g.offsets[u]);
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                appendRaw(out, g.targets[e]);
+                appendRaw(out, (int32_t)g.weights[e]);
+            }
+        }
+    }
+
+    void mapFooter(string& out) const {
+        if (format == TEXT) out += "\t------------------\n---------------------------------------------------\n";
+    }
+
+    void stationsHeader(string& out, const FrozenGraph& g) const {
+        if (format == TEXT) {
+            out += "\n***********************************************************************\n"
+                   "*                      STATIONS IN THE MAP                            *\n"
+                   "***********************************************************************\n";
+        } else if (format == BINARY) {
+            header(out, "DMST", g);
+        }
+    }
+
+    void station(string& out, const FrozenGraph& g, uint32_t u) const {
+        if (format == TEXT) {
+            appendInt(out, u + 1);
+            out += ". ";
+            out += g.name(u);
+            out += '\n';
+        } else if (format == JSONL) {
+            out += "{\"id\":";
+            appendInt(out, u);
+            out += ",\"station\":";
+            appendJson(out, g.name(u));
+            out += "}\n";
+        } else {
+            appendRaw(out, u);
+            appendName(out, g.name(u));
+        }
+    }
+
+    void stationsFooter(string& out) const {
+        if (format == TEXT) out += "***********************************************************************\n";
+    }
+
+    // The CSV header line, or the binary header; ranked results have a route column
+    void routesHeader(string& out, const FrozenGraph& g) const {
+        if (format == TEXT) {
+            out += ranked ? "source,destination,route,distance_km,time_s,stations,interchanges,fare\n"
+                          : "source,destination,distance_km,time_s,stations,interchanges,fare\n";
+        } else if (format == BINARY) {
+            header(out, "DMRT", g);
+        }
+    }
+
+    /**
+     * One route result with its totals and fare; JSON and binary also
+     * list its stations.
+     * @param src, dst The names as given, resolved to s and d
+     * @param rank Position among alternative routes from 1 when ranked
+     * @param r The route; only read when status is FOUND
+     */
+    void route(string& out, const FrozenGraph& g, const string& src, const string& dst, uint32_t s, uint32_t d,
+               uint32_t rank, Status status, const RouteResult& r) const {
+        if (format == TEXT) {
+            out += src;
+            out += ',';
+            out += dst;
+            if (status != FOUND) {
+                out += status == INVALID ? ",invalid,,,," : ",unreachable,,,,";
+                if (ranked) out += ',';
+                out += '\n';
+                return;
+            }
+            if (ranked) {
+                out += ',';
+                appendInt(out, rank);
+            }
+            for (int value : {r.distance, r.time, r.numStations(), (int)r.interchanges.size(), r.fare}) {
+                out += ',';
+                appendInt(out, value);
+            }
+            out += '\n';
+        } else if (format == JSONL) {
+            out += "{\"source\":";
+            appendJson(out, src);
+            out += ",\"destination\":";
+            appendJson(out, dst);
+            if (status != FOUND) {
+                out += status == INVALID ? ",\"status\":\"invalid\"}\n" : ",\"status\":\"unreachable\"}\n";
+                return;
+            }
+            out += ",\"status\":\"ok\"";
+            if (ranked) {
+                out += ",\"route\":";
+                appendInt(out, rank);
+            }
+            const char* keys[5] = {",\"distance_km\":", ",\"time_s\":", ",\"stations\":", ",\"interchanges\":", ",\"fare\":"};
+            int values[5] = {r.distance, r.time, r.numStations(), (int)r.interchanges.size(), r.fare};
+            for (int i = 0; i < 5; i++) {
+                out += keys[i];
+                appendInt(out, values[i]);
+            }
+            out += ",\"path\":[";
+            for (size_t i = 0; i < r.stations.size(); i++) {
+                if (i) out += ',';
+                appendJson(out, g.name(r.stations[i]));
+            }
+            out += "]}\n";
+        } else {
+            appendRaw(out, s);
+            appendRaw(out, d);
+            appendRaw(out, status == FOUND && ranked ? rank : 0u);
+            out += (char)status;
+            if (status != FOUND) return;
+            for (int value : {r.distance, r.time, (int)r.interchanges.size(), r.fare}) {
+                appendRaw(out, (int32_t)value);
+            }
+            appendRaw(out, (uint32_t)r.stations.size());
+            out.append((const char*)r.stations.data(), r.stations.size() * sizeof(uint32_t));
+        }
+    }
+
+private:
+    template <class T>
+    static void appendRaw(string& out, T v) {
+        out.append((const char*)&v, sizeof(T));
+    }
+
+    static void appendInt(string& out, long long v) {
+        char digits[24];
+        out.append(digits, to_chars(digits, digits + sizeof(digits), v).ptr);
+    }
+
+    static void appendName(string& out, const string& name) {
+        appendRaw(out, (uint32_t)name.size());
+        out += name;
+    }
+
+    // Appends a JSON string literal, escaping quotes, backslashes and control characters
+    static void appendJson(string& out, const string& s) {
+        out += '"';
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if ((unsigned char)c < 0x20) {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                out += esc;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    static void header(string& out, const char* magic, const FrozenGraph& g) {
+        out.append(magic, 4);
+        appendRaw(out, VERSION);
+        appendRaw(out, g.numStations());
+        appendRaw(out, g.fingerprint());
+    }
+};
+
+/**
+ * LineGraph is the state-expanded form of the network used for line-aware
+ * routing. Every station has one state per line it is on; riding a train
+ * moves between states of the same line, and changing line is an explicit
+ * move between two states of the same station that costs a penalty.
+ * Transfer moves are implied by the state ranges and are not stored.
+ */
+class LineGraph {
+public:
+    static constexpr char NO_LINE = '?';   // Line of a station whose name has no line suffix
+
+    vector<uint32_t> stateOffsets;  // States of station u are [stateOffsets[u], stateOffsets[u + 1])
+    vector<uint32_t> stateStation;  // State -> station ID
+    vector<char> stateLine;         // State -> line letter
+    vector<uint32_t> arcOffsets;    // Ride arcs of each state, CSR-style
+    vector<uint32_t> arcTargets;    // Target state of each ride arc
+    vector<int> arcKm;              // Distance of each ride arc
+
+    uint32_t numStates() const {
+        return stateStation.size();
+    }
+
+    /**
+     * Derives line membership from the station names and builds the state
+     * graph. A connection rides every line its two stations share; if they
+     * share none it joins all their states, as a ride on the next station's line.
+     */
+    static LineGraph build(const FrozenGraph& g) {
+        LineGraph lg;
+        uint32_t n = g.numStations();
+        lg.stateOffsets.assign(1, 0);
+        for (uint32_t u = 0; u < n; u++) {
+            uint32_t mask = g.lineMask[u];
+            if (mask == 0) {
+                lg.stateStation.push_back(u);
+                lg.stateLine.push_back(NO_LINE);
+            }
+            for (uint32_t bit = 0; bit < 26; bit++) {
+                if (mask & (1u << bit)) {
+                    lg.stateStation.push_back(u);
+                    lg.stateLine.push_back('A' + bit);
+                }
+            }
+            lg.stateOffsets.push_back(lg.stateStation.size());
+        }
+
+        lg.arcOffsets.assign(1, 0);
+        for (uint32_t u = 0; u < n; u++) {
+            for (uint32_t su = lg.stateOffsets[u]; su < lg.stateOffsets[u + 1]; su++) {
+                for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                    uint32_t v = g.targets[e];
+                    bool shared = (g.lineMask[u] & g.lineMask[v]) != 0;
+                    for (uint32_t sv = lg.stateOffsets[v]; sv < lg.stateOffsets[v + 1]; sv++) {
+                        if (shared && lg.stateLine[sv] != lg.stateLine[su]) continue;
+                        lg.arcTargets.push_back(sv);
+                        lg.arcKm.push_back(g.weights[e]);
+                    }
+                }
+                lg.arcOffsets.push_back(lg.arcTargets.size());
+            }
+        }
+        return lg;
+    }
+
+    /**
+     * Finds the cheapest route from any state of src to any state of dst,
+     * where each line change costs transferPenalty in the units of Cost.
+     * The result lists the legs ridden; its interchanges are the stations
+     * where one leg ends and the next begins.
+     */
+    template <class Cost>
+    RouteResult route(const FrozenGraph& g, uint32_t src, uint32_t dst, int transferPenalty,
+                      SearchScratch& s) const {
+        RouteResult res;
+        s.settled = 0;
+        if (!g.connected(src, dst)) return res;
+
+        s.prepare(numStates());
+        for (uint32_t st = stateOffsets[src]; st < stateOffsets[src + 1]; st++) {
+            s.dist[st] = 0;
+            s.touched.push_back(st);
+            s.heap.pushOrDecrease(st, 0);
+        }
+
+        auto relax = [&s](uint32_t from, uint32_t to, int nc) {
+            if (nc < s.dist[to]) {
+                if (s.dist[to] == INT_MAX) s.touched.push_back(to);
+                s.dist[to] = nc;
+                s.parent[to] = from;
+                s.heap.pushOrDecrease(to, nc);
+            }
+        };
+
+        uint32_t reached = NO_STATION;
+        while (!s.heap.empty()) {
+            IndexedHeap::Entry rp = s.heap.pop();
+            s.settled++;
+            uint32_t station = stateStation[rp.id];
+            if (station == dst) {
+                reached = rp.id;
+                break;
+            }
+
+            for (uint32_t a = arcOffsets[rp.id]; a < arcOffsets[rp.id + 1]; a++) {
+                relax(rp.id, arcTargets[a], rp.key + Cost::edge(arcKm[a]));
+            }
+            for (uint32_t st = stateOffsets[station]; st < stateOffsets[station + 1]; st++) {
+                if (st != rp.id) relax(rp.id, st, rp.key + transferPenalty);
+            }
+        }
+        if (reached == NO_STATION) return res;
+
+        fill(g, DijkstraEngine::path(s, reached), res);
+        return res;
+    }
+
+    /**
+     * Fills a route from the states it passes through: the stations,
+     * totals and fare, one leg per run of ride arcs on the same line, and
+     * an interchange wherever one leg ends and the next begins.
+     */
+    void fill(const FrozenGraph& g, const vector<uint32_t>& states, RouteResult& res) const {
+        vector<uint32_t> path;
+        for (uint32_t st : states) {
+            if (path.empty() || path.back() != stateStation[st]) path.push_back(stateStation[st]);
+        }
+        res.fill(g, std::move(path));
+
+        res.interchanges.clear();
+        size_t index = 0;
+        for (size_t i = 1; i < states.size(); i++) {
+            uint32_t from = stateStation[states[i - 1]], to = stateStation[states[i]];
+            if (from == to) {
+                res.interchanges.push_back(index);
+                continue;
+            }
+            char line = stateLine[states[i]];
+            if (res.legs.empty() || res.legs.back().line != line || res.legs.back().alight != from) {
+                res.legs.push_back({line, from, to, 0});
+            }
+            res.legs.back().alight = to;
+            res.legs.back().stops++;
+            index++;
+        }
+    }
+};
+
+/**
+ * ParetoRoutes finds every route between two stations that no other route
+ * beats on time, fare and interchanges at once, so a rider can trade one
+ * against another. It is a multi-criteria label-setting search over the
+ * line graph: a label is a partial route with its time, stations (which
+ * give the fare) and line changes, and every state keeps a bag of the
+ * labels no other label there dominates. Labels are taken in order of
+ * time plus a lower bound to the target, so the fastest route is found
+ * first; a label is then dropped as soon as its bounds show that a route
+ * already found is at least as good on all three.
+ */
+class ParetoRoutes {
+public:
+    static constexpr uint32_t NO_LABEL = UINT32_MAX;
+
+    /**
+     * Label class is one partial route ending at a line state. All labels
+     * of a query live in one array; the labels in a state's bag are linked
+     * through nextInBag, newest first.
+     */
+    class Label {
+    public:
+        int time;               // Seconds riding
+        uint32_t stations;      // Stations passed, both ends included
+        uint32_t transfers;     // Line changes
+        uint32_t state;
+        uint32_t parent;        // Label this one extends, NO_LABEL at the source
+        uint32_t nextInBag;
+        bool dead;              // Dominated after it was queued
+    };
+
+    /**
+     * QueueEntry class orders labels by time plus its bound to the target,
+     * then by fewer line changes, then by fewer stations.
+     */
+    class QueueEntry {
+    public:
+        int bound;
+        uint32_t transfers, stations;
+        uint32_t label;
+
+        bool operator>(const QueueEntry& o) const {
+            if (bound != o.bound) return bound > o.bound;
+            if (transfers != o.transfers) return transfers > o.transfers;
+            return stations > o.stations;
+        }
+    };
+
+    /**
+     * Scratch class holds one thread's labels, bags and queue, reused from
+     * query to query, and the counts of its last query.
+     */
+    class Scratch {
+    public:
+        vector<Label> labels;
+        vector<uint32_t> bag;           // State -> newest label in its bag, NO_LABEL if empty
+        vector<uint32_t> bagsUsed;      // States with a non-empty bag
+        vector<QueueEntry> queue;       // Min-heap of queued labels
+        vector<uint32_t> found;         // Labels that reached the target, in the order taken
+        SearchScratch timeBound;        // Fastest time from the target to every station
+        SearchScratch hopBound;         // Fewest hops from the target to every station
+        vector<uint32_t> states;
+
+        uint64_t created = 0;       // Labels made by the last query
+        uint64_t dominated = 0;     // Labels a bag rejected or a later label replaced
+        uint64_t pruned = 0;        // Labels dropped by the bounds
+        uint64_t taken = 0;         // Labels taken from the queue and expanded
+    };
+
+    /**
+     * Finds the Pareto set of routes from src to dst on time, fare and
+     * interchanges, fastest first. Interchanges are line changes, as in
+     * line-aware routing.
+     * @param maxExtra Seconds a route may take over the fastest one, INT_MAX for any
+     * @return Number of routes written to out
+     */
+    static size_t find(const FrozenGraph& g, const LineGraph& lg, uint32_t src, uint32_t dst, int maxExtra,
+                       Scratch& s, vector<RouteResult>& out) {
+        out.clear();
+        s.created = s.dominated = s.pruned = s.taken = 0;
+        if (!g.connected(src, dst)) return 0;
+
+        /*
+         * Shortest times and hop counts to dst bound what any label can
+         * still reach. Both searches stop at the time limit once the fastest
+         * time from src is known: stations they leave unsettled keep a time
+         * over the limit, so labels there are pruned, and no route within
+         * the limit passes them, so the hop counts can ignore them.
+         */
+        const int* weights = g.weights.data();
+        const uint32_t* targets = g.targets.data();
+        int limit = INT_MAX;
+        DijkstraEngine::explore(g, dst, INT_MAX, s.timeBound, [weights](uint32_t e) {
+            return TimeCost::edge(weights[e]);
+        }, [&limit, src, maxExtra](uint32_t id, int key) {
+            if (id == src) limit = maxExtra >= INT_MAX - key ? INT_MAX : key + maxExtra;
+            return key <= limit;
+        });
+        const int* minTime = s.timeBound.dist.data();
+        DijkstraEngine::explore(g, dst, INT_MAX, s.hopBound, [minTime, targets, limit](uint32_t e) {
+            return minTime[targets[e]] <= limit ? 1 : CLOSED_EDGE;
+        }, [](uint32_t, int) {
+            return true;
+        });
+        const int* minHops = s.hopBound.dist.data();
+
+        if (s.bag.size() != lg.numStates()) {
+            s.bag.assign(lg.numStates(), NO_LABEL);
+            s.bagsUsed.clear();
+        }
+        for (uint32_t st : s.bagsUsed) {
+            s.bag[st] = NO_LABEL;
+        }
+        s.bagsUsed.clear();
+        s.labels.clear();
+        s.queue.clear();
+        s.found.clear();
+
+        // Queues a label unless the bounds or the bag of its state rule it out
+        auto offer = [&](int time, uint32_t stations, uint32_t transfers, uint32_t state, uint32_t parent) {
+            s.created++;
+            uint32_t v = lg.stateStation[state];
+            if (minTime[v] > limit - time) {
+                s.pruned++;
+                return;
+            }
+            int bound = time + minTime[v];
+            int fare = RouteResult::fareForStations(stations + minHops[v]);
+            for (uint32_t f : s.found) {
+                const Label& t = s.labels[f];
+                if (t.time <= bound && t.transfers <= transfers &&
+                    RouteResult::fareForStations(t.stations) <= fare) {
+                    s.pruned++;
+                    return;
+                }
+            }
+
+            uint32_t* link = &s.bag[state];
+            if (*link == NO_LABEL) s.bagsUsed.push_back(state);
+            for (uint32_t b = *link; b != NO_LABEL; b = s.labels[b].nextInBag) {
+                const Label& o = s.labels[b];
+                if (o.time <= time && o.stations <= stations && o.transfers <= transfers) {
+                    s.dominated++;
+                    return;
+                }
+            }
+            while (*link != NO_LABEL) {
+                Label& o = s.labels[*link];
+                if (time <= o.time && stations <= o.stations && transfers <= o.transfers) {
+                    o.dead = true;
+                    s.dominated++;
+                    *link = o.nextInBag;
+                } else {
+                    link = &o.nextInBag;
+                }
+            }
+
+            uint32_t id = s.labels.size();
+            s.labels.push_back({time, stations, transfers, state, parent, s.bag[state], false});
+            s.bag[state] = id;
+            s.queue.push_back({bound, transfers, stations, id});
+            push_heap(s.queue.begin(), s.queue.end(), greater<QueueEntry>());
+        };
+
+        for (uint32_t st = lg.stateOffsets[src]; st < lg.stateOffsets[src + 1]; st++) {
+            offer(0, 1, 0, st, NO_LABEL);
+        }
+
+        while (!s.queue.empty()) {
+            pop_heap(s.queue.begin(), s.queue.end(), greater<QueueEntry>());
+            uint32_t id = s.queue.back().label;
+            s.queue.pop_back();
+            Label l = s.labels[id];
+            if (l.dead) continue;
+            s.taken++;
+
+            uint32_t station = lg.stateStation[l.state];
+            if (station == dst) {
+                // Taken in key order, so no later target label can dominate this one
+                bool worse = false;
+                for (uint32_t f : s.found) {
+                    const Label& t = s.labels[f];
+                    worse = worse || (t.time <= l.time && t.transfers <= l.transfers &&
+                                      RouteResult::fareForStations(t.stations) <=
+                                      RouteResult::fareForStations(l.stations));
+                }
+                if (!worse) s.found.push_back(id);
+                continue;
+            }
+
+            for (uint32_t a = lg.arcOffsets[l.state]; a < lg.arcOffsets[l.state + 1]; a++) {
+                offer(l.time + TimeCost::edge(lg.arcKm[a]), l.stations + 1, l.transfers, lg.arcTargets[a], id);
+            }
+            if (l.parent == NO_LABEL) continue;     // Every state of the source starts with no change
+            for (uint32_t st = lg.stateOffsets[station]; st < lg.stateOffsets[station + 1]; st++) {
+                if (st != l.state) offer(l.time, l.stations, l.transfers + 1, st, id);
+            }
+        }
+
+        out.resize(s.found.size());
+        for (size_t i = 0; i < s.found.size(); i++) {
+            s.states.clear();
+            for (uint32_t b = s.found[i]; b != NO_LABEL; b = s.labels[b].parent) {
+                s.states.push_back(s.labels[b].state);
+            }
+            reverse(s.states.begin(), s.states.end());
+            lg.fill(g, s.states, out[i]);
+        }
+
+        QUERY_STATS(
+            QueryStats::ThreadStats& stats = QueryStats::local();
+            stats.add(QueryStats::LABELS, s.created);
+            stats.add(QueryStats::LABELS_DOMINATED, s.dominated);
+            stats.add(QueryStats::LABELS_PRUNED, s.pruned);
+            stats.add(QueryStats::SETTLED, s.taken);
+        )
+        return out.size();
+    }
+};
+
+// Formats seconds after midnight as HH:MM, wrapping past midnight
+static string formatClock(int secs) {
+    char buf[8];
+    snprintf(buf, sizeof(buf), "%02d:%02d", secs / 3600 % 24, secs / 60 % 60);
+    return buf;
+}
+
+// Parses HH:MM or HH:MM:SS into seconds after midnight, or -1 if malformed
+static int parseClock(const string& s) {
+    int parts[3] = {0, 0, 0};
+    int field = 0, digits = 0;
+    for (char c : s) {
+        if (c == ':') {
+            if (digits == 0 || ++field > 2) return -1;
+            digits = 0;
+        } else if (isdigit((unsigned char)c) && digits < 2) {
+            parts[field] = parts[field] * 10 + (c - '0');
+            digits++;
+        } else {
+            return -1;
+        }
+    }
+    if (digits == 0 || field == 0 || parts[1] > 59 || parts[2] > 59) return -1;
+    return parts[0] * 3600 + parts[1] * 60 + parts[2];
+}
+
+/**
+ * Timetable class holds scheduled trips for time-dependent routing with
+ * the Connection Scan Algorithm. Every trip is broken into elementary
+ * connections, one per hop between consecutive stops, and all of them
+ * sit in one array sorted by departure: a query is a single scan over
+ * contiguous memory, forwards for the earliest arrival and backwards for
+ * the profile of a departure window.
+ */
+class Timetable {
+public:
+    static constexpr int NEVER = INT_MAX;          // Arrival at a station not reached
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr int DEFAULT_CHANGE = 180;     // Seconds needed to change trains at a station
+    static constexpr int MAX_CHANGE = 24 * 3600;   // Longest change time a timetable file may set
+
+    class Connection {
+    public:
+        int depart;         // Seconds after midnight
+        int arrive;
+        uint32_t from;      // Station IDs
+        uint32_t to;
+        uint32_t trip;
+        uint32_t stop;      // Index of the departure stop in stopStation
+    };
+
+    /**
+     * Scratch holds the per-query state of a scan. Its buffers keep their
+     * capacity, so a warmed-up scratch answers queries without allocating.
+     */
+    class Scratch {
+    public:
+        vector<int> arrival;            // Earliest known arrival per station
+        vector<uint32_t> reachedBy;     // Connection giving each arrival, NONE at the source
+        vector<uint32_t> boarded;       // First connection taken on each trip, NONE if not boarded
+        vector<int> tripArrival;        // Profile scan: arrival at the target staying on each trip
+        vector<vector<pair<int, int>>> profiles;   // Profile scan: (departure, arrival) per station
+        uint64_t scanned = 0;           // Connections looked at by the last scan
+    };
+
+    vector<Connection> connections; // Sorted by departure
+    vector<uint32_t> tripOffsets;   // Stops of trip t are [tripOffsets[t], tripOffsets[t + 1])
+    vector<uint32_t> stopStation;   // Station ID of each stop
+    vector<int> stopTime;           // Departure time of each stop; trains do not dwell
+    vector<char> tripLine;          // Line letter per trip
+    vector<int> minChange;          // Seconds needed to change trains, per station
+
+    Timetable() : tripOffsets(1, 0) {}
+
+    uint32_t numTrips() const {
+        return tripLine.size();
+    }
+
+    // Adds one trip calling at stations at the given times, which must not decrease
+    void addTrip(char line, const vector<uint32_t>& stations, const vector<int>& times) {
+        uint32_t trip = numTrips();
+        uint32_t first = stopStation.size();
+        for (size_t i = 0; i < stations.size(); i++) {
+            if (i > 0) {
+                connections.push_back({times[i - 1], times[i], stations[i - 1], stations[i], trip,
+                                       first + (uint32_t)i - 1});
+            }
+            stopStation.push_back(stations[i]);
+            stopTime.push_back(times[i]);
+        }
+        tripLine.push_back(line);
+        tripOffsets.push_back(stopStation.size());
+    }
+
+    /**
+     * Adds trips along adjacent stations leaving the first one every
+     * headway seconds from first to last, taking TimeCost per hop.
+     * @return False if two consecutive stations are not connected
+     */
+    bool addService(const FrozenGraph& g, char line, const vector<uint32_t>& stations,
+                    int first, int last, int headway) {
+        vector<int> offset(stations.size(), 0);
+        for (size_t i = 1; i < stations.size(); i++) {
+            int km = g.edgeWeight(stations[i - 1], stations[i]);
+            if (km < 0) return false;
+            offset[i] = offset[i - 1] + TimeCost::edge(km);
+        }
+        vector<int> times(stations.size());
+        for (int t = first; t <= last; t += max(1, headway)) {
+            for (size_t i = 0; i < stations.size(); i++) {
+                times[i] = t + offset[i];
+            }
+            addTrip(line, stations, times);
+        }
+        return true;
+    }
+
+    // Sorts the connections by departure; call after adding trips
+    void finish(const FrozenGraph& g) {
+        sort(connections.begin(), connections.end(), [](const Connection& a, const Connection& b) {
+            return a.depart != b.depart ? a.depart < b.depart : a.arrive < b.arrive;
+        });
+        minChange.resize(g.numStations(), DEFAULT_CHANGE);
+    }
+
+    /**
+     * Generates a schedule for a network without one: trains along every
+     * route of every line, both ways, every headway seconds from first to
+     * last. Hops between stations on no common line get no service.
+     */
+    static Timetable fromNetwork(const FrozenGraph& g, int first, int last, int headway) {
+        Timetable tt;
+        for (const pair<char, vector<uint32_t>>& route : lineRoutes(g)) {
+            vector<uint32_t> stations = route.second;
+            tt.addService(g, route.first, stations, first, last, headway);
+            reverse(stations.begin(), stations.end());
+            tt.addService(g, route.first, stations, first, last, headway);
+        }
+        tt.finish(g);
+        return tt;
+    }
+
+    /**
+     * Returns the routes trains of each line run, from the stations whose
+     * names carry the line letter: a path between every two ends of a line,
+     * so a branch gets its own trains, or once around a line with no ends.
+     */
+    static vector<pair<char, vector<uint32_t>>> lineRoutes(const FrozenGraph& g) {
+        vector<pair<char, vector<uint32_t>>> routes;
+        uint32_t n = g.numStations();
+        vector<uint32_t> seen(n, 0), parent(n, NONE), queue;
+        uint32_t searches = 0;
+
+        for (uint32_t bit = 0; bit < 26; bit++) {
+            uint32_t mask = 1u << bit;
+            char line = 'A' + bit;
+            auto degree = [&](uint32_t u) {
+                uint32_t d = 0;
+                for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                    if (g.lineMask[g.targets[e]] & mask) d++;
+                }
+                return d;
+            };
+            // Breadth-first search along the line from root, returning the stations reached
+            auto bfs = [&](uint32_t root) {
+                uint32_t mark = ++searches;
+                queue.assign(1, root);
+                seen[root] = mark;
+                parent[root] = NONE;
+                for (size_t q = 0; q < queue.size(); q++) {
+                    uint32_t u = queue[q];
+                    for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                        uint32_t v = g.targets[e];
+                        if (!(g.lineMask[v] & mask) || seen[v] == mark) continue;
+                        seen[v] = mark;
+                        parent[v] = u;
+                        queue.push_back(v);
+                    }
+                }
+                return queue;
+            };
+            auto pathTo = [&](uint32_t v) {
+                vector<uint32_t> path;
+                for (; v != NONE; v = parent[v]) path.push_back(v);
+                reverse(path.begin(), path.end());
+                return path;
+            };
+
+            vector<bool> done(n, false);
+            for (uint32_t root = 0; root < n; root++) {
+                if (!(g.lineMask[root] & mask) || done[root]) continue;
+                vector<uint32_t> part = bfs(root);
+                vector<uint32_t> ends;
+                for (uint32_t u : part) {
+                    done[u] = true;
+                    if (degree(u) == 1) ends.push_back(u);
+                }
+                if (part.size() < 2) continue;
+
+                if (ends.empty()) {
+                    // A ring: walk around it back to the start
+                    vector<uint32_t> ring(1, root);
+                    uint32_t prev = NONE, at = root;
+                    while (ring.size() <= part.size()) {
+                        uint32_t next = NONE;
+                        for (uint32_t e = g.offsets[at]; e < g.offsets[at + 1] && next == NONE; e++) {
+                            uint32_t v = g.targets[e];
+                            if ((g.lineMask[v] & mask) && v != prev) next = v;
+                        }
+                        if (next == NONE) break;
+                        ring.push_back(next);
+                        prev = at;
+                        at = next;
+                        if (at == root) break;
+                    }
+                    if (ring.back() == root && ring.size() > 2) {
+                        routes.push_back({line, ring});
+                        continue;
+                    }
+                }
+                if (ends.size() < 2) {
+                    // No clear ends: run between the two stations farthest apart by stops
+                    uint32_t far = bfs(root).back();
+                    ends = {far, bfs(far).back()};
+                }
+                for (size_t i = 0; i < ends.size(); i++) {
+                    bfs(ends[i]);
+                    for (size_t j = i + 1; j < ends.size(); j++) {
+                        routes.push_back({line, pathTo(ends[j])});
+                    }
+                }
+            }
+        }
+        return routes;
+    }
+
+    /**
+     * Loads a schedule for g from a CSV file with one record per line:
+     *   service,LINE,FIRST,LAST,HEADWAY_MIN,STATION,STATION,...
+     *   trip,LINE,STATION@HH:MM[:SS],STATION@HH:MM[:SS],...
+     *   change,STATION,SECONDS
+     * A service or trip runs one way along adjacent stations; list the other way
+     * as its own record. Lines starting with '#' are comments.
+     * @return Empty string on success, otherwise the reason it failed
+     */
+    static string load(const string& path, const FrozenGraph& g, Timetable& tt) {
+        ifstream in(path);
+        if (!in) return "cannot open " + path;
+        tt = Timetable();
+        tt.minChange.assign(g.numStations(), DEFAULT_CHANGE);
+
+        string line;
+        vector<string> fields;
+        vector<uint32_t> stations;
+        vector<int> times;
+        size_t lineNo = 0;
+        while (getline(in, line)) {
+            lineNo++;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            string where = "line " + to_string(lineNo) + ": ";
+
+            fields.clear();
+            stringstream ss(line);
+            string field;
+            while (getline(ss, field, ',')) {
+                fields.push_back(field);
+            }
+
+            const string& kind = fields[0];
+            bool lineOk = fields.size() > 1 && fields[1].size() == 1 && isupper(fields[1][0]);
+            stations.clear();
+            times.clear();
+            if (kind == "service" && fields.size() >= 7 && lineOk) {
+                int first = parseClock(fields[2]);
+                int last = parseClock(fields[3]);
+                int headway = atoi(fields[4].c_str()) * 60;
+                if (first < 0 || last < first || headway <= 0) return where + "bad service times";
+                for (size_t i = 5; i < fields.size(); i++) {
+                    uint32_t id = g.findId(fields[i]);
+                    if (id == NO_STATION) return where + "unknown station " + fields[i];
+                    stations.push_back(id);
+                }
+                if (!tt.addService(g, fields[1][0], stations, first, last, headway)) {
+                    return where + "consecutive stations are not connected";
+                }
+            } else if (kind == "trip" && fields.size() >= 4 && lineOk) {
+                for (size_t i = 2; i < fields.size(); i++) {
+                    size_t at = fields[i].rfind('@');
+                    uint32_t id = at == string::npos ? NO_STATION : g.findId(fields[i].substr(0, at));
+                    int t = at == string::npos ? -1 : parseClock(fields[i].substr(at + 1));
+                    if (id == NO_STATION || t < 0) return where + "bad stop " + fields[i];
+                    if (!times.empty() && t < times.back()) return where + "stop times go backwards";
+                    if (!stations.empty() && g.edgeWeight(stations.back(), id) < 0) {
+                        return where + "consecutive stations are not connected";
+                    }
+                    stations.push_back(id);
+                    times.push_back(t);
+                }
+                tt.addTrip(fields[1][0], stations, times);
+            } else if (kind == "change" && fields.size() == 3) {
+                uint32_t id = g.findId(fields[1]);
+                char* rest;
+                errno = 0;
+                long secs = strtol(fields[2].c_str(), &rest, 10);
+                if (id == NO_STATION || rest == fields[2].c_str() || *rest != '\0' || errno != 0
+                    || secs < 0 || secs > MAX_CHANGE) {
+                    return where + "bad change time";
+                }
+                tt.minChange[id] = secs;
+            } else {
+                return where + "unrecognised record";
+            }
+        }
+        tt.finish(g);
+        return "";
+    }
+
+    /**
+     * Scans connections leaving at or after depart until none can reach
+     * dst sooner. A trip can be boarded where the traveller is by its
+     * departure, allowing the station's change time except at the source.
+     * @return Earliest arrival at dst, or NEVER
+     */
+    int scan(uint32_t src, uint32_t dst, int depart, Scratch& s) const {
+        uint32_t n = minChange.size();
+        s.arrival.assign(n, NEVER);
+        s.reachedBy.assign(n, NONE);
+        s.boarded.assign(numTrips(), NONE);
+        s.arrival[src] = depart;
+        s.scanned = 0;
+
+        auto first = lower_bound(connections.begin(), connections.end(), depart,
+                                 [](const Connection& c, int t) { return c.depart < t; });
+        for (size_t i = first - connections.begin(); i < connections.size(); i++) {
+            const Connection& c = connections[i];
+            if (c.depart >= s.arrival[dst]) break;
+            s.scanned++;
+            if (s.boarded[c.trip] == NONE) {
+                int ready = s.arrival[c.from];
+                if (ready == NEVER || (c.from == src ? ready : ready + minChange[c.from]) > c.depart) continue;
+                s.boarded[c.trip] = i;
+            }
+            if (c.arrive < s.arrival[c.to]) {
+                s.arrival[c.to] = c.arrive;
+                s.reachedBy[c.to] = i;
+            }
+        }
+        QUERY_STATS(QueryStats::local().add(QueryStats::CONNECTIONS_SCANNED, s.scanned);)
+        return s.arrival[dst];
+    }
+
+    /**
+     * Finds the journey from src reaching dst earliest when leaving at
+     * depart. The legs carry their departure and arrival times, and the
+     * result's time is the whole wait and ride from depart.
+     */
+    RouteResult earliestArrival(const FrozenGraph& g, uint32_t src, uint32_t dst, int depart,
+                                Scratch& s) const {
+        RouteResult res;
+        if (!g.connected(src, dst)) return res;
+        int arrive = scan(src, dst, depart, s);
+        if (arrive == NEVER) return res;
+
+        // Walk back one trip at a time: where the last ride was boarded, and how that was reached
+        vector<pair<uint32_t, uint32_t>> rides;
+        for (uint32_t at = dst; s.reachedBy[at] != NONE;) {
+            uint32_t last = s.reachedBy[at];
+            uint32_t first = s.boarded[connections[last].trip];
+            rides.push_back({first, last});
+            at = connections[first].from;
+        }
+        reverse(rides.begin(), rides.end());
+
+        vector<uint32_t> path(1, src);
+        vector<uint32_t> changes;
+        vector<RouteLeg> legs;
+        for (const pair<uint32_t, uint32_t>& ride : rides) {
+            const Connection& first = connections[ride.first];
+            const Connection& last = connections[ride.second];
+            if (!legs.empty()) changes.push_back(path.size() - 1);
+            legs.push_back({tripLine[first.trip], first.from, last.to, last.stop + 1 - first.stop,
+                            first.depart, last.arrive});
+            for (uint32_t k = first.stop + 1; k <= last.stop + 1; k++) {
+                path.push_back(stopStation[k]);
+            }
+        }
+        res.fill(g, std::move(path));
+        res.legs = std::move(legs);
+        res.interchanges = std::move(changes);
+        res.time = arrive - depart;
+        return res;
+    }
+
+    /**
+     * Finds the profile of journeys from src to dst leaving in [from, until]:
+     * every departure time from src that arrives sooner than any later
+     * one, with its earliest arrival, in departure order. Connections are
+     * scanned backwards from the earliest arrival after until, keeping
+     * for each station its (departure, arrival) pairs that no other beats.
+     */
+    vector<pair<int, int>> profile(uint32_t src, uint32_t dst, int from, int until, Scratch& s) const {
+        vector<pair<int, int>> ans;
+        if (src == dst) return ans;
+        uint32_t n = minChange.size();
+        // No journey leaving by until needs a connection leaving after the earliest arrival from until
+        int horizon = scan(src, dst, until, s);
+        s.tripArrival.assign(numTrips(), NEVER);
+        if (s.profiles.size() < n) s.profiles.resize(n);
+        for (uint32_t u = 0; u < n; u++) {
+            s.profiles[u].clear();
+        }
+        s.scanned = 0;
+
+        auto begin = lower_bound(connections.begin(), connections.end(), from,
+                                 [](const Connection& c, int t) { return c.depart < t; });
+        auto end = upper_bound(connections.begin(), connections.end(), horizon,
+                               [](int t, const Connection& c) { return t < c.depart; });
+        for (auto it = end; it != begin;) {
+            const Connection& c = *--it;
+            s.scanned++;
+            int best = s.tripArrival[c.trip];
+            if (c.to == dst) {
+                best = min(best, c.arrive);
+            } else {
+                // Pairs are added by falling departure, so the last one still catchable arrives first
+                const vector<pair<int, int>>& next = s.profiles[c.to];
+                int ready = c.arrive + minChange[c.to];
+                auto catchable = partition_point(next.begin(), next.end(),
+                                                 [ready](const pair<int, int>& p) { return p.first >= ready; });
+                if (catchable != next.begin()) best = min(best, prev(catchable)->second);
+            }
+            if (best == NEVER) continue;
+            s.tripArrival[c.trip] = best;
+
+            vector<pair<int, int>>& here = s.profiles[c.from];
+            if (!here.empty() && best >= here.back().second) continue;
+            if (!here.empty() && here.back().first == c.depart) {
+                here.back().second = best;
+            } else {
+                here.push_back({c.depart, best});
+            }
+        }
+
+        QUERY_STATS(QueryStats::local().add(QueryStats::CONNECTIONS_SCANNED, s.scanned);)
+
+        const vector<pair<int, int>>& out = s.profiles[src];
+        for (auto it = out.rbegin(); it != out.rend(); ++it) {
+            if (it->first <= until) ans.push_back(*it);
+        }
+        return ans;
+    }
+};
+
+/**
+ * LandmarkIndex holds exact costs between every station and K landmark
+ * stations for one metric. By the triangle inequality, |d(L, t) - d(L, v)|
+ * is a lower bound on d(v, t) for every landmark L, which makes the best
+ * such bound a feasible A* potential (the ALT method).
+ */
+class LandmarkIndex {
+public:
+    uint32_t k = 0;                 // Number of landmarks
+    vector<uint32_t> landmarks;     // Landmark station IDs
+    vector<int> dist;               // dist[v * k + i] = cost between v and landmark i
+
+    /**
+     * Picks landmarks farthest-first: each new landmark is the station
+     * whose cost to the nearest chosen landmark is largest (stations not
+     * reached by any landmark yet come first, so every component gets one).
+     * @param cost Cost of every CSR edge of g
+     */
+    static LandmarkIndex build(const FrozenGraph& g, const vector<int>& cost, uint32_t count) {
+        LandmarkIndex lm;
+        uint32_t n = g.numStations();
+        lm.k = min(count, n);
+        lm.dist.assign((size_t)n * lm.k, INT_MAX);
+        if (lm.k == 0) return lm;
+
+        // Start from the station farthest from station 0
+        SearchScratch s;
+        DijkstraEngine::runCosts(g, cost.data(), 0, NO_STATION, s);
+        uint32_t next = 0;
+        for (uint32_t v = 0; v < n; v++) {
+            if (s.dist[v] != INT_MAX && s.dist[v] > s.dist[next]) next = v;
+        }
+
+        vector<int64_t> nearest(n, INT64_MAX);
+        for (uint32_t i = 0; i < lm.k; i++) {
+            lm.landmarks.push_back(next);
+            DijkstraEngine::runCosts(g, cost.data(), next, NO_STATION, s);
+            for (uint32_t v = 0; v < n; v++) {
+                lm.dist[(size_t)v * lm.k + i] = s.dist[v];
+                if (s.dist[v] != INT_MAX) nearest[v] = min(nearest[v], (int64_t)s.dist[v]);
+            }
+            for (uint32_t v = 0; v < n; v++) {
+                if (nearest[v] > nearest[next]) next = v;
+            }
+        }
+        return lm;
+    }
+
+    // Lower bound on the cost between u and v
+    int bound(uint32_t u, uint32_t v) const {
+        const int* a = &dist[(size_t)u * k];
+        const int* b = &dist[(size_t)v * k];
+        int h = 0;
+        for (uint32_t i = 0; i < k; i++) {
+            if (a[i] == INT_MAX || b[i] == INT_MAX) continue;
+            h = max(h, abs(a[i] - b[i]));
+        }
+        return h;
+    }
+
+    /**
+     * Bidirectional A* between src and dst using average potentials
+     * p(v) = (bound(v, dst) - bound(src, v)) / 2 forward and -p(v) backward.
+     * Keys are doubled to stay in integers: 2 * d + (bound(v, dst) - bound(src, v)).
+     * fwd.settled + bwd.settled is the number of stations settled.
+     * @param cost Cost of every CSR edge, the same metric the index was built for
+     */
+    RouteResult route(const FrozenGraph& g, const vector<int>& cost, uint32_t src, uint32_t dst,
+                      SearchScratch& fwd, SearchScratch& bwd) const {
+        RouteResult res;
+        fwd.settled = bwd.settled = 0;
+        if (!g.connected(src, dst)) return res;
+
+        uint32_t n = g.numStations();
+        fwd.prepare(n);
+        bwd.prepare(n);
+        auto potential = [&](uint32_t v) {
+            return bound(v, dst) - bound(src, v);
+        };
+        fwd.dist[src] = 0;
+        fwd.touched.push_back(src);
+        fwd.heap.pushOrDecrease(src, potential(src));
+        bwd.dist[dst] = 0;
+        bwd.touched.push_back(dst);
+        bwd.heap.pushOrDecrease(dst, -potential(dst));
+
+        int64_t best = INT64_MAX;
+        uint32_t meet = NO_STATION;
+
+        while (!fwd.heap.empty() || !bwd.heap.empty()) {
+            int64_t topF = fwd.heap.empty() ? INT32_MAX : fwd.heap.topKey();
+            int64_t topB = bwd.heap.empty() ? INT32_MAX : bwd.heap.topKey();
+            if (best != INT64_MAX && topF + topB >= 2 * best) break;
+
+            bool forward = !fwd.heap.empty() && (bwd.heap.empty() || topF <= topB);
+            SearchScratch& s = forward ? fwd : bwd;
+            const SearchScratch& other = forward ? bwd : fwd;
+            int sign = forward ? 1 : -1;
+
+            uint32_t u = s.heap.pop().id;
+            s.settled++;
+            int du = s.dist[u];
+            if (other.dist[u] != INT_MAX && (int64_t)du + other.dist[u] < best) {
+                best = (int64_t)du + other.dist[u];
+                meet = u;
+            }
+
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                uint32_t w = g.targets[e];
+                int nd = du + cost[e];
+                if (nd < s.dist[w]) {
+                    if (s.dist[w] == INT_MAX) s.touched.push_back(w);
+                    s.dist[w] = nd;
+                    s.parent[w] = u;
+                    s.heap.pushOrDecrease(w, 2 * nd + sign * potential(w));
+                }
+            }
+        }
+        if (meet == NO_STATION) return res;
+
+        vector<uint32_t> path = DijkstraEngine::path(fwd, meet);
+        for (uint32_t v = bwd.parent[meet]; v != NO_STATION; v = bwd.parent[v]) {
+            path.push_back(v);
+        }
+        res.fill(g, std::move(path));
+        return res;
+    }
+};
+
+/**
+ * AlternativeRoutes finds up to k loopless routes between two stations
+ * in order of cost (Yen's algorithm), leaving out routes that share too
+ * much of their length with a route already chosen.
+ * One reverse shortest path tree from the destination is built per query
+ * and shared by all spur searches: its costs are exact lower bounds once
+ * stations and connections are blocked, so each spur search is an A*
+ * that mostly walks straight down the tree.
+ */
+class AlternativeRoutes {
+public:
+    /**
+     * Finds the alternatives; the first is always the shortest route.
+     * @param maxOverlap Largest fraction of a route's distance that may
+     *                   also be on any one route already chosen
+     * @param ctx Scratch for the reverse tree (backward) and spur searches (forward)
+     */
+    template <class Cost>
+    static vector<RouteResult> find(const FrozenGraph& g, uint32_t src, uint32_t dst, uint32_t k,
+                                    double maxOverlap, QueryContext& ctx) {
+        vector<RouteResult> routes;
+        if (k == 0 || !g.connected(src, dst)) return routes;
+
+        // Reverse tree: parent is the next hop towards dst, dist the exact cost to it
+        DijkstraEngine::run<Cost>(g, dst, NO_STATION, ctx.backward);
+        const SearchScratch& tree = ctx.backward;
+        vector<uint32_t> path;
+        for (uint32_t v = src; v != NO_STATION; v = tree.parent[v]) {
+            path.push_back(v);
+        }
+
+        vector<vector<uint32_t>> explored;      // Routes spurred from, in cost order
+        vector<vector<uint64_t>> chosenEdges;   // Sorted edge keys of each chosen route
+        set<vector<uint32_t>> seen;
+        priority_queue<Candidate, vector<Candidate>, greater<Candidate>> candidates;
+        vector<char> blocked(g.numStations(), 0);
+        vector<uint32_t> blockedNext, spur;
+        vector<char> sharesRoot;
+        TreeExits exits(tree, g.numStations());
+
+        seen.insert(path);
+        candidates.push({tree.dist[src], std::move(path), 0});
+        uint32_t maxExplored = 4 * k + 8;   // Bounds the work when most routes overlap
+
+        while (!candidates.empty() && routes.size() < k && explored.size() < maxExplored) {
+            explored.push_back(candidates.top().path);
+            size_t deviation = candidates.top().deviation;
+            candidates.pop();
+            const vector<uint32_t>& last = explored.back();
+
+            if (overlap(g, last, chosenEdges) <= maxOverlap) {
+                chosenEdges.push_back(edgeKeys(last));
+                routes.emplace_back();
+                routes.back().fill(g, last);
+            }
+
+            exits.setRoute(last);
+
+            // Spur from every station from where the route left its parent (Lawler);
+            // spurs before that were already taken from the parent with the same root
+            int rootCost = 0;
+            sharesRoot.assign(explored.size(), 1);
+            for (size_t i = 0; i + 1 < last.size(); i++) {
+                // Routes with the same root path may not leave it the way they did
+                blockedNext.clear();
+                for (size_t r = 0; r < explored.size(); r++) {
+                    const vector<uint32_t>& p = explored[r];
+                    sharesRoot[r] = sharesRoot[r] && p.size() > i + 1 && p[i] == last[i];
+                    if (sharesRoot[r]) blockedNext.push_back(p[i + 1]);
+                }
+
+                int spurCost = i < deviation ? INT_MAX
+                             : spurSearch<Cost>(g, last[i], i, blocked, blockedNext, exits, ctx.forward, spur);
+                if (spurCost != INT_MAX) {
+                    vector<uint32_t> candidate(last.begin(), last.begin() + i);
+                    candidate.insert(candidate.end(), spur.begin(), spur.end());
+                    if (seen.insert(candidate).second) {
+                        candidates.push({rootCost + spurCost, std::move(candidate), i});
+                    }
+                }
+
+                // The root path grows by one station, which later spurs must avoid
+                blocked[last[i]] = 1;
+                rootCost += Cost::edge(g.edgeWeight(last[i], last[i + 1]));
+            }
+            for (uint32_t v : last) {
+                blocked[v] = 0;
+            }
+        }
+        return routes;
+    }
+
+private:
+    /**
+     * Candidate class is a route waiting in Yen's candidate queue.
+     */
+    class Candidate {
+    public:
+        int cost;
+        vector<uint32_t> path;
+        size_t deviation;   // Index of the station where it leaves the route it was spurred from
+
+        bool operator>(const Candidate& o) const {
+            return cost != o.cost ? cost > o.cost : path > o.path;
+        }
+    };
+
+    /**
+     * TreeExits class answers, for the route being spurred from, the
+     * first route index met on the reverse tree path from a station to the
+     * destination. A station's tree path is usable by the spur at index i
+     * exactly when that index is above i. Answers are memoised per route.
+     */
+    class TreeExits {
+    public:
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        const SearchScratch& tree;
+        vector<uint32_t> pos, posStamp;     // Index of a station on the route
+        vector<uint32_t> first, firstStamp; // Memoised answers
+        vector<uint32_t> pending;
+        uint32_t generation = 0;
+
+        TreeExits(const SearchScratch& tree, uint32_t n)
+            : tree(tree), pos(n), posStamp(n, 0), first(n), firstStamp(n, 0) {}
+
+        void setRoute(const vector<uint32_t>& route) {
+            generation++;
+            for (uint32_t j = 0; j < route.size(); j++) {
+                pos[route[j]] = j;
+                posStamp[route[j]] = generation;
+            }
+        }
+
+        uint32_t firstIndex(uint32_t x) {
+            pending.clear();
+            uint32_t known = NONE;
+            for (uint32_t v = x; v != NO_STATION; v = tree.parent[v]) {
+                if (firstStamp[v] == generation) {
+                    known = first[v];
+                    break;
+                }
+                pending.push_back(v);
+            }
+            while (!pending.empty()) {
+                uint32_t v = pending.back();
+                pending.pop_back();
+                if (posStamp[v] == generation) known = min(known, pos[v]);
+                first[v] = known;
+                firstStamp[v] = generation;
+            }
+            return known;
+        }
+    };
+
+    /**
+     * Finds the cheapest path from the station at index i of the route to
+     * dst, avoiding blocked stations and the connections from the spur to
+     * any station in blockedNext, with an A* guided by the reverse tree.
+     * The tree costs are exact for any station whose tree path avoids the
+     * root path, so the search stops at the first such station it settles
+     * and finishes along the tree.
+     * @return Cost of the path written to out, or INT_MAX if there is none
+     */
+    template <class Cost>
+    static int spurSearch(const FrozenGraph& g, uint32_t spur, uint32_t i,
+                          const vector<char>& blocked, const vector<uint32_t>& blockedNext,
+                          TreeExits& exits, SearchScratch& s, vector<uint32_t>& out) {
+        const vector<int>& toDst = exits.tree.dist;
+        auto open = [&](uint32_t v) {
+            return !blocked[v] && std::find(blockedNext.begin(), blockedNext.end(), v) == blockedNext.end();
+        };
+
+        // Most line stations have no open first hop left
+        bool any = false;
+        for (uint32_t e = g.offsets[spur]; e < g.offsets[spur + 1] && !any; e++) {
+            any = open(g.targets[e]);
+        }
+        if (!any) return INT_MAX;
+
+        s.prepare(g.numStations());
+        s.settled = 0;
+        s.dist[spur] = 0;
+        s.touched.push_back(spur);
+        s.heap.pushOrDecrease(spur, toDst[spur]);
+
+        while (!s.heap.empty()) {
+            uint32_t u = s.heap.pop().id;
+            s.settled++;
+            if (u != spur && exits.firstIndex(u) > i) {
+                DijkstraEngine::path(s, u, out);
+                for (uint32_t v = exits.tree.parent[u]; v != NO_STATION; v = exits.tree.parent[v]) {
+                    out.push_back(v);
+                }
+                return s.dist[u] + toDst[u];
+            }
+
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                uint32_t v = g.targets[e];
+                if (blocked[v] || (u == spur && !open(v))) continue;
+                int nc = s.dist[u] + Cost::edge(g.weights[e]);
+                if (nc < s.dist[v]) {
+                    if (s.dist[v] == INT_MAX) s.touched.push_back(v);
+                    s.dist[v] = nc;
+                    s.parent[v] = u;
+                    s.heap.pushOrDecrease(v, nc + toDst[v]);
+                }
+            }
+        }
+        return INT_MAX;
+    }
+
+    // Returns the connections of a route as sorted (lower ID, higher ID) keys
+    static vector<uint64_t> edgeKeys(const vector<uint32_t>& path) {
+        vector<uint64_t> keys;
+        for (size_t i = 1; i < path.size(); i++) {
+            uint64_t a = min(path[i - 1], path[i]), b = max(path[i - 1], path[i]);
+            keys.push_back(a << 32 | b);
+        }
+        sort(keys.begin(), keys.end());
+        return keys;
+    }
+
+    // Returns the largest fraction of the route's distance shared with one chosen route
+    static double overlap(const FrozenGraph& g, const vector<uint32_t>& path,
+                          const vector<vector<uint64_t>>& chosen) {
+        int total = 0;
+        vector<int> shared(chosen.size(), 0);
+        for (size_t i = 1; i < path.size(); i++) {
+            int km = g.edgeWeight(path[i - 1], path[i]);
+            uint64_t a = min(path[i - 1], path[i]), b = max(path[i - 1], path[i]);
+            total += km;
+            for (size_t r = 0; r < chosen.size(); r++) {
+                if (binary_search(chosen[r].begin(), chosen[r].end(), a << 32 | b)) shared[r] += km;
+            }
+        }
+        int most = shared.empty() ? 0 : *max_element(shared.begin(), shared.end());
+        return total > 0 ? (double)most / total : (chosen.empty() ? 0 : 1);
+    }
+};
+
+/**
+ * RouteCache class keeps route results for repeated origin-destination
+ * pairs, up to a fixed number of bytes. It is split into shards, each
+ * with its own lock, hash index and CLOCK ring: a hit sets an entry's
+ * reference bit, and eviction sweeps the ring clearing bits until it
+ * finds an entry not used since the last sweep. Keys carry the network
+ * version, so a result is never served for another version; a shard that
+ * sees a newer version drops everything it holds.
+ */
+class RouteCache {
+public:
+    static constexpr size_t SHARDS = 16;
+
+    class Key {
+    public:
+        uint32_t src, dst;
+        uint32_t metric;    // Chosen by the caller, such as the metric and engine
+        uint64_t version;   // Network version the result belongs to
+
+        bool operator==(const Key& o) const {
+            return src == o.src && dst == o.dst && metric == o.metric && version == o.version;
+        }
+    };
+
+    class Stats {
+    public:
+        uint64_t hits = 0, misses = 0, insertions = 0, evictions = 0, invalidations = 0;
+        size_t entries = 0, bytes = 0, capacity = 0;
+
+        double hitRate() const {
+            return hits + misses ? (double)hits / (hits + misses) : 0;
+        }
+    };
+
+    explicit RouteCache(size_t capacity = 0) {
+        setCapacity(capacity);
+    }
+
+    // Empties the cache and bounds it to the given bytes; 0 turns it off
+    void setCapacity(size_t bytes) {
+        capacity = bytes;
+        for (Shard& s : shards) {
+            lock_guard<mutex> lock(s.lock);
+            s.index.clear();
+            s.ring.clear();
+            s.free.clear();
+            s.hand = 0;
+            s.bytes = 0;
+        }
+    }
+
+    bool enabled() const {
+        return capacity > 0;
+    }
+
+    /**
+     * Copies the cached result for key into out, reusing out's buffers.
+     * @return False on a miss, leaving out unchanged
+     */
+    bool lookup(const Key& key, RouteResult& out) {
+        if (!enabled()) return false;
+        Shard& s = shardFor(key);
+        lock_guard<mutex> lock(s.lock);
+        auto it = s.index.find(key);
+        if (it == s.index.end()) {
+            s.misses++;
+            return false;
+        }
+        Entry& e = s.ring[it->second];
+        e.referenced = true;
+        out = e.result;
+        s.hits++;
+        return true;
+    }
+
+    // Stores a copy of result for key, evicting cold entries to make room
+    void insert(const Key& key, const RouteResult& result) {
+        if (!enabled()) return;
+        size_t bytes = entryBytes(result);
+        size_t budget = capacity / SHARDS;
+        if (bytes > budget) return;
+
+        Shard& s = shardFor(key);
+        lock_guard<mutex> lock(s.lock);
+        if (key.version > s.version) {
+            s.invalidations += s.index.size();
+            s.index.clear();
+            s.ring.clear();
+            s.free.clear();
+            s.hand = 0;
+            s.bytes = 0;
+            s.version = key.version;
+        }
+        if (key.version < s.version || s.index.count(key)) return;
+
+        while (s.bytes + bytes > budget) {
+            evictOne(s);
+        }
+        uint32_t slot;
+        if (!s.free.empty()) {
+            slot = s.free.back();
+            s.free.pop_back();
+        } else {
+            slot = s.ring.size();
+            s.ring.emplace_back();
+        }
+        Entry& e = s.ring[slot];
+        e.key = key;
+        e.result = result;
+        e.bytes = bytes;
+        e.used = true;
+        e.referenced = false;
+        s.index.emplace(key, slot);
+        s.bytes += bytes;
+        s.insertions++;
+    }
+
+    // Sums the counters and sizes of every shard
+    Stats stats() const {
+        Stats st;
+        st.capacity = capacity;
+        for (const Shard& s : shards) {
+            lock_guard<mutex> lock(s.lock);
+            st.hits += s.hits;
+            st.misses += s.misses;
+            st.insertions += s.insertions;
+            st.evictions += s.evictions;
+            st.invalidations += s.invalidations;
+            st.entries += s.index.size();
+            st.bytes += s.bytes;
+        }
+        return st;
+    }
+
+    static void printStats(ostream& out, const Stats& st) {
+        out << "Route cache: " << st.hits << " hits, " << st.misses << " misses ("
+            << fixed << setprecision(1) << st.hitRate() * 100 << defaultfloat << "% hit rate), "
+            << st.evictions << " evictions, " << st.invalidations << " invalidated, " << st.entries
+            << " entries in " << st.bytes << " of " << st.capacity << " bytes\n";
+    }
+
+private:
+    class Entry {
+    public:
+        Key key;
+        RouteResult result;
+        size_t bytes = 0;
+        bool used = false;          // False for a free slot
+        bool referenced = false;    // Hit since the hand last passed
+    };
+
+    class KeyHash {
+    public:
+        size_t operator()(const Key& k) const {
+            uint64_t h = ((uint64_t)k.src << 32 | k.dst) * 0x9E3779B97F4A7C15ull;
+            h ^= (k.metric + k.version * 0xC2B2AE3D27D4EB4Full) + (h >> 29);
+            return h ^ (h >> 32);
+        }
+    };
+
+    class alignas(64) Shard {
+    public:
+        mutable mutex lock;
+        unordered_map<Key, uint32_t, KeyHash> index;   // Key -> slot in ring
+        vector<Entry> ring;
+        vector<uint32_t> free;                          // Empty slots in ring
+        size_t hand = 0;
+        size_t bytes = 0;
+        uint64_t version = 0;                           // Newest version inserted
+        uint64_t hits = 0, misses = 0, insertions = 0, evictions = 0, invalidations = 0;
+    };
+
+    size_t capacity = 0;
+    array<Shard, SHARDS> shards;
+
+    Shard& shardFor(const Key& key) {
+        return shards[KeyHash()(key) % SHARDS];
+    }
+
+    // Bytes an entry holds, counting its index node
+    static size_t entryBytes(const RouteResult& r) {
+        return sizeof(Entry) + sizeof(Key) + 4 * sizeof(void*) + r.stations.size() * sizeof(uint32_t)
+             + r.interchanges.size() * sizeof(uint32_t) + r.legs.size() * sizeof(RouteLeg);
+    }
+
+    // Sweeps the CLOCK hand to the first entry not referenced since its last pass and frees it
+    static void evictOne(Shard& s) {
+        while (true) {
+            if (s.hand >= s.ring.size()) s.hand = 0;
+            Entry& e = s.ring[s.hand++];
+            if (!e.used) continue;
+            if (e.referenced) {
+                e.referenced = false;
+                continue;
+            }
+            s.index.erase(e.key);
+            s.bytes -= e.bytes;
+            e.used = false;
+            e.result = RouteResult();
+            s.free.push_back(s.hand - 1);
+            s.evictions++;
+            return;
+        }
+    }
+};
+
+/**
+ * Epoch class lets threads read shared objects without locks or reference
+ * counts (epoch-based reclamation, a form of RCU). A reader announces the
+ * global epoch in its own slot while it holds pointers; a writer that
+ * replaces an object retires the old one with the epoch of its retirement
+ * and frees it once every reader in a critical section announced a later
+ * epoch. Readers only ever store to their own cache line.
+ */
+class Epoch {
+public:
+    static constexpr uint64_t IDLE = UINT64_MAX;    // Slot of a thread outside any critical section
+    static constexpr size_t MAX_THREADS = 1024;
+
+    // Keeps the calling thread in a critical section for its lifetime; guards nest
+    class Guard {
+    public:
+        Guard() {
+            Local& l = local();
+            if (l.depth++ > 0) return;
+            if (!l.slot) l.slot = claim();
+            l.slot->epoch.store(global().load());
+        }
+
+        ~Guard() {
+            Local& l = local();
+            if (--l.depth == 0) l.slot->epoch.store(IDLE, memory_order_release);
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    // Hands obj over to be deleted once no reader can still hold it
+    template <class T>
+    static void retire(const T* obj) {
+        if (!obj) return;
+        {
+            lock_guard<mutex> lock(retireLock());
+            retired().push_back({global().fetch_add(1), [obj]() { delete obj; }});
+        }
+        collect();
+    }
+
+    // Frees every retired object no reader can still hold; returns how many are left
+    static size_t collect() {
+        uint64_t oldest = IDLE;
+        for (size_t i = 0; i < MAX_THREADS; i++) {
+            oldest = min(oldest, slots()[i].epoch.load());
+        }
+        vector<function<void()>> ready;
+        size_t left;
+        {
+            lock_guard<mutex> lock(retireLock());
+            vector<Retired>& list = retired();
+            auto keep = partition(list.begin(), list.end(), [oldest](const Retired& r) {
+                return r.epoch >= oldest;
+            });
+            for (auto it = keep; it != list.end(); ++it) {
+                ready.push_back(std::move(it->free));
+            }
+            list.erase(keep, list.end());
+            left = list.size();
+        }
+        for (auto& free : ready) {
+            free();
+        }
+        return left;
+    }
+
+private:
+    class alignas(64) Slot {
+    public:
+        atomic<uint64_t> epoch{IDLE};
+        atomic<bool> taken{false};
+    };
+
+    class Retired {
+    public:
+        uint64_t epoch;         // Global epoch when it was retired
+        function<void()> free;
+    };
+
+    // The calling thread's slot, released when the thread exits
+    class Local {
+    public:
+        Slot* slot = nullptr;
+        uint32_t depth = 0;
+
+        ~Local() {
+            if (slot) slot->taken.store(false, memory_order_release);
+        }
+    };
+
+    static Slot* slots() {
+        static Slot table[MAX_THREADS];
+        return table;
+    }
+
+    static atomic<uint64_t>& global() {
+        static atomic<uint64_t> epoch{1};
+        return epoch;
+    }
+
+    static mutex& retireLock() {
+        static mutex m;
+        return m;
+    }
+
+    static vector<Retired>& retired() {
+        static vector<Retired>* list = new vector<Retired>();   // Outlives thread-exit frees
+        return *list;
+    }
+
+    static Local& local() {
+        thread_local Local l;
+        return l;
+    }
+
+    static Slot* claim() {
+        for (size_t i = 0; i < MAX_THREADS; i++) {
+            bool expected = false;
+            if (slots()[i].taken.compare_exchange_strong(expected, true)) return &slots()[i];
+        }
+        cerr << "More than " << MAX_THREADS << " threads reading networks at once\n";
+        abort();
+    }
+};
+
+/**
+ * NetworkSnapshot class is one published version of a network. It never
+ * changes after publication; an update publishes a new one instead.
+ */
+class NetworkSnapshot {
+public:
+    FrozenGraph graph;
+    uint64_t version;   // Unique across all networks in the process
+};
+
+/**
+ * BuiltinNetwork is the Delhi map as compile-time data. The station IDs,
+ * the CSR adjacency, the line of every station and the component labels
+ * are all worked out by the compiler into read-only tables, exactly as
+ * GraphBuilder::freeze() would lay them out, and static_asserts below
+ * reject a map with duplicate stations or connections, a connection to
+ * an unknown station, or stations that cannot reach each other. Loading
+ * it only copies the tables and hashes the names.
+ */
+class BuiltinNetwork {
+public:
+    // Connection class names two stations and the distance between them
+    class Connection {
+    public:
+        const char* a;
+        const char* b;
+        int km;
+    };
+
+    static constexpr const char* STATIONS[] = {
+        "Noida_Sector_62~B", "Botanical_Garden~B", "Yamuna_Bank~B",
+        "Rajiv_Chowk~BY", "Vaishali~B", "Moti_Nagar~B",
+        "Janak_Puri_West~BO", "Dwarka_Sector_21~B", "Huda_City_Center~Y",
+        "Saket~Y", "AIIMS~Y", "New_Delhi~YO",
+        "Chandni_Chowk~Y", "Vishwavidyalaya~Y", "Shivaji_Stadium~O",
+        "DDS_Campus~O", "IGI_Airport~O", "Rajouri_Garden~BP",
+        "Netaji_Subhash_Place~PR", "Punjabi_Bagh_West~P"
+    };
+
+    static constexpr Connection CONNECTIONS[] = {
+        {"Noida_Sector_62~B", "Botanical_Garden~B", 8},
+        {"Botanical_Garden~B", "Yamuna_Bank~B", 10},
+        {"Yamuna_Bank~B", "Vaishali~B", 8},
+        {"Yamuna_Bank~B", "Rajiv_Chowk~BY", 6},
+        {"Rajiv_Chowk~BY", "Moti_Nagar~B", 9},
+        {"Moti_Nagar~B", "Janak_Puri_West~BO", 7},
+        {"Janak_Puri_West~BO", "Dwarka_Sector_21~B", 6},
+        {"Huda_City_Center~Y", "Saket~Y", 15},
+        {"Saket~Y", "AIIMS~Y", 6},
+        {"AIIMS~Y", "Rajiv_Chowk~BY", 7},
+        {"Rajiv_Chowk~BY", "New_Delhi~YO", 1},
+        {"New_Delhi~YO", "Chandni_Chowk~Y", 2},
+        {"Chandni_Chowk~Y", "Vishwavidyalaya~Y", 5},
+        {"New_Delhi~YO", "Shivaji_Stadium~O", 2},
+        {"Shivaji_Stadium~O", "DDS_Campus~O", 7},
+        {"DDS_Campus~O", "IGI_Airport~O", 8},
+        {"Moti_Nagar~B", "Rajouri_Garden~BP", 2},
+        {"Punjabi_Bagh_West~P", "Rajouri_Garden~BP", 2},
+        {"Punjabi_Bagh_West~P", "Netaji_Subhash_Place~PR", 3}
+    };
+
+    static constexpr uint32_t NUM_STATIONS = sizeof(STATIONS) / sizeof(STATIONS[0]);
+    static constexpr uint32_t NUM_CONNECTIONS = sizeof(CONNECTIONS) / sizeof(CONNECTIONS[0]);
+
+    // Tables class holds the frozen form of the map, laid out as in FrozenGraph
+    class Tables {
+    public:
+        uint32_t offsets[NUM_STATIONS + 1] = {};
+        uint32_t targets[2 * NUM_CONNECTIONS] = {};
+        int weights[2 * NUM_CONNECTIONS] = {};
+        uint32_t component[NUM_STATIONS] = {};
+        uint32_t lineMask[NUM_STATIONS] = {};
+    };
+
+    static const Tables TABLES;
+
+    static constexpr bool sameName(const char* a, const char* b) {
+        while (*a && *a == *b) {
+            a++;
+            b++;
+        }
+        return *a == *b;
+    }
+
+    // Returns the ID of a station, or NO_STATION if it is not in STATIONS
+    static constexpr uint32_t findId(const char* name) {
+        for (uint32_t i = 0; i < NUM_STATIONS; i++) {
+            if (sameName(STATIONS[i], name)) return i;
+        }
+        return NO_STATION;
+    }
+
+    static constexpr bool uniqueStations() {
+        for (uint32_t i = 0; i < NUM_STATIONS; i++) {
+            if (findId(STATIONS[i]) != i) return false;
+        }
+        return true;
+    }
+
+    // Every connection joins two different known stations, once, over a positive distance
+    static constexpr bool validConnections() {
+        for (uint32_t i = 0; i < NUM_CONNECTIONS; i++) {
+            uint32_t u = findId(CONNECTIONS[i].a), v = findId(CONNECTIONS[i].b);
+            if (u == NO_STATION || v == NO_STATION || u == v || CONNECTIONS[i].km <= 0) return false;
+            for (uint32_t j = 0; j < i; j++) {
+                uint32_t x = findId(CONNECTIONS[j].a), y = findId(CONNECTIONS[j].b);
+                if ((x == u && y == v) || (x == v && y == u)) return false;
+            }
+        }
+        return true;
+    }
+
+    // Every arc u -> v has a matching v -> u of the same length
+    static constexpr bool symmetric(const Tables& t) {
+        for (uint32_t u = 0; u < NUM_STATIONS; u++) {
+            for (uint32_t e = t.offsets[u]; e < t.offsets[u + 1]; e++) {
+                uint32_t v = t.targets[e];
+                bool back = false;
+                for (uint32_t f = t.offsets[v]; f < t.offsets[v + 1]; f++) {
+                    back = back || (t.targets[f] == u && t.weights[f] == t.weights[e]);
+                }
+                if (!back) return false;
+            }
+        }
+        return true;
+    }
+
+    static constexpr bool connected(const Tables& t) {
+        for (uint32_t u = 0; u < NUM_STATIONS; u++) {
+            if (t.component[u] != 0) return false;
+        }
+        return true;
+    }
+
+    // Builds the tables the way GraphBuilder::freeze() does
+    static constexpr Tables makeTables() {
+        Tables t;
+        for (const Connection& c : CONNECTIONS) {
+            t.offsets[findId(c.a) + 1]++;
+            t.offsets[findId(c.b) + 1]++;
+        }
+        for (uint32_t i = 0; i < NUM_STATIONS; i++) {
+            t.offsets[i + 1] += t.offsets[i];
+        }
+        uint32_t pos[NUM_STATIONS] = {};
+        for (uint32_t i = 0; i < NUM_STATIONS; i++) {
+            pos[i] = t.offsets[i];
+        }
+        for (const Connection& c : CONNECTIONS) {
+            uint32_t u = findId(c.a), v = findId(c.b);
+            t.targets[pos[u]] = v;
+            t.weights[pos[u]++] = c.km;
+            t.targets[pos[v]] = u;
+            t.weights[pos[v]++] = c.km;
+        }
+
+        // Adjacency lists sorted by target, by insertion sort
+        for (uint32_t u = 0; u < NUM_STATIONS; u++) {
+            for (uint32_t e = t.offsets[u] + 1; e < t.offsets[u + 1]; e++) {
+                for (uint32_t f = e; f > t.offsets[u] && t.targets[f - 1] > t.targets[f]; f--) {
+                    uint32_t target = t.targets[f];
+                    t.targets[f] = t.targets[f - 1];
+                    t.targets[f - 1] = target;
+                    int km = t.weights[f];
+                    t.weights[f] = t.weights[f - 1];
+                    t.weights[f - 1] = km;
+                }
+            }
+        }
+
+        // Line letters after the ~, as FrozenGraph::parseLineMask
+        for (uint32_t i = 0; i < NUM_STATIONS; i++) {
+            const char* p = STATIONS[i];
+            while (*p && *p != '~') p++;
+            for (; *p; p++) {
+                if (*p >= 'A' && *p <= 'Z') t.lineMask[i] |= 1u << (*p - 'A');
+            }
+        }
+
+        // Components labelled by their lowest station ID, as GraphBuilder::labelComponents
+        uint32_t stack[NUM_STATIONS] = {};
+        for (uint32_t i = 0; i < NUM_STATIONS; i++) {
+            t.component[i] = NO_STATION;
+        }
+        for (uint32_t root = 0; root < NUM_STATIONS; root++) {
+            if (t.component[root] != NO_STATION) continue;
+            t.component[root] = root;
+            uint32_t top = 0;
+            stack[top++] = root;
+            while (top > 0) {
+                uint32_t u = stack[--top];
+                for (uint32_t e = t.offsets[u]; e < t.offsets[u + 1]; e++) {
+                    if (t.component[t.targets[e]] == NO_STATION) {
+                        t.component[t.targets[e]] = root;
+                        stack[top++] = t.targets[e];
+                    }
+                }
+            }
+        }
+        return t;
+    }
+
+    // Returns the map as a FrozenGraph, copying the tables
+    static FrozenGraph freeze() {
+        FrozenGraph g;
+        vector<string> names(begin(STATIONS), end(STATIONS));
+        unordered_map<string, uint32_t> ids;
+        ids.reserve(NUM_STATIONS);
+        for (uint32_t i = 0; i < NUM_STATIONS; i++) {
+            ids.emplace(names[i], i);
+        }
+        g.stations = make_shared<StationIndex>(std::move(names), std::move(ids));
+        g.offsets.assign(begin(TABLES.offsets), end(TABLES.offsets));
+        g.targets.assign(begin(TABLES.targets), end(TABLES.targets));
+        g.weights.assign(begin(TABLES.weights), end(TABLES.weights));
+        g.component.assign(begin(TABLES.component), end(TABLES.component));
+        g.lineMask.assign(begin(TABLES.lineMask), end(TABLES.lineMask));
+        return g;
+    }
+};
+
+constexpr BuiltinNetwork::Tables BuiltinNetwork::TABLES = BuiltinNetwork::makeTables();
+
+static_assert(BuiltinNetwork::uniqueStations(), "a built-in station is listed twice");
+static_assert(BuiltinNetwork::validConnections(),
+              "a built-in connection names an unknown station, repeats or has no length");
+static_assert(BuiltinNetwork::symmetric(BuiltinNetwork::TABLES), "built-in connections are not symmetric");
+static_assert(BuiltinNetwork::connected(BuiltinNetwork::TABLES), "some built-in stations cannot be reached");
+
+/**
+ * Graph_M class represents the Delhi Metro map as a graph
+ * with stations as vertices and connections as edges.
+ * Edits go to a GraphBuilder; searches run on its frozen CSR form,
+ * published as an immutable NetworkSnapshot after an edit. Each instance
+ * is its own network, so several can be held side by side.
+ *
+ * The menu-style methods below, frozen() included, are for the thread
+ * that owns the instance. Other threads query through a Reader, which
+ * never blocks, while any thread edits and calls publish(). The snapshot
+ * frozen() returns stays alive until the owner's next frozen() call, even
+ * if another thread publishes in between.
+ */
+class Graph_M {
+public:
+    GraphBuilder builder;           // Editable stations and connections, guarded by writeLock
+    uint64_t version = 0;           // Version of the snapshot frozen() last returned
+
+    /**
+     * Reader class pins the published snapshot for as long as it lives.
+     * Taking one is two atomic operations and no lock; an update published
+     * meanwhile is seen by the next Reader.
+     */
+    class Reader {
+    public:
+        explicit Reader(const Graph_M& g) : snapshot(g.current.load()) {}
+
+        const FrozenGraph& graph() const {
+            return snapshot->graph;
+        }
+
+        uint64_t version() const {
+            return snapshot->version;
+        }
+
+    private:
+        Epoch::Guard guard;                 // Declared first: pinned before the load
+        const NetworkSnapshot* snapshot;
+    };
+
+    Graph_M() : current(new NetworkSnapshot{FrozenGraph(), nextVersion++}) {
+        owned = current.load();
+        version = owned->version;
+    }
+
+    ~Graph_M() {
+        lock_guard<mutex> lock(writeLock);
+        replace(nullptr);
+        Epoch::retire(owned);
+    }
+
+    Graph_M(const Graph_M&) = delete;
+    Graph_M& operator=(const Graph_M&) = delete;
+
+    // Pins the current network for reading from any thread
+    Reader read() const {
+        return Reader(*this);
+    }
+
+    // Returns the current network, publishing pending edits first; owner thread only
+    const FrozenGraph& frozen() {
+        if (dirty.load(memory_order_acquire)) publish();
+        if (current.load(memory_order_acquire) != owned) {
+            // Swap the owner's pin to the new snapshot; publishers skipped retiring the old one
+            lock_guard<mutex> lock(writeLock);
+            const NetworkSnapshot* snap = current.load();
+            if (owned != snap) Epoch::retire(owned);
+            owned = snap;
+            version = snap->version;
+        }
+        return owned->graph;
+    }
+
+    /**
+     * Publishes the pending edits as a new snapshot. Edits to connections
+     * only are patched into the previous snapshot, sharing its station
+     * index; adding or removing a station refreezes the builder. Readers
+     * holding the old snapshot keep it until they finish.
+     */
+    void publish() {
+        lock_guard<mutex> lock(writeLock);
+        if (!dirty.load(memory_order_relaxed)) return;
+        const NetworkSnapshot* old = current.load();
+        NetworkSnapshot* next = new NetworkSnapshot{
+            stationsChanged ? builder.freeze() : GraphBuilder::patch(old->graph, pending), nextVersion++};
+        pending.clear();
+        stationsChanged = false;
+        dirty.store(false, memory_order_release);
+        replace(next);
+    }
+
+    // Replaces the whole network with the contents of a builder
+    void load(const GraphBuilder& b) {
+        {
+            lock_guard<mutex> lock(writeLock);
+            builder = b;
+            builderStale = false;
+            stationsChanged = true;
+            dirty.store(true);
+        }
+        publish();
+    }
+
+    /**
+     * Replaces the whole network with one already frozen and publishes
+     * it as is. The builder is filled from it only on the first edit.
+     */
+    void load(FrozenGraph g) {
+        lock_guard<mutex> lock(writeLock);
+        pending.clear();
+        stationsChanged = false;
+        builderStale = true;
+        dirty.store(false);
+        replace(new NetworkSnapshot{std::move(g), nextVersion++});
+    }
+
+    // Returns the number of stations in the graph
+    int numVetex() {
+        return frozen().numStations();
+    }
+
+    // Checks if a station exists in the graph
+    bool containsVertex(string vname) {
+        lock_guard<mutex> lock(writeLock);
+        thaw();
+        return builder.findId(vname) != NO_STATION;
+    }
+
+    // Adds a new station to the graph
+    void addVertex(string vname) {
+        lock_guard<mutex> lock(writeLock);
+        thaw();
+        if (builder.findId(vname) != NO_STATION) return;
+        builder.addStation(vname);
+        stationsChanged = true;
+        dirty.store(true);
+    }
+
+    // Removes a station from the graph and all its connections
+    void removeVertex(string vname) {
+        lock_guard<mutex> lock(writeLock);
+        thaw();
+        if (builder.removeStation(builder.findId(vname))) {
+            stationsChanged = true;
+            dirty.store(true);
+        }
+    }
+
+    // Returns the number of connections in the graph
+    int numEdges() {
+        return frozen().numEdges();
+    }
+
+    // Checks if a direct connection exists between two stations
+    bool containsEdge(string vname1, string vname2) {
+        const FrozenGraph& g = frozen();
+        uint32_t u = g.findId(vname1);
+        uint32_t v = g.findId(vname2);
+        if (u == NO_STATION || v == NO_STATION) return false;
+        return g.edgeWeight(u, v) >= 0;
+    }
+
+    // Adds a connection between two stations with given distance
+    void addEdge(string vname1, string vname2, int value) {
+        lock_guard<mutex> lock(writeLock);
+        thaw();
+        uint32_t u = builder.findId(vname1);
+        uint32_t v = builder.findId(vname2);
+        if (u == NO_STATION || v == NO_STATION) return;
+        builder.addConnection(u, v, value);
+        pending.push_back({u, v, value});
+        dirty.store(true);
+    }
+
+    // Removes a connection between two stations
+    void removeEdge(string vname1, string vname2) {
+        lock_guard<mutex> lock(writeLock);
+        thaw();
+        uint32_t u = builder.findId(vname1);
+        uint32_t v = builder.findId(vname2);
+        if (u == NO_STATION || v == NO_STATION) return;
+        if (builder.removeConnection(u, v)) {
+            pending.push_back({u, v, -1});
+            dirty.store(true);
+        }
+    }
+
+    // Displays the complete metro map in the given format
+    void display_Map(Renderer::Format format = Renderer::TEXT) {
+        const FrozenGraph& g = frozen();
+        Renderer render(format);
+        BufferedWriter out(stdout);
+        render.mapHeader(out.data(), g);
+        for (uint32_t u = 0; u < g.numStations(); u++) {
+            render.mapStation(out.data(), g, u);
+            out.endRecord();
+        }
+        render.mapFooter(out.data());
+    }
+
+    // Displays all stations in the metro in the given format
+    void display_Stations(Renderer::Format format = Renderer::TEXT) {
+        const FrozenGraph& g = frozen();
+        Renderer render(format);
+        BufferedWriter out(stdout);
+        render.stationsHeader(out.data(), g);
+        for (uint32_t u = 0; u < g.numStations(); u++) {
+            render.station(out.data(), g, u);
+            out.endRecord();
+        }
+        render.stationsFooter(out.data());
+    }
+
+    // Checks if a path exists between two stations using the component labels
+    bool hasPath(uint32_t src, uint32_t dst) {
+        QUERY_STATS(QueryStats::Scope stats(src, dst);)
+        return frozen().connected(src, dst);
+    }
+
+    bool hasPath(string vname1, string vname2) {
+        const FrozenGraph& g = frozen();
+        uint32_t src = g.resolve(vname1);
+        uint32_t dst = g.resolve(vname2);
+        if (src == NO_STATION || dst == NO_STATION) return false;
+        return hasPath(src, dst);
+    }
+
+    QueryContext context;   // Scratch and output buffers reused by every query on this instance
+
+    // Answers of earlier route queries, keyed by the network version they were computed on
+    static constexpr size_t DEFAULT_CACHE_BYTES = 8 << 20;
+    RouteCache routeCache{DEFAULT_CACHE_BYTES};
+
+    // Search engines that RouteQuery can use
+    enum Engine { DIJKSTRA, ALT, LINES };
+
+    // Cost of changing line for line-aware routing: km when by distance, seconds when by time
+    static constexpr int DEFAULT_TRANSFER_KM = 1, DEFAULT_TRANSFER_SECONDS = 300;
+    int transferPenalty[2] = {DEFAULT_TRANSFER_KM, DEFAULT_TRANSFER_SECONDS};
+
+    ParetoRoutes::Scratch paretoScratch;
+
+    // Largest share of an alternative route's distance that may repeat an earlier one
+    static constexpr double DEFAULT_OVERLAP = 0.8;
+    double alternativeOverlap = DEFAULT_OVERLAP;
+    LineGraph lineGraph;
+    uint64_t lineGraphVersion = 0;
+
+    // Returns the line state graph, building it on first use
+    const LineGraph& lines() {
+        const FrozenGraph& g = frozen();
+        if (lineGraphVersion != version) {
+            lineGraph = LineGraph::build(g);
+            lineGraphVersion = version;
+        }
+        return lineGraph;
+    }
+
+    // Service hours and headway of the generated timetable, in seconds after midnight
+    static constexpr int SERVICE_START = 6 * 3600;
+    static constexpr int SERVICE_END = 23 * 3600;
+    static constexpr int SERVICE_HEADWAY = 300;
+    Timetable timetable;
+    uint64_t timetableVersion = 0;
+    string timetableFile;               // Schedule to load, empty for the generated one
+    Timetable::Scratch timetableScratch;
+
+    /**
+     * Loads a schedule for the current network from a file, replacing the
+     * generated one. It is loaded again whenever the network changes.
+     * @return Empty string on success, otherwise the reason it failed
+     */
+    string loadTimetable(const string& path) {
+        Timetable tt;
+        string err = Timetable::load(path, frozen(), tt);
+        if (!err.empty()) return err;
+        timetable = std::move(tt);
+        timetableFile = path;
+        timetableVersion = version;
+        return "";
+    }
+
+    // Returns the timetable, generating it from the lines on first use
+    const Timetable& schedule() {
+        const FrozenGraph& g = frozen();
+        if (timetableVersion != version) {
+            string err;
+            if (!timetableFile.empty()) err = Timetable::load(timetableFile, g, timetable);
+            if (!err.empty()) cerr << "Timetable " << timetableFile << " rejected: " << err << "\n";
+            if (timetableFile.empty() || !err.empty()) {
+                timetable = Timetable::fromNetwork(g, SERVICE_START, SERVICE_END, SERVICE_HEADWAY);
+            }
+            timetableVersion = version;
+        }
+        return timetable;
+    }
+
+    static const uint32_t NUM_LANDMARKS = 16;
+    static const vector<uint32_t> CRP_CELL_SIZES;   // Minimum stations per cell, finest level first
+    LandmarkIndex landmarks[2];             // ALT index per metric (distance, time)
+    vector<int> landmarkCosts[2];           // Edge costs the indexes were built with
+    uint64_t landmarkVersion[2] = {0, 0};   // Graph version the indexes belong to
+
+    // Returns the ALT index for a metric, building it on first use
+    const LandmarkIndex& landmarkIndex(bool nan) {
+        const FrozenGraph& g = frozen();
+        if (landmarkVersion[nan] != version) {
+            landmarkCosts[nan] = nan ? edgeCosts<TimeCost>(g) : edgeCosts<DistanceCost>(g);
+            landmarks[nan] = LandmarkIndex::build(g, landmarkCosts[nan], NUM_LANDMARKS);
+            landmarkVersion[nan] = version;
+        }
+        return landmarks[nan];
+    }
+
+    /**
+     * Dijkstra's algorithm to find shortest distance or time between stations
+     * @param src Source station ID
+     * @param des Destination station ID
+     * @param nan If true, calculates time; if false, calculates distance
+     * @return Minimum cost (distance in km or time in seconds)
+     */
+    int dijkstra(uint32_t src, uint32_t des, bool nan) {
+        QUERY_STATS(QueryStats::Scope stats(src, des);)
+        if (nan) return DijkstraEngine::run<TimeCost>(frozen(), src, des, context.forward);
+        return DijkstraEngine::run<DistanceCost>(frozen(), src, des, context.forward);
+    }
+
+    int dijkstra(const string& src, const string& des, bool nan) {
+        const FrozenGraph& g = frozen();
+        uint32_t s = g.resolve(src);
+        uint32_t d = g.resolve(des);
+        if (s == NO_STATION || d == NO_STATION) return INT_MAX;
+        return dijkstra(s, d, nan);
+    }
+
+    /**
+     * Answers a route query with a single shortest path search.
+     * Reachability comes from the component labels, so unreachable pairs
+     * cost nothing; the other metric is summed along the chosen path.
+     * @param nan If true, the route minimises time; otherwise distance
+     * @param engine DIJKSTRA, ALT for a landmark-guided bidirectional A*,
+     *               or LINES for line-aware routing with transfer penalties
+     */
+    RouteResult RouteQuery(uint32_t src, uint32_t dst, bool nan, Engine engine = DIJKSTRA) {
+        QUERY_STATS(QueryStats::Scope stats(src, dst);)
+        const FrozenGraph& g = frozen();
+        RouteCache::Key key{src, dst, nan + 2u * engine, version};
+        RouteResult res;
+        if (routeCache.lookup(key, res)) {
+            context.forward.settled = context.backward.settled = 0;
+            return res;
+        }
+        if (engine == LINES) {
+            const LineGraph& lg = lines();
+            if (nan) res = lg.route<TimeCost>(g, src, dst, transferPenalty[1], context.forward);
+            else res = lg.route<DistanceCost>(g, src, dst, transferPenalty[0], context.forward);
+        } else if (engine == ALT) {
+            const LandmarkIndex& lm = landmarkIndex(nan);
+            res = lm.route(g, landmarkCosts[nan], src, dst, context.forward, context.backward);
+        } else {
+            res = RouteQuery(g, src, dst, nan, context.forward);
+        }
+        routeCache.insert(key, res);
+        return res;
+    }
+
+    // Returns the stations settled by the last RouteQuery, 0 if it came from the cache
+    uint32_t lastSettled(Engine engine) const {
+        return engine == ALT ? context.forward.settled + context.backward.settled : context.forward.settled;
+    }
+
+    // Thread-safe form for callers that own their graph reference and scratch
+    static RouteResult RouteQuery(const FrozenGraph& g, uint32_t src, uint32_t dst,
+                                  bool nan, SearchScratch& s) {
+        QUERY_STATS(QueryStats::Scope stats(src, dst);)
+        RouteResult res;
+        if (!g.connected(src, dst)) return res;
+
+        if (nan) {
+            DijkstraEngine::run<TimeCost>(g, src, dst, s);
+        } else {
+            DijkstraEngine::run<DistanceCost>(g, src, dst, s);
+        }
+        res.fill(g, DijkstraEngine::path(s, dst));
+        return res;
+    }
+
+    /**
+     * Answers a Dijkstra route query into context.result, from the route
+     * cache when it holds the pair. The path text is then formatted from
+     * context.result as usual.
+     */
+    const RouteResult& cachedRoute(const FrozenGraph& g, uint32_t src, uint32_t dst, bool nan) {
+        RouteCache::Key key{src, dst, nan + 2u * DIJKSTRA, version};
+        if (routeCache.lookup(key, context.result)) {
+            context.arena.reset();
+            context.forward.settled = 0;
+            return context.result;
+        }
+        context.route(g, src, dst, nan);
+        routeCache.insert(key, context.result);
+        return context.result;
+    }
+
+    RouteResult RouteQuery(const string& src, const string& dst, bool nan, Engine engine = DIJKSTRA) {
+        const FrozenGraph& g = frozen();
+        uint32_t s = g.resolve(src);
+        uint32_t d = g.resolve(dst);
+        if (s == NO_STATION || d == NO_STATION) return RouteResult();
+        return RouteQuery(s, d, nan, engine);
+    }
+
+    /**
+     * Finds the journey between two stations that arrives earliest when
+     * leaving at depart, by the timetable, with times on every leg.
+     * @param depart Seconds after midnight
+     */
+    RouteResult EarliestArrivalQuery(const string& src, const string& dst, int depart) {
+        const FrozenGraph& g = frozen();
+        uint32_t s = g.resolve(src);
+        uint32_t d = g.resolve(dst);
+        if (s == NO_STATION || d == NO_STATION) return RouteResult();
+        const Timetable& tt = schedule();
+        QUERY_STATS(QueryStats::Scope stats(s, d);)
+        return tt.earliestArrival(g, s, d, depart, timetableScratch);
+    }
+
+    /**
+     * Lists the departures between two stations in [from, until] that
+     * arrive before any later one, with their earliest arrivals.
+     */
+    vector<pair<int, int>> DepartureProfile(const string& src, const string& dst, int from, int until) {
+        const FrozenGraph& g = frozen();
+        uint32_t s = g.resolve(src);
+        uint32_t d = g.resolve(dst);
+        if (s == NO_STATION || d == NO_STATION) return {};
+        const Timetable& tt = schedule();
+        QUERY_STATS(QueryStats::Scope stats(s, d);)
+        return tt.profile(s, d, from, until, timetableScratch);
+    }
+
+    /**
+     * Finds up to k distinct loopless routes between two stations, best
+     * first, each with its distance, time, interchanges and fare.
+     * @param nan If true, routes are ranked by time; otherwise by distance
+     */
+    vector<RouteResult> AlternativeRouteQuery(const string& src, const string& dst, bool nan, uint32_t k) {
+        const FrozenGraph& g = frozen();
+        uint32_t s = g.resolve(src);
+        uint32_t d = g.resolve(dst);
+        if (s == NO_STATION || d == NO_STATION) return {};
+        QUERY_STATS(QueryStats::Scope stats(s, d);)
+        if (nan) return AlternativeRoutes::find<TimeCost>(g, s, d, k, alternativeOverlap, context);
+        return AlternativeRoutes::find<DistanceCost>(g, s, d, k, alternativeOverlap, context);
+    }
+
+    /**
+     * Finds every route between two stations that no other route beats
+     * on time, fare and interchanges together, fastest first.
+     * @param maxExtra Seconds a route may take over the fastest one, INT_MAX for any
+     */
+    vector<RouteResult> ParetoRouteQuery(const string& src, const string& dst, int maxExtra = INT_MAX) {
+        const FrozenGraph& g = frozen();
+        uint32_t s = g.resolve(src);
+        uint32_t d = g.resolve(dst);
+        vector<RouteResult> routes;
+        if (s == NO_STATION || d == NO_STATION) return routes;
+        const LineGraph& lg = lines();
+        QUERY_STATS(QueryStats::Scope stats(s, d);)
+        ParetoRoutes::find(g, lg, s, d, maxExtra, paretoScratch, routes);
+        return routes;
+    }
+
+    /**
+     * Streams every station reachable from src within a budget, nearest
+     * first, from one bounded search; see Isochrone::run.
+     * @param budget In km, seconds or Rs. as metric says
+     */
+    template <class Visit>
+    uint32_t ReachableQuery(uint32_t src, Isochrone::Metric metric, int budget, Visit visit) {
+        QUERY_STATS(QueryStats::Scope stats(src, NO_STATION);)
+        return Isochrone::run(frozen(), src, metric, budget, context.forward, context.reach, visit);
+    }
+
+    // Joins the stations of a route with two spaces, as the string API expects
+    string pathString(const RouteResult& res) {
+        const FrozenGraph& g = frozen();
+        string ans = "";
+        for (uint32_t id : res.stations) {
+            ans += g.name(id) + "  ";
+        }
+        return ans;
+    }
+
+    // Prints a route one numbered stop per line, joining interchange pairs with ==>
+    void printRoute(const RouteResult& res) {
+        const FrozenGraph& g = frozen();
+        if (!res.legs.empty()) {
+            printLegs(res);
+            return;
+        }
+        size_t next = 0;
+        int n = 1;
+        for (size_t i = 0; i < res.stations.size(); i++) {
+            cout << n++ << ". " << g.name(res.stations[i]);
+            if (next < res.interchanges.size() && res.interchanges[next] == i) {
+                cout << " ==> " << g.name(res.stations[++i]);
+                next++;
+            }
+            cout << "\n";
+        }
+    }
+
+    // Prints a line-aware route leg by leg
+    void printLegs(const RouteResult& res) {
+        const FrozenGraph& g = frozen();
+        int n = 1;
+        for (const RouteLeg& leg : res.legs) {
+            cout << n++ << ". " << g.lineName(leg.line) << " line: " << g.name(leg.board)
+                 << " -> " << g.name(leg.alight) << " (" << leg.stops
+                 << (leg.stops == 1 ? " stop" : " stops");
+            if (leg.depart >= 0) cout << ", " << formatClock(leg.depart) << " - " << formatClock(leg.arrive);
+            cout << ")\n";
+        }
+    }
+
+    // Returns text followed by suffix, allocating once
+    static string withSuffix(string_view text, const string& suffix) {
+        string ans;
+        ans.reserve(text.size() + suffix.size());
+        ans.append(text);
+        ans += suffix;
+        return ans;
+    }
+
+    /**
+     * Finds the path with minimum distance between two stations.
+     * @return Stations separated by two spaces, followed by the distance
+     */
+    string Get_Minimum_Distance(const string& src, const string& dst) {
+        const FrozenGraph& g = frozen();
+        uint32_t s = g.resolve(src);
+        uint32_t d = g.resolve(dst);
+        if (s == NO_STATION || d == NO_STATION) return to_string(INT_MAX);
+        QUERY_STATS(QueryStats::Scope stats(s, d);)
+        const RouteResult& res = cachedRoute(g, s, d, false);
+        if (!res.found) return to_string(INT_MAX);
+        return withSuffix(context.pathText(g), to_string(res.distance));
+    }
+
+    /**
+     * Finds the path with minimum time between two stations.
+     * @return Stations separated by two spaces, followed by the time in minutes
+     */
+    string Get_Minimum_Time(const string& src, const string& dst) {
+        const FrozenGraph& g = frozen();
+        uint32_t s = g.resolve(src);
+        uint32_t d = g.resolve(dst);
+        if (s == NO_STATION || d == NO_STATION) return to_string(ceil((double)INT_MAX / 60));
+        QUERY_STATS(QueryStats::Scope stats(s, d);)
+        const RouteResult& res = cachedRoute(g, s, d, true);
+        if (!res.found) return to_string(ceil((double)INT_MAX / 60));
+        // Convert seconds to minutes
+        double minutes = ceil((double)res.time / 60);
+        return withSuffix(context.pathText(g), to_string(minutes));
+    }
+
+    /**
+     * Parses the path string to identify interchanges between metro lines.
+     * Kept for callers holding path strings; RouteQuery reports the
+     * interchanges directly in RouteResult::interchanges.
+     * @param str Path string containing stations and distances/times
+     * @return Vector containing stations and interchange information
+     */
+    vector<string> get_Interchanges(string str) {
+        vector<string> arr;
+        vector<string> tokens;
+        stringstream ss(str);
+        string token;
+        
+        // Split the path string into tokens
+        while (getline(ss, token, ' ')) {
+            if (!token.empty()) {
+                tokens.push_back(token);
+            }
+        }
+        
+        if (tokens.empty()) return arr;
+        
+        arr.push_back(tokens[0]);
+        int interchange_count = 0;
+
+        for (size_t i = 1; i < tokens.size() - 1; i++) {
+            size_t index = tokens[i].find('~');
+            if (index == string::npos) continue;
+            
+            string line = tokens[i].substr(index + 1);
+            
+            if (line.length() == 2) {
+                // Check if this is an interchange station
+                string prev_line = tokens[i-1].substr(tokens[i-1].find('~') + 1);
+                string next_line = tokens[i+1].substr(tokens[i+1].find('~') + 1);
+                
+                if (prev_line != next_line) {
+                    // Add interchange information
+                    arr.push_back(tokens[i] + " ==> " + tokens[i + 1]);
+                    i++; // Skip next station as we've already processed it
+                    interchange_count++;
+                } else {
+                    arr.push_back(tokens[i]);
+                }
+            } else {
+                arr.push_back(tokens[i]);
+            }
+        }
+        
+        arr.push_back(tokens.back());
+        arr.push_back(to_string(interchange_count));
+        return arr;
+    }
+
+    /**
+     * Calculates the fare based on number of stations traveled.
+     * @param src Source station
+     * @param dst Destination station
+     * @param x 7 for distance-wise, 8 for time-wise
+     * @return Vector containing number of stations and fare
+     */
+    vector<int> Get_Minimum_Fare(const string& src, const string& dst, int x) {
+        const FrozenGraph& g = frozen();
+        uint32_t s = g.resolve(src);
+        uint32_t d = g.resolve(dst);
+        if (s == NO_STATION || d == NO_STATION) return {0, 0};
+        QUERY_STATS(QueryStats::Scope stats(s, d);)
+        const RouteResult& res = cachedRoute(g, s, d, x != 7);
+        return {res.numStations(), res.fare};
+    }
+
+    /**
+     * Creates the Delhi Metro map with stations and connections, from
+     * the tables BuiltinNetwork built at compile time.
+     */
+    static void Create_Metro_Map(Graph_M &g) {
+        g.load(BuiltinNetwork::freeze());
+    }
+
+private:
+    // Fills builder from the published network after load(FrozenGraph); writeLock held
+    void thaw() {
+        if (!builderStale) return;
+        builder = GraphBuilder::thaw(current.load()->graph);
+        builderStale = false;
+    }
+
+    // Publishes next, retiring the old snapshot unless the owner still holds it; writeLock held
+    void replace(const NetworkSnapshot* next) {
+        const NetworkSnapshot* old = current.exchange(next);
+        if (old != owned) Epoch::retire(old);
+    }
+
+    static atomic<uint64_t> nextVersion;
+    atomic<const NetworkSnapshot*> current;     // Published network, replaced whole by publish()
+    const NetworkSnapshot* owned;               // Snapshot frozen() last returned, pinned for the owner
+    mutex writeLock;                            // Serialises writers; readers never take it
+    atomic<bool> dirty{false};                  // True if builder changed since the last publish
+    bool stationsChanged = false;               // Pending edits add or remove stations
+    bool builderStale = false;                  // builder is empty and the network is in current
+    vector<GraphBuilder::Connection> pending;   // Connection edits since the last publish, -1 km removes
+};
+
+// Initialize static members
+atomic<uint64_t> Graph_M::nextVersion{1};
+const vector<uint32_t> Graph_M::CRP_CELL_SIZES = {64, 1024};
+
+// Returns a frozen copy of the built-in Delhi network
+FrozenGraph builtinNetwork() {
+    return BuiltinNetwork::freeze();
+}
+
+/**
+ * NetworkFile reads and writes whole networks, so the map can be changed
+ * without recompiling. Two formats are supported:
+ *
+ *   CSV, one record per line ('#' starts a comment):
+ *     station,<name>
+ *     edge,<name1>,<name2>,<km>
+ *     line,<letter>,<display name>
+ *   Stations named by an edge are added if not declared before.
+ *
+ *   Binary: "DMNET" magic, version, counts, then every name as a length
+ *   and bytes, the line names the same way, and the connections as
+ *   (u, v, km) triples in native byte order.
+ *
+ * Both are read in one pass through a fixed-size buffer and inserted
+ * straight into a GraphBuilder, so only the network itself is held.
+ */
+class NetworkFile {
+public:
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+    /**
+     * Loads a network file in either format into b, replacing its contents.
+     * @return Empty string on success, otherwise the reason it failed
+     */
+    static string load(const string& path, GraphBuilder& b) {
+        Reader in;
+        if (!in.open(path)) return "cannot open " + path;
+        b = GraphBuilder();
+
+        char magic[8];
+        if (in.peek(magic, sizeof(magic)) && memcmp(magic, MAGIC, sizeof(magic)) == 0) {
+            return loadBinary(in, b);
+        }
+        return loadCsv(in, b);
+    }
+
+    // Writes a network as CSV
+    static bool saveCsv(const FrozenGraph& g, const string& path) {
+        ofstream out(path, ios::trunc);
+        if (!out) return false;
+        for (int i = 0; i < 26; i++) {
+            if (!g.lineNames[i].empty()) out << "line," << (char)('A' + i) << ',' << g.lineNames[i] << '\n';
+        }
+        for (const string& name : g.stations->names) {
+            out << "station," << name << '\n';
+        }
+        for (uint32_t u = 0; u < g.numStations(); u++) {
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                if (g.targets[e] > u) {
+                    out << "edge," << g.name(u) << ',' << g.name(g.targets[e]) << ',' << g.weights[e] << '\n';
+                }
+            }
+        }
+        return (bool)out;
+    }
+
+    // Writes a network in the binary format
+    static bool saveBinary(const FrozenGraph& g, const string& path) {
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out) return false;
+        uint32_t n = g.numStations();
+        uint32_t m = g.numEdges();
+        out.write(MAGIC, 8);
+        out.write((const char*)&VERSION, sizeof(VERSION));
+        out.write((const char*)&n, sizeof(n));
+        out.write((const char*)&m, sizeof(m));
+        for (const string& name : g.stations->names) {
+            writeString(out, name);
+        }
+        for (const string& name : g.lineNames) {
+            writeString(out, name);
+        }
+        for (uint32_t u = 0; u < n; u++) {
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                if (g.targets[e] <= u) continue;
+                int32_t triple[3] = {(int32_t)u, (int32_t)g.targets[e], g.weights[e]};
+                out.write((const char*)triple, sizeof(triple));
+            }
+        }
+        return (bool)out;
+    }
+
+    // Writes CSV if the path ends in .csv, otherwise binary
+    static bool save(const FrozenGraph& g, const string& path) {
+        bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+        return csv ? saveCsv(g, path) : saveBinary(g, path);
+    }
+
+private:
+    static constexpr char MAGIC[9] = "DMNET\0\0\0";
+
+    /**
+     * Reader class streams a file through one reusable buffer.
+     */
+    class Reader {
+    public:
+        ~Reader() {
+            if (fd >= 0) ::close(fd);
+        }
+
+        bool open(const string& path) {
+            fd = ::open(path.c_str(), O_RDONLY);
+            buf.resize(BUFFER_SIZE);
+            return fd >= 0;
+        }
+
+        // Size of the whole file in bytes
+        uint64_t size() const {
+            struct stat st;
+            return fstat(fd, &st) == 0 ? st.st_size : 0;
+        }
+
+        // Copies the next len bytes without consuming them
+        bool peek(char* dst, size_t len) {
+            if (!fill(len)) return false;
+            memcpy(dst, buf.data() + pos, len);
+            return true;
+        }
+
+        bool read(void* dst, size_t len) {
+            char* out = (char*)dst;
+            while (len > 0) {
+                if (!fill(1)) return false;
+                size_t k = min(len, end - pos);
+                memcpy(out, buf.data() + pos, k);
+                pos += k;
+                out += k;
+                len -= k;
+            }
+            return true;
+        }
+
+        // Reads one line without its terminator; false at end of file
+        bool getline(string& line) {
+            line.clear();
+            while (true) {
+                if (pos == end && !fill(1)) return !line.empty();
+                const char* start = buf.data() + pos;
+                const char* nl = (const char*)memchr(start, '\n', end - pos);
+                if (nl) {
+                    line.append(start, nl - start);
+                    pos += nl - start + 1;
+                    if (!line.empty() && line.back() == '\r') line.pop_back();
+                    return true;
+                }
+                line.append(start, end - pos);
+                pos = end;
+            }
+        }
+
+    private:
+        int fd = -1;
+        vector<char> buf;
+        size_t pos = 0, end = 0;
+
+        // Makes at least len bytes available, refilling the buffer if needed
+        bool fill(size_t len) {
+            if (end - pos >= len) return true;
+            memmove(buf.data(), buf.data() + pos, end - pos);
+            end -= pos;
+            pos = 0;
+            while (end < len) {
+                ssize_t r = ::read(fd, buf.data() + end, buf.size() - end);
+                if (r <= 0) return false;
+                end += r;
+            }
+            return true;
+        }
+    };
+
+    static void writeString(ofstream& out, const string& s) {
+        uint32_t len = s.size();
+        out.write((const char*)&len, sizeof(len));
+        out.write(s.data(), len);
+    }
+
+    static bool readString(Reader& in, string& s) {
+        uint32_t len;
+        if (!in.read(&len, sizeof(len)) || len > BUFFER_SIZE) return false;
+        s.resize(len);
+        return in.read(&s[0], len);
+    }
+
+    static string loadBinary(Reader& in, GraphBuilder& b) {
+        char magic[8];
+        uint32_t version, n, m;
+        in.read(magic, sizeof(magic));
+        if (!in.read(&version, 4) || !in.read(&n, 4) || !in.read(&m, 4)) return "file truncated";
+        if (version != VERSION) return "unsupported version " + to_string(version);
+        // Each station takes at least its name length and each connection 12 bytes,
+        // so counts the file cannot hold are corrupt rather than worth reserving for
+        if (4 * (uint64_t)n + 12 * (uint64_t)m > in.size()) return "file truncated";
+
+        b.reserve(n, m);
+        string name;
+        for (uint32_t i = 0; i < n; i++) {
+            if (!readString(in, name)) return "file truncated";
+            if (b.addStation(name) != i) return "duplicate station " + name;
+        }
+        for (string& line : b.lineNames) {
+            if (!readString(in, line)) return "file truncated";
+        }
+        for (uint32_t i = 0; i < m; i++) {
+            int32_t triple[3];
+            if (!in.read(triple, sizeof(triple))) return "file truncated";
+            if ((uint32_t)triple[0] >= n || (uint32_t)triple[1] >= n) return "connection to unknown station";
+            if (triple[2] < 0) return "bad distance";
+            b.addConnection(triple[0], triple[1], triple[2]);
+        }
+        return "";
+    }
+
+    static string loadCsv(Reader& in, GraphBuilder& b) {
+        string line;
+        vector<string> fields;
+        size_t lineNo = 0;
+
+        while (in.getline(line)) {
+            lineNo++;
+            if (line.empty() || line[0] == '#') continue;
+
+            fields.clear();
+            size_t start = 0;
+            while (true) {
+                size_t comma = line.find(',', start);
+                fields.emplace_back(line, start, comma == string::npos ? string::npos : comma - start);
+                if (comma == string::npos) break;
+                start = comma + 1;
+            }
+
+            const string& kind = fields[0];
+            if (kind == "station" && fields.size() == 2) {
+                b.addStation(fields[1]);
+            } else if (kind == "edge" && fields.size() == 4) {
+                char* rest;
+                long km = strtol(fields[3].c_str(), &rest, 10);
+                if (*rest != '\0' || km < 0) return "line " + to_string(lineNo) + ": bad distance";
+                b.addConnection(b.addStation(fields[1]), b.addStation(fields[2]), km);
+            } else if (kind == "line" && fields.size() == 3 && fields[1].size() == 1 && isupper(fields[1][0])) {
+                b.lineNames[fields[1][0] - 'A'] = fields[2];
+            } else {
+                return "line " + to_string(lineNo) + ": unrecognised record";
+            }
+        }
+        return "";
+    }
+};
+
+/**
+ * SyntheticMetro generates metro-like networks of a requested size for
+ * stress tests: straight lines crossing the city near its centre, ring
+ * lines around it, an interchange wherever two lines cross, and ordinary
+ * stations every 1-3 km in between. The same seed gives the same network.
+ */
+class SyntheticMetro {
+public:
+    /**
+     * Generates a network of about the given number of stations.
+     * Lines are lettered A-Z, so there are at most 26 of them; larger
+     * networks get longer lines rather than more of them.
+     */
+    static GraphBuilder generate(uint32_t stations, uint32_t seed) {
+        mt19937 rng(seed);
+        uniform_real_distribution<double> unit(0, 1);
+        uint32_t radials = min(18u, max(3u, (uint32_t)lround(sqrt((double)stations) / 6)));
+        uint32_t rings = min(8u, max(1u, radials / 3));
+
+        // Line shapes in a circle of radius 1, scaled to km below
+        vector<Line> lines;
+        for (uint32_t i = 0; i < radials; i++) {
+            Line l;
+            l.letter = 'A' + i;
+            l.ring = false;
+            l.angle = M_PI * (i + 0.8 * unit(rng)) / radials;
+            l.offset = 0.3 * (unit(rng) - 0.5);
+            l.radius = sqrt(1 - l.offset * l.offset);
+            lines.push_back(l);
+        }
+        for (uint32_t j = 0; j < rings; j++) {
+            Line l;
+            l.letter = 'A' + radials + j;
+            l.ring = true;
+            l.angle = 0;
+            l.offset = 0;
+            l.radius = 0.2 + 0.75 * (j + 0.5 + 0.4 * (unit(rng) - 0.5)) / rings;
+            lines.push_back(l);
+        }
+
+        double length = 0;
+        for (const Line& l : lines) {
+            length += l.ring ? 2 * M_PI * l.radius : 2 * l.radius;
+        }
+        double scale = 2.0 * stations / length; // Average spacing of 2 km
+
+        GraphBuilder b;
+        b.reserve(stations + stations / 16, stations + stations / 16);
+
+        // Interchanges where two lines cross
+        uint32_t interchanges = 0;
+        auto addInterchange = [&](Line& a, double pa, Line& c, double pc) {
+            string name = "X" + to_string(interchanges++) + "~" + string(1, min(a.letter, c.letter))
+                        + string(1, max(a.letter, c.letter));
+            uint32_t id = b.addStation(name);
+            a.stops.push_back({pa, id});
+            c.stops.push_back({pc, id});
+        };
+        for (uint32_t i = 0; i < radials; i++) {
+            Line& a = lines[i];
+            for (uint32_t k = i + 1; k < radials; k++) {
+                Line& c = lines[k];
+                double s = sin(c.angle - a.angle);
+                if (fabs(s) < 1e-9) continue;
+                // Solve offset_a * n_a + t_a * u_a == offset_c * n_c + t_c * u_c
+                double dx = c.offset * -sin(c.angle) - a.offset * -sin(a.angle);
+                double dy = c.offset * cos(c.angle) - a.offset * cos(a.angle);
+                double ta = (dx * sin(c.angle) - dy * cos(c.angle)) / s;
+                double tc = (dx * sin(a.angle) - dy * cos(a.angle)) / s;
+                if (fabs(ta) < a.radius && fabs(tc) < c.radius) addInterchange(a, ta, c, tc);
+            }
+            for (uint32_t k = radials; k < lines.size(); k++) {
+                Line& c = lines[k];
+                if (fabs(a.offset) >= c.radius) continue;
+                double t = sqrt(c.radius * c.radius - a.offset * a.offset);
+                for (double ta : {-t, t}) {
+                    double x = -a.offset * sin(a.angle) + ta * cos(a.angle);
+                    double y = a.offset * cos(a.angle) + ta * sin(a.angle);
+                    double phi = atan2(y, x);
+                    addInterchange(a, ta, c, (phi < 0 ? phi + 2 * M_PI : phi) * c.radius);
+                }
+            }
+        }
+
+        // Ordinary stations every 1-3 km between stops along each line
+        for (Line& l : lines) {
+            uint32_t count = 0;
+            auto addStop = [&]() {
+                return b.addStation(string(1, l.letter) + "_" + to_string(count++) + "~" + string(1, l.letter));
+            };
+            if (!l.ring) {
+                l.stops.push_back({-l.radius, addStop()});
+                l.stops.push_back({l.radius, addStop()});
+            } else if (l.stops.empty()) {
+                l.stops.push_back({0, addStop()});
+            }
+            sort(l.stops.begin(), l.stops.end());
+
+            size_t segments = l.ring ? l.stops.size() : l.stops.size() - 1;
+            for (size_t i = 0; i < segments; i++) {
+                double from = l.stops[i].first;
+                double to = i + 1 < l.stops.size() ? l.stops[i + 1].first
+                                                   : l.stops[0].first + 2 * M_PI * l.radius;
+                int gap = (int)lround((to - from) * scale);
+                uint32_t prev = l.stops[i].second;
+                while (gap > 3) {
+                    int step = 1 + rng() % 3;
+                    uint32_t id = addStop();
+                    b.addConnection(prev, id, step);
+                    prev = id;
+                    gap -= step;
+                }
+                b.addConnection(prev, l.stops[(i + 1) % l.stops.size()].second, max(1, gap));
+            }
+        }
+        return b;
+    }
+
+private:
+    /**
+     * Line class is one generated line: a chord through the circle at the
+     * given angle and offset from the centre, or a ring of the given radius.
+     * Stops are positions along it (in radius units) with station IDs.
+     */
+    class Line {
+    public:
+        char letter;
+        bool ring;
+        double angle, offset, radius;
+        vector<pair<double, uint32_t>> stops;
+    };
+};
+
+/**
+ * Prints the list of stations with their codes.
+ */
+void printCodelist(const FrozenGraph& g) {
+    cout << "\n***********************************************************************\n";
+    cout << "*                STATION CODES IN THE MAP                             *\n";
+    cout << "***********************************************************************\n";
+    
+    // Codes are unique, so they can be typed instead of the names
+    const vector<string>& codes = g.stations->search().codes;
+    for (uint32_t i = 0; i < g.numStations(); i++) {
+        const string& key = g.name(i);
+        cout << i + 1 << ". " << key;
+        if (key.length() < 22) cout << "\t";
+        if (key.length() < 14) cout << "\t";
+        if (key.length() < 6) cout << "\t";
+        cout << codes[i] << endl;
+    }
+    
+    cout << "***********************************************************************\n";
+}
+
+/**
+ * Reads a station from the menu. Anything resolve() accepts is replaced
+ * by the station's full name; otherwise the closest names are suggested
+ * and the text is returned as typed.
+ */
+string readStation(const FrozenGraph& g, const char* prompt) {
+    string text;
+    cout << prompt;
+    getline(cin, text);
+    uint32_t id = g.resolve(text);
+    if (id != NO_STATION) return g.name(id);
+
+    NameIndex::Scratch s;
+    vector<NameIndex::Match> close;
+    g.stations->search().fuzzy(text, 2, 5, close, s);
+    vector<uint32_t> ids;
+    g.stations->search().complete(text, 5, ids, s);
+    for (const NameIndex::Match& m : close) {
+        ids.push_back(m.id);
+    }
+    if (ids.empty()) return text;
+    cout << "Did you mean:";
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (find(ids.begin(), ids.begin() + i, ids[i]) == ids.begin() + i) cout << "  " << g.name(ids[i]);
+    }
+    cout << "\n";
+    return text;
+}
+
+/**
+ * RouteTable serves precomputed answers for every station pair from a
+ * memory-mapped binary file. For each metric (distance, time) the file
+ * holds four n x n matrices of uint32: next hop, distance, time and fare,
+ * each starting on a 64-byte boundary after a fixed header. The header
+ * records the network fingerprint so a table built for another network
+ * is rejected at load. Values are stored in native byte order.
+ */
+class RouteTable {
+public:
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t UNREACHABLE = UINT32_MAX;
+
+    // Matrix kinds within one metric
+    enum Matrix { NEXT_HOP = 0, DISTANCE = 1, TIME = 2, FARE = 3, NUM_MATRICES = 4 };
+
+    /**
+     * Header class is the fixed-size file prefix.
+     */
+    class Header {
+    public:
+        char magic[8];              // "DMROUTE" + NUL
+        uint32_t version;
+        uint32_t stations;
+        uint64_t networkHash;       // FrozenGraph::fingerprint() of the source network
+        uint64_t sections[2 * NUM_MATRICES];    // Byte offset of each matrix
+        uint8_t reserved[40];
+    };
+    static_assert(sizeof(Header) == 128, "route table header must stay 128 bytes");
+
+    RouteTable() {}
+    RouteTable(const RouteTable&) = delete;
+    RouteTable& operator=(const RouteTable&) = delete;
+
+    ~RouteTable() {
+        close();
+    }
+
+    /**
+     * Runs a full shortest path tree from every station for both metrics
+     * and writes the table to path.
+     * @return False if the file could not be written
+     */
+    static bool build(const FrozenGraph& g, const string& path) {
+        uint32_t n = g.numStations();
+        uint64_t cells = (uint64_t)n * n;
+        Header h = makeHeader(g);
+
+        vector<uint32_t> next(cells), values(cells);
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out) return false;
+        out.write((const char*)&h, sizeof(h));
+
+        SearchScratch s;
+        for (int m = 0; m < 2; m++) {
+            // Next hop from every source, from its shortest path tree
+            for (uint32_t src = 0; src < n; src++) {
+                if (m == 1) {
+                    DijkstraEngine::run<TimeCost>(g, src, NO_STATION, s);
+                } else {
+                    DijkstraEngine::run<DistanceCost>(g, src, NO_STATION, s);
+                }
+                firstHops(s, src, &next[(uint64_t)src * n], n);
+            }
+            writeSection(out, h.sections[m * NUM_MATRICES + NEXT_HOP], next);
+
+            // Totals along the next-hop walk, so served values match served paths
+            for (int k = DISTANCE; k <= FARE; k++) {
+                fillAlongPaths(g, next, k, values);
+                writeSection(out, h.sections[m * NUM_MATRICES + k], values);
+            }
+        }
+        return (bool)out;
+    }
+
+    /**
+     * Maps a table file and checks it against the network.
+     * @return Empty string on success, otherwise the reason it was rejected
+     */
+    string open(const string& path, const FrozenGraph& g) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return "cannot open " + path;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+            ::close(fd);
+            return "file too small";
+        }
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return "mmap failed";
+        base = (const uint8_t*)p;
+        length = st.st_size;
+
+        Header expected = makeHeader(g);
+        const Header* h = (const Header*)base;
+        string err;
+        if (memcmp(h->magic, expected.magic, sizeof(h->magic)) != 0) {
+            err = "not a route table";
+        } else if (h->version != VERSION) {
+            err = "unsupported version " + to_string(h->version);
+        } else if (h->stations != expected.stations || h->networkHash != expected.networkHash) {
+            err = "table was built for a different network";
+        } else if (memcmp(h->sections, expected.sections, sizeof(expected.sections)) != 0) {
+            err = "bad section offsets";
+        } else if (length < expected.sections[2 * NUM_MATRICES - 1] + (uint64_t)expected.stations * expected.stations * 4) {
+            err = "file truncated";
+        }
+        if (!err.empty()) {
+            close();
+            return err;
+        }
+
+        for (int i = 0; i < 2 * NUM_MATRICES; i++) {
+            matrices[i] = (const uint32_t*)(base + expected.sections[i]);
+        }
+        stations = h->stations;
+        return "";
+    }
+
+    void close() {
+        if (base) munmap((void*)base, length);
+        base = nullptr;
+        length = 0;
+        stations = 0;
+    }
+
+    bool isOpen() const {
+        return base != nullptr;
+    }
+
+    // Returns one cell; UNREACHABLE if there is no route
+    uint32_t lookup(bool time, Matrix k, uint32_t src, uint32_t dst) const {
+        return matrices[(time ? NUM_MATRICES : 0) + k][(uint64_t)src * stations + dst];
+    }
+
+    // Rebuilds the full route by walking next hops; a damaged walk gives no route
+    RouteResult route(const FrozenGraph& g, uint32_t src, uint32_t dst, bool time) const {
+        RouteResult res;
+        if (src != dst && lookup(time, NEXT_HOP, src, dst) == UNREACHABLE) return res;
+
+        // Every hop must be a connection, and the walk can visit each station once
+        vector<uint32_t> path = {src};
+        for (uint32_t cur = src; cur != dst; ) {
+            uint32_t next = lookup(time, NEXT_HOP, cur, dst);
+            if (next >= stations || path.size() >= stations || g.edgeWeight(cur, next) < 0) return res;
+            cur = next;
+            path.push_back(cur);
+        }
+        res.fill(g, std::move(path));
+        return res;
+    }
+
+private:
+    const uint8_t* base = nullptr;
+    size_t length = 0;
+    uint32_t stations = 0;
+    const uint32_t* matrices[2 * NUM_MATRICES] = {};
+
+    static Header makeHeader(const FrozenGraph& g) {
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "DMROUTE", 8);
+        h.version = VERSION;
+        h.stations = g.numStations();
+        h.networkHash = g.fingerprint();
+
+        uint64_t bytes = (uint64_t)h.stations * h.stations * 4;
+        uint64_t offset = sizeof(Header);
+        for (int i = 0; i < 2 * NUM_MATRICES; i++) {
+            offset = (offset + 63) & ~(uint64_t)63;
+            h.sections[i] = offset;
+            offset += bytes;
+        }
+        return h;
+    }
+
+    // Fills row[j] with the first station after src on the tree path to j
+    static void firstHops(const SearchScratch& s, uint32_t src, uint32_t* row, uint32_t n) {
+        const uint32_t PENDING = UNREACHABLE - 1;
+        fill(row, row + n, PENDING);
+        row[src] = src;
+        vector<uint32_t> st;
+
+        for (uint32_t j = 0; j < n; j++) {
+            if (row[j] != PENDING) continue;
+            if (s.dist[j] == INT_MAX) {
+                row[j] = UNREACHABLE;
+                continue;
+            }
+
+            // Walk up until a station with a known hop or a child of src
+            uint32_t v = j;
+            while (row[v] == PENDING && s.parent[v] != src) {
+                st.push_back(v);
+                v = s.parent[v];
+            }
+            uint32_t hop = row[v] == PENDING ? v : row[v];
+            row[v] = hop;
+            for (uint32_t u : st) {
+                row[u] = hop;
+            }
+            st.clear();
+        }
+    }
+
+    /**
+     * Fills values[i][j] for one matrix kind by following next hops. For a
+     * fixed j the hops form a tree towards j, so each cell is the edge to
+     * the next hop plus that hop's already known cell.
+     */
+    static void fillAlongPaths(const FrozenGraph& g, const vector<uint32_t>& next, int kind,
+                               vector<uint32_t>& values) {
+        uint32_t n = g.numStations();
+        vector<uint32_t> hops(n);
+        vector<bool> known(n);
+        vector<uint32_t> st;
+
+        for (uint32_t j = 0; j < n; j++) {
+            fill(known.begin(), known.end(), false);
+            hops[j] = 0;
+            known[j] = true;
+            values[(uint64_t)j * n + j] = kind == FARE ? RouteResult::fareForStations(1) : 0;
+
+            for (uint32_t i = 0; i < n; i++) {
+                for (uint32_t v = i; !known[v]; v = next[(uint64_t)v * n + j]) {
+                    if (next[(uint64_t)v * n + j] == UNREACHABLE) break;
+                    st.push_back(v);
+                }
+                while (!st.empty()) {
+                    uint32_t v = st.back();
+                    st.pop_back();
+                    uint32_t w = next[(uint64_t)v * n + j];
+                    int km = g.edgeWeight(v, w);
+                    uint32_t after = values[(uint64_t)w * n + j];
+                    hops[v] = hops[w] + 1;
+                    known[v] = true;
+                    if (kind == DISTANCE) {
+                        values[(uint64_t)v * n + j] = after + DistanceCost::edge(km);
+                    } else if (kind == TIME) {
+                        values[(uint64_t)v * n + j] = after + TimeCost::edge(km);
+                    } else {
+                        values[(uint64_t)v * n + j] = RouteResult::fareForStations(hops[v] + 1);
+                    }
+                }
+                if (!known[i]) values[(uint64_t)i * n + j] = UNREACHABLE;
+            }
+        }
+    }
+
+    static void writeSection(ofstream& out, uint64_t offset, const vector<uint32_t>& data) {
+        static const char zeros[64] = {};
+        uint64_t at = out.tellp();
+        out.write(zeros, offset - at);
+        out.write((const char*)data.data(), data.size() * sizeof(uint32_t));
+    }
+};
+
+/**
+ * ContractionHierarchy is a preprocessed form of the network for fast
+ * point-to-point queries. Stations are contracted one at a time in order
+ * of an edge-difference priority, adding shortcuts wherever a witness
+ * search finds no path as short as the one through the contracted
+ * station. Queries run a bidirectional Dijkstra over upward arcs only,
+ * then unpack shortcuts back into the original station sequence.
+ */
+class ContractionHierarchy {
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    uint32_t metric = 0;            // 0 = distance, 1 = time
+    uint64_t networkHash = 0;       // FrozenGraph::fingerprint() it was built from
+    vector<uint32_t> rank;          // Contraction order of every station
+    vector<uint32_t> upOffsets;     // Upward arcs of each station, CSR-style
+    vector<uint32_t> upTargets;     // Higher ranked end of each arc
+    vector<int> upCost;
+    vector<uint32_t> upMiddle;      // Contracted station a shortcut skips, NO_STATION for real edges
+
+    uint32_t numStations() const {
+        return rank.size();
+    }
+
+    /**
+     * Builds the hierarchy for a metric.
+     * @param cost Cost of every CSR edge of g
+     * @param witnessLimit Stations a witness search may settle before giving up
+     */
+    static ContractionHierarchy build(const FrozenGraph& g, const vector<int>& cost,
+                                      uint32_t metric, uint32_t witnessLimit = 500) {
+        uint32_t n = g.numStations();
+        vector<vector<Arc>> adj(n);
+        for (uint32_t u = 0; u < n; u++) {
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                adj[u].push_back({g.targets[e], cost[e], NO_STATION});
+            }
+        }
+
+        Contractor c(adj, witnessLimit);
+        vector<int> deleted(n, 0);
+        priority_queue<pair<int, uint32_t>, vector<pair<int, uint32_t>>, greater<pair<int, uint32_t>>> order;
+        for (uint32_t v = 0; v < n; v++) {
+            order.push({c.priority(v, deleted[v]), v});
+        }
+
+        ContractionHierarchy ch;
+        ch.metric = metric;
+        ch.networkHash = g.fingerprint();
+        ch.rank.assign(n, 0);
+        vector<vector<Arc>> up(n);
+        uint32_t next = 0;
+
+        while (!order.empty()) {
+            uint32_t v = order.top().second;
+            order.pop();
+            if (c.contracted[v]) continue;
+
+            // Lazy update: recompute and re-queue if v is no longer the minimum
+            int p = c.priority(v, deleted[v]);
+            if (!order.empty() && p > order.top().first) {
+                order.push({p, v});
+                continue;
+            }
+
+            up[v] = adj[v];
+            c.contract(v);
+            ch.rank[v] = next++;
+            for (const Arc& a : up[v]) {
+                deleted[a.to]++;
+            }
+        }
+
+        ch.upOffsets.assign(n + 1, 0);
+        for (uint32_t v = 0; v < n; v++) {
+            ch.upOffsets[v + 1] = ch.upOffsets[v] + up[v].size();
+            for (const Arc& a : up[v]) {
+                ch.upTargets.push_back(a.to);
+                ch.upCost.push_back(a.cost);
+                ch.upMiddle.push_back(a.middle);
+            }
+        }
+        return ch;
+    }
+
+    /**
+     * Runs a bidirectional upward search between src and dst.
+     * fwd.settled + bwd.settled is the number of stations settled.
+     * @return The route, with shortcuts unpacked into stations
+     */
+    RouteResult route(const FrozenGraph& g, uint32_t src, uint32_t dst,
+                      SearchScratch& fwd, SearchScratch& bwd) const {
+        RouteResult res;
+        if (!g.connected(src, dst)) return res;
+
+        uint32_t meet = search(src, dst, fwd, bwd);
+        if (meet == NO_STATION) return res;
+
+        // Upward chain from src to meet, then down from meet to dst
+        vector<uint32_t> chain;
+        for (uint32_t v = meet; v != NO_STATION; v = fwd.parent[v]) {
+            chain.push_back(v);
+        }
+        reverse(chain.begin(), chain.end());
+        for (uint32_t v = bwd.parent[meet]; v != NO_STATION; v = bwd.parent[v]) {
+            chain.push_back(v);
+        }
+
+        vector<uint32_t> path = {chain[0]};
+        for (size_t i = 1; i < chain.size(); i++) {
+            unpack(chain[i - 1], chain[i], path);
+        }
+        res.fill(g, std::move(path));
+        return res;
+    }
+
+    /**
+     * Bidirectional upward Dijkstra with stall-on-demand.
+     * @return The station where the best up-down path meets, or NO_STATION
+     */
+    uint32_t search(uint32_t src, uint32_t dst, SearchScratch& fwd, SearchScratch& bwd) const {
+        uint32_t n = numStations();
+        fwd.prepare(n);
+        bwd.prepare(n);
+        fwd.settled = bwd.settled = 0;
+        start(fwd, src);
+        start(bwd, dst);
+
+        int best = INT_MAX;
+        uint32_t meet = NO_STATION;
+
+        while (!fwd.heap.empty() || !bwd.heap.empty()) {
+            int minF = fwd.heap.empty() ? INT_MAX : fwd.heap.topKey();
+            int minB = bwd.heap.empty() ? INT_MAX : bwd.heap.topKey();
+            if (min(minF, minB) >= best) break;
+
+            bool forward = minF <= minB;
+            SearchScratch& s = forward ? fwd : bwd;
+            const SearchScratch& other = forward ? bwd : fwd;
+
+            IndexedHeap::Entry rp = s.heap.pop();
+            s.settled++;
+            if (other.dist[rp.id] != INT_MAX && rp.key + other.dist[rp.id] < best) {
+                best = rp.key + other.dist[rp.id];
+                meet = rp.id;
+            }
+
+            if (stalled(s, rp.id, rp.key)) continue;
+
+            for (uint32_t e = upOffsets[rp.id]; e < upOffsets[rp.id + 1]; e++) {
+                uint32_t w = upTargets[e];
+                int nc = rp.key + upCost[e];
+                if (nc < s.dist[w]) {
+                    if (s.dist[w] == INT_MAX) s.touched.push_back(w);
+                    s.dist[w] = nc;
+                    s.parent[w] = rp.id;
+                    s.heap.pushOrDecrease(w, nc);
+                }
+            }
+        }
+        return meet;
+    }
+
+    /**
+     * Runs a complete upward search from src and calls visit(v, cost) for
+     * every station settled without being stalled. Such costs are exact
+     * for the up part of an up-down path, which is what buckets need.
+     */
+    template <class Visit>
+    void upward(uint32_t src, SearchScratch& s, Visit visit) const {
+        s.prepare(numStations());
+        s.settled = 0;
+        start(s, src);
+        while (!s.heap.empty()) {
+            IndexedHeap::Entry rp = s.heap.pop();
+            s.settled++;
+            if (stalled(s, rp.id, rp.key)) continue;
+            visit(rp.id, rp.key);
+
+            for (uint32_t e = upOffsets[rp.id]; e < upOffsets[rp.id + 1]; e++) {
+                uint32_t w = upTargets[e];
+                int nc = rp.key + upCost[e];
+                if (nc < s.dist[w]) {
+                    if (s.dist[w] == INT_MAX) s.touched.push_back(w);
+                    s.dist[w] = nc;
+                    s.parent[w] = rp.id;
+                    s.heap.pushOrDecrease(w, nc);
+                }
+            }
+        }
+    }
+
+    // Writes the hierarchy to a binary file
+    bool save(const string& path) const {
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out) return false;
+        uint32_t n = numStations();
+        uint32_t arcs = upTargets.size();
+        out.write("DMCH\0\0\0\0", 8);
+        writeValue(out, VERSION);
+        writeValue(out, metric);
+        writeValue(out, networkHash);
+        writeValue(out, n);
+        writeValue(out, arcs);
+        writeArray(out, rank);
+        writeArray(out, upOffsets);
+        writeArray(out, upTargets);
+        writeArray(out, upCost);
+        writeArray(out, upMiddle);
+        return (bool)out;
+    }
+
+    /**
+     * Reads a hierarchy file and checks it was built for this network.
+     * @return Empty string on success, otherwise the reason it was rejected
+     */
+    string load(const string& path, const FrozenGraph& g) {
+        ifstream in(path, ios::binary);
+        if (!in) return "cannot open " + path;
+
+        char magic[8];
+        uint32_t version = 0, n = 0, arcs = 0;
+        in.read(magic, 8);
+        readValue(in, version);
+        readValue(in, metric);
+        readValue(in, networkHash);
+        readValue(in, n);
+        readValue(in, arcs);
+        if (!in || memcmp(magic, "DMCH", 5) != 0) return "not a contraction hierarchy";
+        if (version != VERSION) return "unsupported version " + to_string(version);
+        if (n != g.numStations() || networkHash != g.fingerprint()) {
+            return "hierarchy was built for a different network";
+        }
+
+        // Size the arrays only once the file is known to hold them
+        streamoff start = in.tellg();
+        in.seekg(0, ios::end);
+        uint64_t left = in.tellg() - start;
+        in.seekg(start);
+        if (left < 4 * (2 * (uint64_t)n + 1) + 12 * (uint64_t)arcs) return "file truncated";
+
+        readArray(in, rank, n);
+        readArray(in, upOffsets, n + 1);
+        readArray(in, upTargets, arcs);
+        readArray(in, upCost, arcs);
+        readArray(in, upMiddle, arcs);
+        if (!in) return "file truncated";
+        return validate();
+    }
+
+private:
+    /**
+     * Arc class is an edge or shortcut in the graph being contracted.
+     */
+    class Arc {
+    public:
+        uint32_t to;
+        int cost;
+        uint32_t middle;
+    };
+
+    /**
+     * Shortcut class is a u-w connection needed when a station is contracted.
+     */
+    class Shortcut {
+    public:
+        uint32_t u, w;
+        int cost;
+    };
+
+    /**
+     * Contractor class holds the shrinking graph during preprocessing and
+     * the scratch of its witness searches.
+     */
+    class Contractor {
+    public:
+        vector<vector<Arc>>& adj;
+        vector<bool> contracted;
+        uint32_t witnessLimit;
+        SearchScratch witness;
+        vector<Shortcut> shortcuts;     // Found by the last findShortcuts call
+
+        Contractor(vector<vector<Arc>>& adj, uint32_t witnessLimit)
+            : adj(adj), contracted(adj.size(), false), witnessLimit(witnessLimit) {}
+
+        // Edge difference plus contracted neighbours, lower contracts first
+        int priority(uint32_t v, int deletedNeighbours) {
+            findShortcuts(v);
+            return (int)shortcuts.size() - (int)adj[v].size() + deletedNeighbours;
+        }
+
+        // Removes v from the graph, adding the shortcuts it needs
+        void contract(uint32_t v) {
+            findShortcuts(v);
+            for (const Shortcut& s : shortcuts) {
+                addArc(s.u, s.w, s.cost, v);
+                addArc(s.w, s.u, s.cost, v);
+            }
+            for (const Arc& a : adj[v]) {
+                auto& list = adj[a.to];
+                list.erase(remove_if(list.begin(), list.end(), [v](const Arc& b) {
+                    return b.to == v;
+                }), list.end());
+            }
+            contracted[v] = true;
+        }
+
+    private:
+        void addArc(uint32_t u, uint32_t w, int cost, uint32_t middle) {
+            for (Arc& a : adj[u]) {
+                if (a.to == w) {
+                    if (cost < a.cost) {
+                        a.cost = cost;
+                        a.middle = middle;
+                    }
+                    return;
+                }
+            }
+            adj[u].push_back({w, cost, middle});
+        }
+
+        /**
+         * Fills shortcuts with every neighbour pair (u, w) of v whose only
+         * shortest connection runs through v.
+         */
+        void findShortcuts(uint32_t v) {
+            shortcuts.clear();
+            const vector<Arc>& nb = adj[v];
+            for (size_t i = 0; i < nb.size(); i++) {
+                int limit = 0;
+                for (size_t j = i + 1; j < nb.size(); j++) {
+                    limit = max(limit, nb[i].cost + nb[j].cost);
+                }
+                if (limit == 0) continue;
+
+                witnessSearch(nb[i].to, v, limit);
+                for (size_t j = i + 1; j < nb.size(); j++) {
+                    int via = nb[i].cost + nb[j].cost;
+                    if (witness.dist[nb[j].to] > via) {
+                        shortcuts.push_back({nb[i].to, nb[j].to, via});
+                    }
+                }
+            }
+        }
+
+        // Dijkstra from src avoiding v, bounded by cost limit and settle count
+        void witnessSearch(uint32_t src, uint32_t v, int limit) {
+            witness.prepare(adj.size());
+            witness.dist[src] = 0;
+            witness.touched.push_back(src);
+            witness.heap.pushOrDecrease(src, 0);
+            uint32_t settled = 0;
+
+            while (!witness.heap.empty() && settled < witnessLimit) {
+                IndexedHeap::Entry rp = witness.heap.pop();
+                settled++;
+                if (rp.key > limit) break;
+
+                for (const Arc& a : adj[rp.id]) {
+                    if (a.to == v) continue;
+                    int nc = rp.key + a.cost;
+                    if (nc < witness.dist[a.to]) {
+                        if (witness.dist[a.to] == INT_MAX) witness.touched.push_back(a.to);
+                        witness.dist[a.to] = nc;
+                        witness.heap.pushOrDecrease(a.to, nc);
+                    }
+                }
+            }
+        }
+    };
+
+    static void start(SearchScratch& s, uint32_t src) {
+        s.dist[src] = 0;
+        s.touched.push_back(src);
+        s.heap.pushOrDecrease(src, 0);
+    }
+
+    // A station is stalled if a higher neighbour already reaches it more cheaply
+    bool stalled(const SearchScratch& s, uint32_t v, int d) const {
+        for (uint32_t e = upOffsets[v]; e < upOffsets[v + 1]; e++) {
+            int dw = s.dist[upTargets[e]];
+            if (dw != INT_MAX && dw + upCost[e] < d) return true;
+        }
+        return false;
+    }
+
+    // Appends the stations after a up to and including b, expanding shortcuts
+    void unpack(uint32_t a, uint32_t b, vector<uint32_t>& path) const {
+        vector<pair<uint32_t, uint32_t>> st = {{a, b}};
+        while (!st.empty()) {
+            pair<uint32_t, uint32_t> arc = st.back();
+            st.pop_back();
+            uint32_t mid = middleOf(arc.first, arc.second);
+            if (mid == NO_STATION) {
+                path.push_back(arc.second);
+            } else {
+                st.push_back({mid, arc.second});
+                st.push_back({arc.first, mid});
+            }
+        }
+    }
+
+    /**
+     * Checks the loaded arrays form a hierarchy queries can walk: ranks
+     * are a permutation, arcs lead upward to known stations, and every
+     * shortcut skips a station ranked below both its ends.
+     * @return Empty string if so, otherwise what is wrong
+     */
+    string validate() const {
+        uint32_t n = numStations();
+        vector<char> seen(n, 0);
+        for (uint32_t u = 0; u < n; u++) {
+            if (rank[u] >= n || seen[rank[u]]) return "bad station ranks";
+            seen[rank[u]] = 1;
+        }
+        if (upOffsets[0] != 0 || upOffsets[n] != upTargets.size()) return "bad arc offsets";
+        for (uint32_t u = 0; u < n; u++) {
+            if (upOffsets[u] > upOffsets[u + 1]) return "bad arc offsets";
+            for (uint32_t e = upOffsets[u]; e < upOffsets[u + 1]; e++) {
+                uint32_t w = upTargets[e], mid = upMiddle[e];
+                if (w >= n || rank[w] <= rank[u] || upCost[e] < 0) return "bad arc";
+                if (mid != NO_STATION && (mid >= n || rank[mid] >= rank[u])) return "bad shortcut";
+            }
+        }
+        return "";
+    }
+
+    // Returns the middle station of the cheapest arc between u and w
+    uint32_t middleOf(uint32_t u, uint32_t w) const {
+        uint32_t low = rank[u] < rank[w] ? u : w;
+        uint32_t high = low == u ? w : u;
+        uint32_t mid = NO_STATION;
+        int best = INT_MAX;
+        for (uint32_t e = upOffsets[low]; e < upOffsets[low + 1]; e++) {
+            if (upTargets[e] == high && upCost[e] < best) {
+                best = upCost[e];
+                mid = upMiddle[e];
+            }
+        }
+        return mid;
+    }
+
+    template <class T>
+    static void writeValue(ofstream& out, const T& v) {
+        out.write((const char*)&v, sizeof(T));
+    }
+
+    template <class T>
+    static void writeArray(ofstream& out, const vector<T>& v) {
+        out.write((const char*)v.data(), v.size() * sizeof(T));
+    }
+
+    template <class T>
+    static void readValue(ifstream& in, T& v) {
+        in.read((char*)&v, sizeof(T));
+    }
+
+    template <class T>
+    static void readArray(ifstream& in, vector<T>& v, size_t count) {
+        v.resize(count);
+        in.read((char*)v.data(), count * sizeof(T));
+    }
+};
+
+/**
+ * CostMatrix class holds the costs from S sources to T targets, row by
+ * row; INT_MAX marks a target a source cannot reach.
+ */
+class CostMatrix {
+public:
+    uint32_t rows = 0, cols = 0;
+    vector<int> cost;
+
+    int at(uint32_t i, uint32_t j) const {
+        return cost[(size_t)i * cols + j];
+    }
+
+    void reset(uint32_t r, uint32_t c) {
+        rows = r;
+        cols = c;
+        cost.assign((size_t)r * c, INT_MAX);
+    }
+};
+
+/**
+ * ManyToMany computes source x target cost matrices without one search
+ * per pair. With a contraction hierarchy it uses the bucket method: an
+ * upward search from every target leaves (target, cost) entries in the
+ * buckets of the stations it settles, then one upward search per source
+ * reads the buckets it passes, so the down half of every route is found
+ * once per target and shared by all sources. Without one, each row is a
+ * single Dijkstra search that stops once the row's targets are settled.
+ */
+class ManyToMany {
+public:
+    /**
+     * Scratch class holds the searches and buckets of one thread, reused
+     * from call to call.
+     */
+    class Scratch {
+    public:
+        SearchScratch search;
+        vector<uint32_t> first;         // Station -> its first bucket entry, NO_STATION if none
+        vector<uint32_t> marked;        // Stations whose first is set, or the row's targets
+        vector<pair<uint64_t, int>> entries;    // (station << 32 | target column, cost), sorted
+    };
+
+    // Fills m with the costs of the hierarchy's metric from the bucket method
+    static void buckets(const ContractionHierarchy& ch, const vector<uint32_t>& sources,
+                        const vector<uint32_t>& targets, Scratch& s, CostMatrix& m) {
+        m.reset(sources.size(), targets.size());
+        s.entries.clear();
+        for (uint32_t j = 0; j < targets.size(); j++) {
+            ch.upward(targets[j], s.search, [&s, j](uint32_t v, int d) {
+                s.entries.push_back({(uint64_t)v << 32 | j, d});
+            });
+        }
+        sort(s.entries.begin(), s.entries.end());
+        if (s.first.size() != ch.numStations()) s.first.assign(ch.numStations(), NO_STATION);
+        s.marked.clear();
+        for (uint32_t k = 0; k < s.entries.size(); k++) {
+            uint32_t v = s.entries[k].first >> 32;
+            if (s.first[v] == NO_STATION) {
+                s.first[v] = k;
+                s.marked.push_back(v);
+            }
+        }
+
+        for (uint32_t i = 0; i < sources.size(); i++) {
+            int* row = m.cost.data() + (size_t)i * m.cols;
+            ch.upward(sources[i], s.search, [&s, row](uint32_t v, int d) {
+                for (uint32_t k = s.first[v]; k < s.entries.size() && s.entries[k].first >> 32 == v; k++) {
+                    uint32_t j = (uint32_t)s.entries[k].first;
+                    row[j] = min(row[j], d + s.entries[k].second);
+                }
+            });
+        }
+
+        for (uint32_t v : s.marked) {
+            s.first[v] = NO_STATION;
+        }
+    }
+
+    // Fills m row by row, one search per source that ends at its last target
+    template <class Cost>
+    static void rows(const FrozenGraph& g, const vector<uint32_t>& sources,
+                     const vector<uint32_t>& targets, Scratch& s, CostMatrix& m) {
+        m.reset(sources.size(), targets.size());
+        if (s.first.size() != g.numStations()) s.first.assign(g.numStations(), NO_STATION);
+        s.marked.clear();
+        for (uint32_t j = 0; j < targets.size(); j++) {
+            if (s.first[targets[j]] == NO_STATION) s.marked.push_back(targets[j]);
+            s.first[targets[j]] = 0;
+        }
+
+        const int* weights = g.weights.data();
+        for (uint32_t i = 0; i < sources.size(); i++) {
+            // Only targets in the source's component can be settled
+            uint32_t left = 0;
+            for (uint32_t t : s.marked) {
+                left += g.connected(sources[i], t);
+            }
+            if (left == 0) continue;
+            DijkstraEngine::explore(g, sources[i], INT_MAX, s.search, [weights](uint32_t e) {
+                return Cost::edge(weights[e]);
+            }, [&s, &left](uint32_t id, int) {
+                return s.first[id] == NO_STATION || --left > 0;
+            });
+            int* row = m.cost.data() + (size_t)i * m.cols;
+            for (uint32_t j = 0; j < targets.size(); j++) {
+                row[j] = s.search.dist[targets[j]];
+            }
+        }
+
+        for (uint32_t v : s.marked) {
+            s.first[v] = NO_STATION;
+        }
+    }
+};
+
+/**
+ * WorkStealingPool runs batches of indexed tasks on a fixed set of threads.
+ * Each worker has its own task deque and takes from the back of it; once
+ * empty it steals from the front of the other workers' deques, so uneven
+ * tasks balance out without a shared queue.
+ */
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned n) {
+        if (n == 0) n = 1;
+        for (unsigned i = 0; i < n; i++) {
+            queues.emplace_back(new Queue());
+        }
+        for (unsigned i = 0; i < n; i++) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    // Returns the number of worker threads
+    unsigned size() const {
+        return threads.size();
+    }
+
+    /**
+     * Runs fn(worker, task) for every task in [0, numTasks) and waits.
+     * Tasks are dealt out in contiguous runs so neighbouring tasks start
+     * on the same worker.
+     */
+    void run(size_t numTasks, function<void(unsigned, size_t)> fn) {
+        if (numTasks == 0) return;
+
+        unique_lock<mutex> lock(m);
+        job = std::move(fn);
+        remaining = numTasks;
+        size_t per = (numTasks + queues.size() - 1) / queues.size();
+        for (size_t t = 0; t < numTasks; t++) {
+            Queue& q = *queues[t / per];
+            lock_guard<mutex> ql(q.m);
+            q.tasks.push_back(t);
+        }
+        generation++;
+        cv.notify_all();
+        doneCv.wait(lock, [this] { return remaining == 0; });
+    }
+
+private:
+    /**
+     * Queue class is one worker's deque of task indices.
+     */
+    class Queue {
+    public:
+        mutex m;
+        deque<size_t> tasks;
+    };
+
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> threads;
+    mutex m;
+    condition_variable cv;          // Wakes workers for a new batch or shutdown
+    condition_variable doneCv;      // Wakes run() when the batch is finished
+    function<void(unsigned, size_t)> job;
+    size_t generation = 0;
+    size_t remaining = 0;
+    bool stopping = false;
+
+    // Takes a task from the worker's own deque, else steals one
+    bool take(unsigned id, size_t& task) {
+        {
+            Queue& own = *queues[id];
+            lock_guard<mutex> lock(own.m);
+            if (!own.tasks.empty()) {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++) {
+            Queue& victim = *queues[(id + k) % queues.size()];
+            lock_guard<mutex> lock(victim.m);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned id) {
+        size_t seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> lock(m);
+                cv.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+
+            size_t task;
+            size_t finished = 0;
+            while (take(id, task)) {
+                job(id, task);
+                finished++;
+            }
+
+            if (finished > 0) {
+                lock_guard<mutex> lock(m);
+                remaining -= finished;
+                if (remaining == 0) doneCv.notify_all();
+            }
+        }
+    }
+};
+
+/**
+ * CrpPartition is the metric-independent half of customizable route
+ * planning: a nested multi-level partition of the stations into cells,
+ * with the boundary stations of every cell. Level 0 is the station graph
+ * itself; each level l >= 1 groups the cells of level l - 1 by growing
+ * them breadth-first until a cell holds at least cellSizes[l - 1] stations.
+ */
+class CrpPartition {
+public:
+    uint32_t levels = 0;                        // Number of cell levels above the station graph
+    vector<vector<uint32_t>> cell;              // cell[l][v], l = 1..levels (cell[0] unused)
+    vector<vector<uint32_t>> boundary;          // boundary[l]: stations grouped by cell
+    vector<vector<uint32_t>> boundaryOffsets;   // boundaryOffsets[l][c]: start of cell c in boundary[l]
+    vector<vector<uint32_t>> boundaryIndex;     // boundaryIndex[l][v]: position within its cell, or NO_STATION
+    vector<vector<uint64_t>> cliqueOffsets;     // cliqueOffsets[l][c]: start of cell c's matrix
+
+    uint32_t numCells(uint32_t l) const {
+        return boundaryOffsets[l].size() - 1;
+    }
+
+    uint32_t boundarySize(uint32_t l, uint32_t c) const {
+        return boundaryOffsets[l][c + 1] - boundaryOffsets[l][c];
+    }
+
+    static CrpPartition build(const FrozenGraph& g, const vector<uint32_t>& cellSizes) {
+        CrpPartition p;
+        uint32_t n = g.numStations();
+        p.levels = cellSizes.size();
+        p.cell.resize(p.levels + 1);
+        p.boundary.resize(p.levels + 1);
+        p.boundaryOffsets.resize(p.levels + 1);
+        p.boundaryIndex.resize(p.levels + 1);
+        p.cliqueOffsets.resize(p.levels + 1);
+
+        // Level 0 units are the stations themselves
+        vector<uint32_t> unitOf(n);
+        iota(unitOf.begin(), unitOf.end(), 0);
+        uint32_t units = n;
+
+        for (uint32_t l = 1; l <= p.levels; l++) {
+            // Quotient graph of the units below
+            vector<uint32_t> unitSize(units, 0);
+            vector<vector<uint32_t>> unitAdj(units);
+            for (uint32_t v = 0; v < n; v++) {
+                unitSize[unitOf[v]]++;
+                for (uint32_t e = g.offsets[v]; e < g.offsets[v + 1]; e++) {
+                    uint32_t a = unitOf[v], b = unitOf[g.targets[e]];
+                    if (a != b) unitAdj[a].push_back(b);
+                }
+            }
+
+            // Grow cells breadth-first over units
+            vector<uint32_t> cellOfUnit(units, NO_STATION);
+            uint32_t cells = 0;
+            deque<uint32_t> q;
+            for (uint32_t seed = 0; seed < units; seed++) {
+                if (cellOfUnit[seed] != NO_STATION) continue;
+                uint32_t size = 0;
+                q.assign(1, seed);
+                cellOfUnit[seed] = cells;
+                while (!q.empty() && size < cellSizes[l - 1]) {
+                    uint32_t u = q.front();
+                    q.pop_front();
+                    size += unitSize[u];
+                    for (uint32_t w : unitAdj[u]) {
+                        if (cellOfUnit[w] == NO_STATION && size < cellSizes[l - 1]) {
+                            cellOfUnit[w] = cells;
+                            q.push_back(w);
+                        }
+                    }
+                }
+                // Units queued but not expanded stay in the cell; they are still connected to it
+                cells++;
+            }
+
+            p.cell[l].resize(n);
+            for (uint32_t v = 0; v < n; v++) {
+                p.cell[l][v] = cellOfUnit[unitOf[v]];
+            }
+
+            // Boundary stations have an edge leaving their cell
+            vector<vector<uint32_t>> byCell(cells);
+            p.boundaryIndex[l].assign(n, NO_STATION);
+            for (uint32_t v = 0; v < n; v++) {
+                for (uint32_t e = g.offsets[v]; e < g.offsets[v + 1]; e++) {
+                    if (p.cell[l][g.targets[e]] != p.cell[l][v]) {
+                        p.boundaryIndex[l][v] = byCell[p.cell[l][v]].size();
+                        byCell[p.cell[l][v]].push_back(v);
+                        break;
+                    }
+                }
+            }
+            p.boundaryOffsets[l].assign(1, 0);
+            p.cliqueOffsets[l].assign(1, 0);
+            for (uint32_t c = 0; c < cells; c++) {
+                p.boundary[l].insert(p.boundary[l].end(), byCell[c].begin(), byCell[c].end());
+                p.boundaryOffsets[l].push_back(p.boundary[l].size());
+                p.cliqueOffsets[l].push_back(p.cliqueOffsets[l].back() + (uint64_t)byCell[c].size() * byCell[c].size());
+            }
+
+            unitOf = p.cell[l];
+            units = cells;
+        }
+        return p;
+    }
+};
+
+/**
+ * CrpMetric is the customized half: the edge costs of one metric and,
+ * for every cell, the matrix of shortest costs between its boundary
+ * stations within the cell. Customizing a new metric only refills these
+ * matrices; the partition is reused.
+ */
+class CrpMetric {
+public:
+    vector<int> cost;               // Cost of every CSR edge, CLOSED_EDGE if unusable
+    vector<vector<int>> clique;     // clique[l]: all cell matrices of level l, row-major
+
+    /**
+     * Fills the cell matrices bottom-up, the cells of each level in
+     * parallel: a level l matrix comes from searches over the level l - 1
+     * overlay restricted to the cell.
+     */
+    static CrpMetric customize(const FrozenGraph& g, const CrpPartition& p, vector<int> cost,
+                               WorkStealingPool& pool) {
+        CrpMetric m;
+        m.cost = std::move(cost);
+        m.clique.resize(p.levels + 1);
+        vector<SearchScratch> scratch(pool.size());
+
+        for (uint32_t l = 1; l <= p.levels; l++) {
+            m.clique[l].assign(p.cliqueOffsets[l].back(), CLOSED_EDGE);
+            pool.run(p.numCells(l), [&](unsigned worker, size_t c) {
+                SearchScratch& s = scratch[worker];
+                uint32_t b = p.boundarySize(l, c);
+                const uint32_t* border = &p.boundary[l][p.boundaryOffsets[l][c]];
+                int* out = &m.clique[l][p.cliqueOffsets[l][c]];
+                for (uint32_t i = 0; i < b; i++) {
+                    m.searchLevel(g, p, border[i], l - 1, [&](uint32_t v) {
+                        return p.cell[l][v] == c;
+                    }, [](uint32_t) { return false; }, s);
+                    for (uint32_t j = 0; j < b; j++) {
+                        out[i * b + j] = s.dist[border[j]];
+                    }
+                }
+            });
+        }
+        return m;
+    }
+
+    /**
+     * Dijkstra over the overlay from src. level(v) is the level whose arcs
+     * a station scans; inside(v) limits the search to a region; the search
+     * stops when done(v) is true for a settled station v.
+     */
+    template <class Level, class Inside, class Done>
+    void search(const FrozenGraph& g, const CrpPartition& p, uint32_t src, Level level,
+                Inside inside, Done done, SearchScratch& s) const {
+        s.prepare(g.numStations());
+        s.settled = 0;
+        s.dist[src] = 0;
+        s.touched.push_back(src);
+        s.heap.pushOrDecrease(src, 0);
+
+        auto relax = [&s](uint32_t from, uint32_t to, int nc) {
+            if (nc < s.dist[to]) {
+                if (s.dist[to] == INT_MAX) s.touched.push_back(to);
+                s.dist[to] = nc;
+                s.parent[to] = from;
+                s.heap.pushOrDecrease(to, nc);
+            }
+        };
+
+        while (!s.heap.empty()) {
+            IndexedHeap::Entry rp = s.heap.pop();
+            s.settled++;
+            if (done(rp.id)) return;
+
+            uint32_t l = level(rp.id);
+            uint32_t c = l ? p.cell[l][rp.id] : NO_STATION;
+            for (uint32_t e = g.offsets[rp.id]; e < g.offsets[rp.id + 1]; e++) {
+                uint32_t w = g.targets[e];
+                if (cost[e] == CLOSED_EDGE || !inside(w)) continue;
+                if (l && p.cell[l][w] == c) continue;   // Covered by the cell matrix
+                relax(rp.id, w, rp.key + cost[e]);
+            }
+            if (l == 0) continue;
+
+            uint32_t i = p.boundaryIndex[l][rp.id];
+            if (i == NO_STATION) continue;
+            uint32_t b = p.boundarySize(l, c);
+            const uint32_t* border = &p.boundary[l][p.boundaryOffsets[l][c]];
+            const int* row = &clique[l][p.cliqueOffsets[l][c] + (uint64_t)i * b];
+            for (uint32_t j = 0; j < b; j++) {
+                if (j == i || row[j] == CLOSED_EDGE || !inside(border[j])) continue;
+                relax(rp.id, border[j], rp.key + row[j]);
+            }
+        }
+    }
+
+    // Variant of search where every station scans the same level
+    template <class Inside, class Done>
+    void searchLevel(const FrozenGraph& g, const CrpPartition& p, uint32_t src, uint32_t level,
+                Inside inside, Done done, SearchScratch& s) const {
+        search(g, p, src, [level](uint32_t) { return level; }, inside, done, s);
+    }
+
+    /**
+     * Point-to-point query. Each station scans the highest level whose
+     * cell contains neither src nor dst, so only the source and target
+     * cells are searched on the station graph. Cell matrix arcs on the
+     * result are unpacked by a search inside the cell.
+     * s.settled is the number of stations settled by the overlay search.
+     */
+    RouteResult route(const FrozenGraph& g, const CrpPartition& p, uint32_t src, uint32_t dst,
+                      SearchScratch& s, SearchScratch& unpack) const {
+        RouteResult res;
+        s.settled = 0;
+        if (!g.connected(src, dst)) return res;
+
+        auto level = [&](uint32_t v) {
+            for (uint32_t l = p.levels; l >= 1; l--) {
+                if (p.cell[l][v] != p.cell[l][src] && p.cell[l][v] != p.cell[l][dst]) return l;
+            }
+            return 0u;
+        };
+        search(g, p, src, level, [](uint32_t) { return true; }, [dst](uint32_t v) {
+            return v == dst;
+        }, s);
+        if (s.dist[dst] == INT_MAX) return res;
+
+        vector<uint32_t> hops = DijkstraEngine::path(s, dst);
+        vector<uint32_t> path = {hops[0]};
+        for (size_t i = 1; i < hops.size(); i++) {
+            int step = s.dist[hops[i]] - s.dist[hops[i - 1]];
+            appendLeg(g, p, hops[i - 1], hops[i], step, level(hops[i - 1]), path, unpack);
+        }
+        res.fill(g, std::move(path));
+        return res;
+    }
+
+private:
+    // Appends the stations after a up to b for an arc of the given cost scanned at level l
+    void appendLeg(const FrozenGraph& g, const CrpPartition& p, uint32_t a, uint32_t b, int step,
+                   uint32_t l, vector<uint32_t>& path, SearchScratch& s) const {
+        for (uint32_t e = g.offsets[a]; e < g.offsets[a + 1]; e++) {
+            if (g.targets[e] == b && cost[e] == step) {
+                path.push_back(b);
+                return;
+            }
+        }
+
+        // A cell matrix arc: redo the search on the stations of that cell
+        uint32_t c = p.cell[l][a];
+        searchLevel(g, p, a, 0, [&](uint32_t v) {
+            return p.cell[l][v] == c;
+        }, [b](uint32_t v) {
+            return v == b;
+        }, s);
+        vector<uint32_t> leg = DijkstraEngine::path(s, b);
+        path.insert(path.end(), leg.begin() + 1, leg.end());
+    }
+};
+
+/**
+ * Edge cost arrays for the operational metrics that CRP customizes.
+ */
+class CrpMetrics {
+public:
+    // Time with a longer dwell at every station, as at peak hours
+    static vector<int> peakTime(const FrozenGraph& g, int dwellSeconds) {
+        vector<int> cost(g.weights.size());
+        for (size_t e = 0; e < cost.size(); e++) {
+            cost[e] = dwellSeconds + 40 * g.weights[e];
+        }
+        return cost;
+    }
+
+    // Time with every connection that only runs on one line closed
+    static vector<int> lineClosed(const FrozenGraph& g, char line) {
+        vector<int> cost = edgeCosts<TimeCost>(g);
+        uint32_t closed = 1u << (line - 'A');
+        for (uint32_t u = 0; u < g.numStations(); u++) {
+            for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                uint32_t lines = g.lineMask[u] & g.lineMask[g.targets[e]];
+                if (lines == closed) cost[e] = CLOSED_EDGE;
+            }
+        }
+        return cost;
+    }
+
+    // Fewest stations first (the fare depends only on the count), then distance
+    static vector<int> fareWeighted(const FrozenGraph& g) {
+        vector<int> cost(g.weights.size());
+        for (size_t e = 0; e < cost.size(); e++) {
+            cost[e] = 1000 + g.weights[e];
+        }
+        return cost;
+    }
+};
+
+/**
+ * DynamicRoutes class keeps the shortest-path trees of a set of source
+ * stations correct while connections close, reopen or change length,
+ * which together form a distance table from those sources. An update
+ * recomputes only what it can change: a tree edge that got longer or
+ * closed invalidates the subtree below it, which is re-seeded from its
+ * untouched neighbours; an edge that got shorter or reopened starts a
+ * search from its far end that spreads only while it improves costs.
+ */
+class DynamicRoutes {
+public:
+    static constexpr int CLOSED = -1;   // Length of a closed connection
+
+    /**
+     * Change class sets the length of one existing connection, both
+     * ways; CLOSED closes it.
+     */
+    class Change {
+    public:
+        uint32_t u, v;
+        int km;
+    };
+
+    // One origin-destination pair whose cost an update changed; INT_MAX is unreachable
+    class Changed {
+    public:
+        uint32_t src, dst;
+        int before, after;
+    };
+
+    uint32_t n = 0;                 // Number of stations
+    bool time = false;              // Costs are times rather than distances
+    vector<uint32_t> sources;       // Root of each tree
+    vector<int> km;                 // Current length of every CSR edge, CLOSED if closed
+    vector<int> cost;               // Current cost of every CSR edge, CLOSED_EDGE if closed
+    vector<int> dist;               // dist[i * n + v]: cost from sources[i] to v, INT_MAX if unreached
+    vector<uint32_t> parent;        // Same layout: predecessor of v, NO_STATION at the root or unreached
+    uint64_t resettled = 0;         // Stations whose cost was recomputed by the last update
+
+    /**
+     * Builds the trees of the given sources over g with every connection
+     * open, by distance or by time.
+     */
+    static DynamicRoutes build(const FrozenGraph& g, vector<uint32_t> sources, bool time) {
+        DynamicRoutes dr;
+        dr.n = g.numStations();
+        dr.time = time;
+        dr.sources = std::move(sources);
+        dr.km = g.weights;
+        dr.cost = time ? edgeCosts<TimeCost>(g) : edgeCosts<DistanceCost>(g);
+        dr.dist.resize((size_t)dr.sources.size() * dr.n);
+        dr.parent.resize(dr.dist.size());
+        dr.rebuild(g);
+        return dr;
+    }
+
+    // Recomputes every tree from scratch with the current lengths
+    void rebuild(const FrozenGraph& g) {
+        SearchScratch s;
+        for (size_t i = 0; i < sources.size(); i++) {
+            DijkstraEngine::runCosts(g, cost.data(), sources[i], NO_STATION, s);
+            copy(s.dist.begin(), s.dist.end(), dist.begin() + i * n);
+            copy(s.parent.begin(), s.parent.end(), parent.begin() + i * n);
+        }
+    }
+
+    // Longest connection an update accepts, so that a route of n of them still fits in an int
+    int maxLength() const {
+        int perEdge = INT_MAX / max(1u, n) - 1;
+        if (!time) return perEdge;
+        int perKm = TimeCost::edge(1) - TimeCost::edge(0);
+        return max(0, (perEdge - TimeCost::edge(0)) / perKm);
+    }
+
+    // Returns the cost from sources[i] to v, INT_MAX if unreachable
+    int costTo(size_t i, uint32_t v) const {
+        return dist[i * n + v];
+    }
+
+    // Returns a change closing every connection of station u
+    vector<Change> closeStation(const FrozenGraph& g, uint32_t u) const {
+        vector<Change> changes;
+        for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+            changes.push_back({u, g.targets[e], CLOSED});
+        }
+        return changes;
+    }
+
+    // Returns a change reopening every connection of station u at its original length
+    vector<Change> reopenStation(const FrozenGraph& g, uint32_t u) const {
+        vector<Change> changes;
+        for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+            changes.push_back({u, g.targets[e], g.weights[e]});
+        }
+        return changes;
+    }
+
+    /**
+     * Applies a batch of changes and repairs every tree once for all of
+     * them. If changed is given, it receives each pair whose cost moved.
+     * @return Empty string on success, otherwise why nothing was applied
+     */
+    string update(const FrozenGraph& g, const vector<Change>& changes, vector<Changed>* changed = nullptr) {
+        // Edge index of each change in both directions, with its cost before
+        vector<Edit> edits;
+        for (const Change& c : changes) {
+            uint32_t uv = edgeIndex(g, c.u, c.v), vu = edgeIndex(g, c.v, c.u);
+            if (uv == NO_STATION || vu == NO_STATION) {
+                return "no connection between " + g.name(c.u) + " and " + g.name(c.v);
+            }
+            if (c.km < CLOSED) return "negative length";
+            if (c.km > maxLength()) return "length over " + to_string(maxLength()) + " km";
+            edits.push_back({c.u, c.v, uv, vu, cost[uv], 0});
+        }
+        for (size_t i = 0; i < changes.size(); i++) {
+            int km = changes[i].km;
+            Edit& ed = edits[i];
+            int c = km == CLOSED ? CLOSED_EDGE : time ? TimeCost::edge(km) : DistanceCost::edge(km);
+            this->km[ed.uv] = this->km[ed.vu] = km;
+            cost[ed.uv] = cost[ed.vu] = c;
+        }
+        // A later change to the same connection overrides an earlier one
+        for (Edit& ed : edits) {
+            ed.after = cost[ed.uv];
+        }
+
+        resettled = 0;
+        if (changed) changed->clear();
+        mark.assign(n, 0);
+        stamp = 0;
+        heap.resize(n);
+        for (size_t i = 0; i < sources.size(); i++) {
+            repair(g, i, edits, changed);
+        }
+        return "";
+    }
+
+private:
+    class Edit {
+    public:
+        uint32_t u, v;
+        uint32_t uv, vu;    // CSR edge indices
+        int before, after;  // Costs
+    };
+
+    vector<uint32_t> mark;                  // mark[v] == stamp: v's cost may change in this repair
+    uint32_t stamp = 0;
+    vector<pair<uint32_t, int>> touched;    // Stations marked in this repair, with their cost before
+    IndexedHeap heap;
+
+    // Returns the CSR index of edge u -> v, or NO_STATION if they are not adjacent
+    static uint32_t edgeIndex(const FrozenGraph& g, uint32_t u, uint32_t v) {
+        const uint32_t* first = g.targets.data() + g.offsets[u];
+        const uint32_t* last = g.targets.data() + g.offsets[u + 1];
+        const uint32_t* it = lower_bound(first, last, v);
+        return it == last || *it != v ? NO_STATION : it - g.targets.data();
+    }
+
+    // Repairs tree i after edits, which are already applied to cost
+    void repair(const FrozenGraph& g, size_t i, const vector<Edit>& edits, vector<Changed>* changed) {
+        int* d = dist.data() + i * n;
+        uint32_t* p = parent.data() + i * n;
+        stamp++;
+        touched.clear();
+
+        auto touch = [&](uint32_t v) {
+            if (mark[v] == stamp) return;
+            mark[v] = stamp;
+            touched.push_back({v, d[v]});
+        };
+
+        // A longer or closed tree edge cuts off the subtree below it; its children are
+        // the neighbours whose parent it is, so no child lists are needed
+        for (const Edit& ed : edits) {
+            if (ed.after <= ed.before) continue;
+            for (uint32_t b : {ed.u, ed.v}) {
+                uint32_t a = b == ed.u ? ed.v : ed.u;
+                if (p[b] != a || mark[b] == stamp) continue;
+                size_t head = touched.size();
+                touch(b);
+                for (size_t q = head; q < touched.size(); q++) {
+                    uint32_t x = touched[q].first;
+                    for (uint32_t e = g.offsets[x]; e < g.offsets[x + 1]; e++) {
+                        uint32_t y = g.targets[e];
+                        if (p[y] == x) touch(y);
+                    }
+                }
+            }
+        }
+        for (const pair<uint32_t, int>& t : touched) {
+            d[t.first] = INT_MAX;
+            p[t.first] = NO_STATION;
+        }
+
+        // Re-seed the cut-off stations from their best neighbour outside the cut
+        size_t cut = touched.size();
+        for (size_t k = 0; k < cut; k++) {
+            uint32_t x = touched[k].first;
+            for (uint32_t e = g.offsets[x]; e < g.offsets[x + 1]; e++) {
+                uint32_t y = g.targets[e];
+                if (mark[y] == stamp || d[y] == INT_MAX || cost[e] == CLOSED_EDGE) continue;
+                if (d[y] + cost[e] < d[x]) {
+                    d[x] = d[y] + cost[e];
+                    p[x] = y;
+                }
+            }
+            if (d[x] != INT_MAX) heap.pushOrDecrease(x, d[x]);
+        }
+
+        // A shorter or reopened edge can improve its far end
+        for (const Edit& ed : edits) {
+            if (ed.after >= ed.before) continue;
+            for (uint32_t b : {ed.u, ed.v}) {
+                uint32_t a = b == ed.u ? ed.v : ed.u;
+                if (d[a] == INT_MAX || d[a] + ed.after >= d[b]) continue;
+                touch(b);
+                d[b] = d[a] + ed.after;
+                p[b] = a;
+                heap.pushOrDecrease(b, d[b]);
+            }
+        }
+
+        // Spread the new costs only as far as they improve
+        while (!heap.empty()) {
+            IndexedHeap::Entry rp = heap.pop();
+            resettled++;
+            for (uint32_t e = g.offsets[rp.id]; e < g.offsets[rp.id + 1]; e++) {
+                if (cost[e] == CLOSED_EDGE) continue;
+                uint32_t y = g.targets[e];
+                int nc = rp.key + cost[e];
+                if (nc < d[y]) {
+                    touch(y);
+                    d[y] = nc;
+                    p[y] = rp.id;
+                    heap.pushOrDecrease(y, nc);
+                }
+            }
+        }
+
+        if (!changed) return;
+        for (const pair<uint32_t, int>& t : touched) {
+            if (d[t.first] != t.second) changed->push_back({sources[i], t.first, t.second, d[t.first]});
+        }
+    }
+};
+
+/**
+ * BatchOptions class holds the command line settings of batch mode.
+ */
+class BatchOptions {
+public:
+    string input = "-";         // OD file, "-" for stdin
+    string output = "-";        // Results file, "-" for stdout
+    bool time = false;          // Route by time instead of distance
+    unsigned threads = 0;       // 0 means one per hardware thread
+    string table;               // Route table to serve from instead of searching
+    string ch;                  // Contraction hierarchy to query instead of Dijkstra
+    bool alt = false;           // Use landmark-guided bidirectional A* instead of Dijkstra
+    bool crp = false;           // Use the customizable route planning overlay instead of Dijkstra
+    uint32_t alternatives = 1;  // Routes per pair; more than one lists Dijkstra alternatives
+    int depart = -1;            // Seconds after midnight; if set, route by the timetable
+    string closures;            // Updates to apply to a maintained distance table instead
+    size_t cacheBytes = 0;      // Route cache budget for Dijkstra queries, 0 for none
+    size_t blockLines = 1 << 16;    // OD pairs read per block
+    size_t chunkLines = 512;        // OD pairs per pool task
+    Renderer::Format format = Renderer::TEXT;   // Output as CSV, JSON Lines or binary records
+};
+
+// Strips surrounding spaces, tabs and carriage returns
+static string trimField(const string& s, size_t begin, size_t end) {
+    while (begin < end && isspace((unsigned char)s[begin])) begin++;
+    while (end > begin && isspace((unsigned char)s[end - 1])) end--;
+    return s.substr(begin, end - begin);
+}
+
+/**
+ * Answers a stream of origin-destination pairs without the menu.
+ * Each input line is "source,destination"; blank lines and lines starting
+ * with '#' are skipped. Blocks of lines are split into chunks that run on
+ * a work-stealing pool, every worker with its own SearchScratch over the
+ * shared frozen graph, and results are written in input order.
+ * The table, hierarchy, ALT and CRP engines agree with Dijkstra on the
+ * cost of each route but may break ties between equal-cost routes
+ * differently, so the other columns can vary with the engine.
+ * @return Process exit code
+ */
+int runBatch(Graph_M& gm, const BatchOptions& opt) {
+    const FrozenGraph& g = gm.frozen();
+
+    ifstream fin;
+    istream* in = &cin;
+    if (opt.input != "-") {
+        fin.open(opt.input);
+        if (!fin) {
+            cerr << "Cannot open " << opt.input << "\n";
+            return 1;
+        }
+        in = &fin;
+    }
+
+    FILE* out = stdout;
+    if (opt.output != "-") {
+        out = fopen(opt.output.c_str(), "wb");
+        if (!out) {
+            cerr << "Cannot open " << opt.output << "\n";
+            return 1;
+        }
+    }
+
+    RouteTable table;
+    if (!opt.table.empty()) {
+        string err = table.open(opt.table, g);
+        if (!err.empty()) {
+            cerr << "Route table rejected: " << err << "\n";
+            return 1;
+        }
+    }
+
+    ContractionHierarchy ch;
+    bool useCh = !opt.ch.empty();
+    if (useCh) {
+        string err = ch.load(opt.ch, g);
+        if (err.empty() && ch.metric != (opt.time ? 1u : 0u)) err = "hierarchy was built for the other metric";
+        if (!err.empty()) {
+            cerr << "Contraction hierarchy rejected: " << err << "\n";
+            return 1;
+        }
+    }
+
+    vector<int> altCosts;
+    LandmarkIndex landmarks;
+    if (opt.alt) {
+        altCosts = opt.time ? edgeCosts<TimeCost>(g) : edgeCosts<DistanceCost>(g);
+        landmarks = LandmarkIndex::build(g, altCosts, Graph_M::NUM_LANDMARKS);
+    }
+
+    unsigned n = opt.threads ? opt.threads : max(1u, thread::hardware_concurrency());
+    WorkStealingPool pool(n);
+    vector<QueryContext> contexts(pool.size());
+    RouteCache& cache = gm.routeCache;
+    cache.setCapacity(opt.cacheBytes);
+
+    const Timetable* timetable = opt.depart >= 0 ? &gm.schedule() : nullptr;
+    vector<Timetable::Scratch> scans(timetable ? pool.size() : 0);
+
+    CrpPartition partition;
+    CrpMetric crp;
+    if (opt.crp) {
+        partition = CrpPartition::build(g, Graph_M::CRP_CELL_SIZES);
+        crp = CrpMetric::customize(g, partition, opt.time ? edgeCosts<TimeCost>(g)
+                                                          : edgeCosts<DistanceCost>(g), pool);
+    }
+    size_t pairs = 0;
+    auto start = chrono::steady_clock::now();
+
+    {
+        BufferedWriter writer(out);
+        bool ranked = opt.alternatives > 1;
+        Renderer render(opt.format, ranked);
+        render.routesHeader(writer.data(), g);
+
+        vector<string> lines;
+        vector<string> chunkOut;
+        string line;
+        bool more = true;
+
+        while (more) {
+            lines.clear();
+            while (lines.size() < opt.blockLines) {
+                if (!getline(*in, line)) {
+                    more = false;
+                    break;
+                }
+                if (line.empty() || line[0] == '#' || line[0] == '\r') continue;
+                lines.push_back(line);
+            }
+            if (lines.empty()) break;
+            pairs += lines.size();
+
+            size_t chunks = (lines.size() + opt.chunkLines - 1) / opt.chunkLines;
+            // Chunk buffers keep their capacity from block to block
+            if (chunkOut.size() < chunks) chunkOut.resize(chunks);
+            for (size_t c = 0; c < chunks; c++) {
+                chunkOut[c].clear();
+            }
+
+            pool.run(chunks, [&](unsigned worker, size_t chunk) {
+                string& res = chunkOut[chunk];
+                size_t end = min(lines.size(), (chunk + 1) * opt.chunkLines);
+                for (size_t i = chunk * opt.chunkLines; i < end; i++) {
+                    const string& l = lines[i];
+                    size_t comma = l.find(',');
+                    string src = trimField(l, 0, comma == string::npos ? l.size() : comma);
+                    string dst = comma == string::npos ? "" : trimField(l, comma + 1, l.size());
+
+                    uint32_t s = g.resolve(src);
+                    uint32_t d = g.resolve(dst);
+                    QueryContext& ctx = contexts[worker];
+                    if (s == NO_STATION || d == NO_STATION) {
+                        render.route(res, g, src, dst, s, d, 0, Renderer::INVALID, ctx.result);
+                        continue;
+                    }
+
+                    if (ranked) {
+                        vector<RouteResult> routes = opt.time
+                            ? AlternativeRoutes::find<TimeCost>(g, s, d, opt.alternatives, Graph_M::DEFAULT_OVERLAP, ctx)
+                            : AlternativeRoutes::find<DistanceCost>(g, s, d, opt.alternatives, Graph_M::DEFAULT_OVERLAP, ctx);
+                        if (routes.empty()) render.route(res, g, src, dst, s, d, 0, Renderer::UNREACHABLE, ctx.result);
+                        for (size_t k = 0; k < routes.size(); k++) {
+                            render.route(res, g, src, dst, s, d, k + 1, Renderer::FOUND, routes[k]);
+                        }
+                        continue;
+                    }
+
+                    if (timetable) {
+                        QUERY_STATS(QueryStats::Scope stats(s, d);)
+                        ctx.result = timetable->earliestArrival(g, s, d, opt.depart, scans[worker]);
+                    } else if (table.isOpen()) {
+                        ctx.result = table.route(g, s, d, opt.time);
+                    } else if (useCh) {
+                        ctx.result = ch.route(g, s, d, ctx.forward, ctx.backward);
+                    } else if (opt.alt) {
+                        ctx.result = landmarks.route(g, altCosts, s, d, ctx.forward, ctx.backward);
+                    } else if (opt.crp) {
+                        ctx.result = crp.route(g, partition, s, d, ctx.forward, ctx.backward);
+                    } else {
+                        QUERY_STATS(QueryStats::Scope stats(s, d);)
+                        RouteCache::Key key{s, d, opt.time, gm.version};
+                        if (!cache.lookup(key, ctx.result)) {
+                            ctx.route(g, s, d, opt.time);
+                            cache.insert(key, ctx.result);
+                        }
+                    }
+                    const RouteResult& r = ctx.result;
+                    render.route(res, g, src, dst, s, d, 0, r.found ? Renderer::FOUND : Renderer::UNREACHABLE, r);
+                }
+            });
+
+            for (size_t c = 0; c < chunks; c++) {
+                writer.write(chunkOut[c]);
+            }
+        }
+    }
+
+    if (out != stdout) fclose(out);
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << pairs << " pairs in " << secs << " s on " << pool.size() << " threads ("
+         << (secs > 0 ? pairs / secs : 0) << " pairs/s)\n";
+    if (cache.enabled()) RouteCache::printStats(cerr, cache.stats());
+    return 0;
+}
+
+/**
+ * Applies closure updates to a distance table over every station and
+ * writes the pairs each update changed. Each input line is one update of
+ * ';'-separated changes: close,A,B  reopen,A,B  set,A,B,KM
+ * close-station,A  reopen-station,A. Blank lines and '#' lines are skipped.
+ * @return Process exit code
+ */
+int runClosures(Graph_M& gm, const BatchOptions& opt) {
+    const FrozenGraph& g = gm.frozen();
+    uint32_t n = g.numStations();
+    if ((uint64_t)n * n > (1u << 28)) {
+        cerr << "A distance table over " << n << " stations is too large to maintain\n";
+        return 1;
+    }
+
+    ifstream in(opt.closures);
+    if (!in) {
+        cerr << "Cannot open " << opt.closures << "\n";
+        return 1;
+    }
+    FILE* out = stdout;
+    if (opt.output != "-") {
+        out = fopen(opt.output.c_str(), "wb");
+        if (!out) {
+            cerr << "Cannot open " << opt.output << "\n";
+            return 1;
+        }
+    }
+
+    vector<uint32_t> sources(n);
+    iota(sources.begin(), sources.end(), 0);
+    auto start = chrono::steady_clock::now();
+    DynamicRoutes dr = DynamicRoutes::build(g, sources, opt.time);
+    double buildSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int status = 0;
+    double repairSecs = 0;
+    size_t updates = 0, lineNo = 0;
+    {
+        BufferedWriter writer(out);
+        writer.write("update,source,destination,before,after\n");
+        string line;
+        vector<DynamicRoutes::Change> changes;
+        vector<DynamicRoutes::Changed> changed;
+
+        while (getline(in, line)) {
+            lineNo++;
+            if (line.empty() || line[0] == '#' || line[0] == '\r') continue;
+
+            changes.clear();
+            string err;
+            stringstream records(line);
+            string record;
+            while (err.empty() && getline(records, record, ';')) {
+                vector<string> f;
+                size_t begin = 0;
+                while (true) {
+                    size_t comma = record.find(',', begin);
+                    f.push_back(trimField(record, begin, comma == string::npos ? record.size() : comma));
+                    if (comma == string::npos) break;
+                    begin = comma + 1;
+                }
+                bool station = f[0] == "close-station" || f[0] == "reopen-station";
+                uint32_t u = f.size() > 1 ? g.findId(f[1]) : NO_STATION;
+                uint32_t v = f.size() > 2 ? g.findId(f[2]) : NO_STATION;
+                if (u == NO_STATION || (!station && v == NO_STATION)) {
+                    err = "unknown station";
+                } else if (f[0] == "close" && f.size() == 3) {
+                    changes.push_back({u, v, DynamicRoutes::CLOSED});
+                } else if (f[0] == "reopen" && f.size() == 3) {
+                    changes.push_back({u, v, g.edgeWeight(u, v)});
+                } else if (f[0] == "set" && f.size() == 4) {
+                    char* rest;
+                    long km = strtol(f[3].c_str(), &rest, 10);
+                    if (f[3].empty() || *rest != '\0' || km < 0 || km > INT_MAX) err = "bad distance " + f[3];
+                    else changes.push_back({u, v, (int)km});
+                } else if (f[0] == "close-station" && f.size() == 2) {
+                    vector<DynamicRoutes::Change> c = dr.closeStation(g, u);
+                    changes.insert(changes.end(), c.begin(), c.end());
+                } else if (f[0] == "reopen-station" && f.size() == 2) {
+                    vector<DynamicRoutes::Change> c = dr.reopenStation(g, u);
+                    changes.insert(changes.end(), c.begin(), c.end());
+                } else {
+                    err = "unrecognised change " + record;
+                }
+            }
+
+            auto t0 = chrono::steady_clock::now();
+            if (err.empty()) err = dr.update(g, changes, &changed);
+            repairSecs += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            if (!err.empty()) {
+                cerr << "line " << lineNo << ": " << err << "\n";
+                status = 1;
+                continue;
+            }
+            updates++;
+
+            string res;
+            for (const DynamicRoutes::Changed& c : changed) {
+                res += to_string(lineNo) + ',' + g.name(c.src) + ',' + g.name(c.dst) + ',';
+                res += c.before == INT_MAX ? "unreachable" : to_string(c.before);
+                res += ',';
+                res += c.after == INT_MAX ? "unreachable" : to_string(c.after);
+                res += '\n';
+            }
+            writer.write(res);
+        }
+    }
+    if (out != stdout) fclose(out);
+
+    cerr << updates << " updates repaired in " << repairSecs * 1e3 << " ms (table of " << n
+         << " stations built in " << buildSecs * 1e3 << " ms)\n";
+    return status;
+}
+
+/**
+ * QueryServer answers route queries over TCP with a line-delimited
+ * protocol, one answer line per request line, in request order:
+ *
+ *   distance SRC,DST            OK KM
+ *   time SRC,DST                OK SECONDS
+ *   route distance|time SRC,DST OK KM SECONDS INTERCHANGES STATION,STATION,...
+ *   fare distance|time SRC,DST  OK STATIONS FARE
+ *   stations                    OK COUNT STATION,STATION,...
+ *   complete PREFIX             OK COUNT STATION,STATION,...  (up to 10, by name)
+ *   reach distance|time|fare BUDGET SRC
+ *                               OK COUNT STATION:KM:SECONDS:INTERCHANGES:FARE,...
+ *                               (every station within BUDGET km, seconds or Rs., nearest first)
+ *   matrix distance|time SRC,SRC,...;DST,DST,...
+ *                               OK ROWS COLS COST COST ...  (row by row, -1 if unreachable)
+ *   quit                        closes the connection after the earlier answers
+ *
+ * Failures answer "ERR reason". One thread runs a non-blocking epoll
+ * loop that reads requests and writes answers; the requests themselves
+ * run on a fixed pool of workers, each with its own QueryContext, so a
+ * client may pipeline many requests without waiting. A client that
+ * stops reading is no longer read from once it has too many requests
+ * in flight or too many unsent bytes, until it catches up. The network
+ * must not change while the server runs.
+ */
+class QueryServer {
+public:
+    static constexpr size_t MAX_LINE = 4096;            // Longest request line
+    static constexpr size_t MAX_IN_FLIGHT = 1024;       // Requests per connection before reading pauses
+    static constexpr size_t MAX_UNSENT = 1 << 20;       // Unsent answer bytes per connection before reading pauses
+
+    uint64_t requests = 0;      // Requests answered
+    uint64_t connections = 0;   // Connections accepted
+    const ContractionHierarchy* hierarchy = nullptr;    // Answers matrix requests of its metric if set
+
+    QueryServer(Graph_M& gm, unsigned threads)
+        : g(gm.frozen()), lineGraph(gm.lines()), cache(gm.routeCache), version(gm.version),
+          penalty{gm.transferPenalty[0], gm.transferPenalty[1]} {
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~QueryServer() {
+        {
+            lock_guard<mutex> lock(jobLock);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (thread& t : workers) {
+            t.join();
+        }
+        for (auto& c : conns) {
+            close(c.second.fd);
+        }
+        if (listenFd >= 0) close(listenFd);
+        if (wakeFd >= 0) close(wakeFd);
+        if (epollFd >= 0) close(epollFd);
+    }
+
+    /**
+     * Binds to host:port (port 0 picks a free one) and prepares the loop.
+     * @return Empty string on success, otherwise why it failed
+     */
+    string listen(const string& host, int port) {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) return strerror(errno);
+        int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) return "bad address " + host;
+        if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(listenFd, SOMAXCONN) < 0) {
+            return strerror(errno);
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(listenFd, (sockaddr*)&addr, &len);
+        boundPort = ntohs(addr.sin_port);
+
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) return strerror(errno);
+        watch(listenFd, LISTEN_ID, EPOLLIN);
+        watch(wakeFd, WAKE_ID, EPOLLIN);
+        return "";
+    }
+
+    int port() const {
+        return boundPort;
+    }
+
+    // Runs the event loop until stop() is called
+    void run() {
+        epoll_event events[256];
+        while (!stopRequested.load()) {
+            int n = epoll_wait(epollFd, events, 256, -1);
+            if (n < 0 && errno != EINTR) break;
+            for (int i = 0; i < n; i++) {
+                uint64_t id = events[i].data.u64;
+                if (id == LISTEN_ID) {
+                    acceptAll();
+                } else if (id == WAKE_ID) {
+                    uint64_t count;
+                    while (read(wakeFd, &count, sizeof(count)) > 0) {}
+                    deliver();
+                } else {
+                    auto it = conns.find(id);
+                    if (it == conns.end()) continue;
+                    Connection& c = it->second;
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) c.broken = true;
+                    if (!c.broken && (events[i].events & EPOLLIN)) readFrom(c);
+                    if (!c.broken && (events[i].events & EPOLLOUT)) writeTo(c);
+                    settle(id);
+                }
+            }
+        }
+    }
+
+    // Makes run() return; safe from any thread and from signal handlers
+    void stop() {
+        stopRequested.store(true);
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {}
+    }
+
+    /**
+     * Answers one request line with the same results as the menu.
+     * Thread-safe: all state it changes is in ctx or the route cache.
+     */
+    string answer(const string& line, QueryContext& ctx) const {
+        size_t end = line.size();
+        while (end > 0 && isspace((unsigned char)line[end - 1])) end--;
+        size_t space = line.find(' ');
+        string cmd = line.substr(0, min(space, end));
+        size_t rest = space == string::npos ? end : space + 1;
+
+        if (cmd == "complete") {
+            static thread_local NameIndex::Scratch s;
+            static thread_local vector<uint32_t> ids;
+            g.stations->search().complete(line.substr(rest, end - rest), COMPLETIONS, ids, s);
+            return "OK " + stationList(ids);
+        }
+
+        if (cmd == "stations") {
+            string res = "OK " + to_string(g.numStations()) + ' ';
+            for (uint32_t u = 0; u < g.numStations(); u++) {
+                if (u) res += ',';
+                res += g.name(u);
+            }
+            return res;
+        }
+
+        if (cmd == "reach") return reach(line, rest, end, ctx);
+        if (cmd == "matrix") return matrix(line, rest, end);
+
+        bool lines = cmd == "lines";
+        bool path = cmd == "route" || lines, fare = cmd == "fare";
+        bool nan = cmd == "time";
+        if (!path && !fare && cmd != "distance" && !nan) return "ERR unknown command " + cmd;
+        if (path || fare) {
+            size_t sp = line.find(' ', rest);
+            string metric = trimField(line, rest, min(sp, end));
+            if (metric != "distance" && metric != "time") return "ERR expected distance or time";
+            nan = metric == "time";
+            rest = sp == string::npos ? end : sp + 1;
+        }
+        size_t comma = line.find(',', rest);
+        if (comma == string::npos || comma > end) return "ERR expected SOURCE,DESTINATION";
+        string src = trimField(line, rest, comma);
+        string dst = trimField(line, comma + 1, end);
+        uint32_t s = g.resolve(src);
+        if (s == NO_STATION) return unknownStation(src);
+        uint32_t d = g.resolve(dst);
+        if (d == NO_STATION) return unknownStation(dst);
+
+        QUERY_STATS(QueryStats::Scope stats(s, d);)
+        Graph_M::Engine engine = lines ? Graph_M::LINES : Graph_M::DIJKSTRA;
+        RouteCache::Key key{s, d, nan + 2u * engine, version};
+        RouteResult& r = ctx.result;
+        if (!cache.lookup(key, r)) {
+            if (lines) {
+                r = nan ? lineGraph.route<TimeCost>(g, s, d, penalty[1], ctx.forward)
+                        : lineGraph.route<DistanceCost>(g, s, d, penalty[0], ctx.forward);
+            } else {
+                ctx.route(g, s, d, nan);
+            }
+            cache.insert(key, r);
+        }
+        if (!r.found) return "ERR no path";
+
+        if (fare) return "OK " + to_string(r.numStations()) + ' ' + to_string(r.fare);
+        if (!path) return "OK " + to_string(nan ? r.time : r.distance);
+        string res = "OK " + to_string(r.distance) + ' ' + to_string(r.time) + ' '
+                   + to_string(r.interchanges.size()) + ' ';
+        for (size_t i = 0; i < r.stations.size(); i++) {
+            if (i) res += ',';
+            res += g.name(r.stations[i]);
+        }
+        return res;
+    }
+
+private:
+    static constexpr uint64_t LISTEN_ID = 0, WAKE_ID = 1;
+    static constexpr size_t COMPLETIONS = 10;   // Stations listed by complete and suggestions
+
+    // Formats a count and the stations' names, comma-separated
+    string stationList(const vector<uint32_t>& ids) const {
+        string res = to_string(ids.size()) + ' ';
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (i) res += ',';
+            res += g.name(ids[i]);
+        }
+        return res;
+    }
+
+    // Answers "reach METRIC BUDGET SRC" from one bounded search
+    string reach(const string& line, size_t rest, size_t end, QueryContext& ctx) const {
+        stringstream ss(line.substr(rest, end - rest));
+        string metric, src;
+        long budget;
+        if (!(ss >> metric >> budget) || budget < 0) return "ERR expected METRIC BUDGET SOURCE";
+        if (metric != "distance" && metric != "time" && metric != "fare") {
+            return "ERR expected distance, time or fare";
+        }
+        getline(ss, src);
+        src = trimField(src, 0, src.size());
+        uint32_t s = g.resolve(src);
+        if (s == NO_STATION) return unknownStation(src);
+
+        Isochrone::Metric m = metric == "distance" ? Isochrone::DISTANCE
+                            : metric == "time" ? Isochrone::TIME : Isochrone::FARE;
+        QUERY_STATS(QueryStats::Scope stats(s, NO_STATION);)
+        string body;
+        uint32_t count = Isochrone::run(g, s, m, (int)min(budget, (long)INT_MAX), ctx.forward, ctx.reach,
+                                        [this, &body](const Isochrone::Reach& r) {
+            if (!body.empty()) body += ',';
+            body += g.name(r.station);
+            for (int v : {r.distance, r.time, r.interchanges, r.fare}) {
+                body += ':';
+                body += to_string(v);
+            }
+            return true;
+        });
+        return "OK " + to_string(count) + ' ' + body;
+    }
+
+    // Answers "matrix METRIC SOURCES;TARGETS", with the hierarchy if one was given for the metric
+    string matrix(const string& line, size_t rest, size_t end) const {
+        size_t sp = line.find(' ', rest);
+        string metric = trimField(line, rest, min(sp, end));
+        if (metric != "distance" && metric != "time") return "ERR expected distance or time";
+        bool nan = metric == "time";
+        rest = sp == string::npos ? end : sp + 1;
+        size_t semi = line.find(';', rest);
+        if (semi == string::npos || semi > end) return "ERR expected SOURCES;TARGETS";
+
+        static thread_local vector<uint32_t> ids[2];
+        size_t from[2] = {rest, semi + 1}, to[2] = {semi, end};
+        for (int k = 0; k < 2; k++) {
+            ids[k].clear();
+            for (size_t b = from[k]; b <= to[k];) {
+                size_t comma = min(line.find(',', b), to[k]);
+                string name = trimField(line, b, comma);
+                uint32_t id = g.resolve(name);
+                if (id == NO_STATION) return unknownStation(name);
+                ids[k].push_back(id);
+                b = comma + 1;
+            }
+        }
+
+        static thread_local ManyToMany::Scratch scratch;
+        static thread_local CostMatrix m;
+        QUERY_STATS(QueryStats::Scope stats(ids[0][0], ids[1][0]);)
+        if (hierarchy && hierarchy->metric == (nan ? 1u : 0u)) {
+            ManyToMany::buckets(*hierarchy, ids[0], ids[1], scratch, m);
+        } else if (nan) {
+            ManyToMany::rows<TimeCost>(g, ids[0], ids[1], scratch, m);
+        } else {
+            ManyToMany::rows<DistanceCost>(g, ids[0], ids[1], scratch, m);
+        }
+        string res = "OK " + to_string(m.rows) + ' ' + to_string(m.cols);
+        for (int c : m.cost) {
+            res += ' ';
+            res += c == INT_MAX ? "-1" : to_string(c);
+        }
+        return res;
+    }
+
+    // Answer to a station that does not resolve, with the closest names if any
+    string unknownStation(const string& text) const {
+        static thread_local NameIndex::Scratch s;
+        static thread_local vector<NameIndex::Match> close;
+        g.stations->search().fuzzy(text, 2, COMPLETIONS, close, s);
+        string res = "ERR unknown station " + text;
+        for (size_t i = 0; i < close.size(); i++) {
+            res += i ? ", " : " (did you mean ";
+            res += g.name(close[i].id);
+        }
+        return close.empty() ? res : res + ")";
+    }
+
+    class Connection {
+    public:
+        int fd = -1;
+        uint32_t events = 0;        // Events epoll watches for
+        string in;                  // Received bytes not yet split into requests
+        string out;                 // Answers not yet sent
+        size_t sent = 0;            // Bytes of out already sent
+        uint64_t nextSeq = 0;       // Sequence number of the next request
+        uint64_t nextSend = 0;      // Sequence number of the next answer to send
+        map<uint64_t, string> ready;    // Answers that arrived ahead of nextSend
+        bool eof = false;           // Client sent everything, or quit
+        bool broken = false;        // Socket failed; close without sending more
+    };
+
+    class Job {
+    public:
+        uint64_t conn, seq;
+        string line;
+    };
+
+    const FrozenGraph& g;
+    const LineGraph& lineGraph;
+    RouteCache& cache;
+    uint64_t version;
+    int penalty[2];
+
+    int listenFd = -1, epollFd = -1, wakeFd = -1;
+    int boundPort = 0;
+    atomic<bool> stopRequested{false};
+    uint64_t nextConn = 2;
+    unordered_map<uint64_t, Connection> conns;
+
+    vector<thread> workers;
+    mutex jobLock;
+    condition_variable jobReady;
+    deque<Job> jobs;
+    bool stopping = false;
+    mutex doneLock;
+    vector<Job> done;           // Answered jobs, line holding the answer
+
+    void watch(int fd, uint64_t id, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = id;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    // Worker loop: answers jobs and hands them back to the event loop
+    void work() {
+        QueryContext ctx;
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> lock(jobLock);
+                jobReady.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (stopping) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job.line = answer(job.line, ctx);
+            job.line += '\n';
+            bool wake;
+            {
+                lock_guard<mutex> lock(doneLock);
+                wake = done.empty();
+                done.push_back(std::move(job));
+            }
+            // The loop drains every answer per wake-up, so only the first needs to wake it
+            if (wake) {
+                uint64_t one = 1;
+                if (write(wakeFd, &one, sizeof(one)) < 0) {}
+            }
+        }
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            uint64_t id = nextConn++;
+            Connection& c = conns[id];
+            c.fd = fd;
+            c.events = EPOLLIN;
+            watch(fd, id, EPOLLIN);
+            connections++;
+        }
+    }
+
+    // Reads what the socket has into c.in
+    void readFrom(Connection& c) {
+        char buf[65536];
+        while (true) {
+            ssize_t n = read(c.fd, buf, sizeof(buf));
+            if (n > 0) {
+                c.in.append(buf, n);
+                // The rest waits for the next wake-up, keeping one client from holding the loop
+                if ((size_t)n < sizeof(buf) || c.in.size() >= MAX_UNSENT) break;
+            } else if (n == 0) {
+                c.eof = true;
+                break;
+            } else {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) c.broken = true;
+                break;
+            }
+        }
+    }
+
+    // Whether c has too much in flight to be read from
+    static bool saturated(const Connection& c) {
+        return c.nextSeq - c.nextSend >= MAX_IN_FLIGHT || c.out.size() - c.sent >= MAX_UNSENT;
+    }
+
+    // Splits complete lines of c.in into jobs until c is saturated
+    void dispatch(uint64_t id, Connection& c) {
+        size_t pos = 0;
+        vector<Job> batch;
+        while (pos < c.in.size() && !saturated(c)) {
+            size_t nl = c.in.find('\n', pos);
+            if (nl == string::npos) {
+                if (c.in.size() - pos > MAX_LINE) {
+                    c.ready[c.nextSeq++] = "ERR line too long\n";
+                    c.eof = true;
+                    pos = c.in.size();
+                    break;
+                }
+                if (!c.eof) break;
+                nl = c.in.size();   // Last line, sent without a newline
+            }
+            string line = c.in.substr(pos, nl - pos);
+            pos = min(nl + 1, c.in.size());
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty()) continue;
+            if (line.size() > MAX_LINE) {
+                c.ready[c.nextSeq++] = "ERR line too long\n";
+            } else if (line == "quit") {
+                c.eof = true;
+                pos = c.in.size();
+            } else {
+                batch.push_back({id, c.nextSeq++, std::move(line)});
+            }
+        }
+        c.in.erase(0, pos);
+        if (batch.empty()) return;
+        {
+            lock_guard<mutex> lock(jobLock);
+            for (Job& job : batch) {
+                jobs.push_back(std::move(job));
+            }
+        }
+        if (batch.size() == 1) {
+            jobReady.notify_one();
+        } else {
+            jobReady.notify_all();
+        }
+    }
+
+    // Moves the answers workers finished into their connections' output
+    void deliver() {
+        vector<Job> answered;
+        {
+            lock_guard<mutex> lock(doneLock);
+            answered.swap(done);
+        }
+        vector<uint64_t> touched;
+        for (Job& job : answered) {
+            auto it = conns.find(job.conn);
+            if (it == conns.end()) continue;   // Closed while the job ran
+            it->second.ready[job.seq] = std::move(job.line);
+            touched.push_back(job.conn);
+            requests++;
+        }
+        sort(touched.begin(), touched.end());
+        touched.erase(unique(touched.begin(), touched.end()), touched.end());
+        for (uint64_t id : touched) {
+            settle(id);
+        }
+    }
+
+    // Sends what it can of c.out
+    void writeTo(Connection& c) {
+        while (c.sent < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                c.sent += n;
+            } else {
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) c.broken = true;
+                break;
+            }
+        }
+        if (c.sent == c.out.size()) {
+            c.out.clear();
+            c.sent = 0;
+        } else if (c.sent > MAX_UNSENT) {
+            c.out.erase(0, c.sent);
+            c.sent = 0;
+        }
+    }
+
+    /**
+     * Brings connection id up to date after anything happened to it:
+     * queues new requests, appends answers in order, sends, and either
+     * closes it or sets the events to wait for.
+     */
+    void settle(uint64_t id) {
+        auto it = conns.find(id);
+        if (it == conns.end()) return;
+        Connection& c = it->second;
+        if (!c.broken) {
+            dispatch(id, c);
+            while (!c.ready.empty() && c.ready.begin()->first == c.nextSend) {
+                c.out += c.ready.begin()->second;
+                c.ready.erase(c.ready.begin());
+                c.nextSend++;
+            }
+            writeTo(c);
+            // Sending may have made room for requests held back
+            if (!c.broken && !c.in.empty()) dispatch(id, c);
+        }
+
+        bool finished = c.eof && c.in.empty() && c.nextSend == c.nextSeq && c.out.empty();
+        if (c.broken || finished) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, c.fd, nullptr);
+            close(c.fd);
+            conns.erase(it);
+            return;
+        }
+        uint32_t events = (c.eof || saturated(c) ? 0u : (uint32_t)EPOLLIN) | (c.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+        if (events != c.events) {
+            epoll_event ev{};
+            ev.events = events;
+            ev.data.u64 = id;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &ev);
+            c.events = events;
+        }
+    }
+};
+
+// Server stopped by SIGINT and SIGTERM
+static QueryServer* activeServer = nullptr;
+
+/**
+ * Serves queries on host:port until interrupted, with one worker per
+ * thread (default: all cores). A hierarchy from chFile, if given, answers
+ * matrix requests of its metric.
+ * @return Process exit code
+ */
+int runServer(Graph_M& gm, const string& address, unsigned threads, const string& chFile) {
+    size_t colon = address.rfind(':');
+    string host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+    int port = atoi(address.c_str() + (colon == string::npos ? 0 : colon + 1));
+    unsigned n = threads ? threads : max(1u, thread::hardware_concurrency());
+
+    QueryServer server(gm, n);
+    ContractionHierarchy ch;
+    if (!chFile.empty()) {
+        string err = ch.load(chFile, gm.frozen());
+        if (!err.empty()) {
+            cerr << "Contraction hierarchy rejected: " << err << "\n";
+            return 1;
+        }
+        server.hierarchy = &ch;
+    }
+    string err = server.listen(host, port);
+    if (!err.empty()) {
+        cerr << "Cannot listen on " << address << ": " << err << "\n";
+        return 1;
+    }
+    cerr << "Serving " << gm.numVetex() << " stations on " << host << ':' << server.port() << " with "
+         << n << " workers" << endl;
+
+    activeServer = &server;
+    auto onSignal = [](int) { activeServer->stop(); };
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    auto start = chrono::steady_clock::now();
+    server.run();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    activeServer = nullptr;
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << server.requests << " requests from " << server.connections << " connections in " << secs << " s\n";
+    if (gm.routeCache.enabled()) RouteCache::printStats(cerr, gm.routeCache.stats());
+    return 0;
+}
+
+// Seconds elapsed since t, for the benchmarks
+static double secondsSince(chrono::steady_clock::time_point t) {
+    return chrono::duration<double>(chrono::steady_clock::now() - t).count();
+}
+
+// Benchmark sizes led by 0, which stands for the built-in map
+static vector<uint32_t> withBuiltin(const vector<uint32_t>& sizes) {
+    vector<uint32_t> all = {0};
+    all.insert(all.end(), sizes.begin(), sizes.end());
+    return all;
+}
+
+/**
+ * Builds a random connected network for benchmarks: a random spanning
+ * tree plus about n/2 extra connections, 1-15 km each, from a fixed seed.
+ */
+GraphBuilder randomNetwork(uint32_t n, uint32_t seed) {
+    GraphBuilder b;
+    mt19937 rng(seed);
+    for (uint32_t i = 0; i < n; i++) {
+        b.addStation("S" + to_string(i) + "~" + string(1, 'A' + i % 26));
+    }
+    for (uint32_t i = 1; i < n; i++) {
+        b.addConnection(i, rng() % i, 1 + rng() % 15);
+    }
+    for (uint32_t i = 0; i < n / 2; i++) {
+        b.addConnection(rng() % n, rng() % n, 1 + rng() % 15);
+    }
+    return b;
+}
+
+/**
+ * Compares the routing engines on the same random OD pairs, for the
+ * built-in network and random networks of the given sizes: preprocessing
+ * time, query latency and settled stations per query for Dijkstra, ALT
+ * and the contraction hierarchy, and checks that all agree with Dijkstra.
+ */
+int runRoutingBench(const vector<uint32_t>& sizes, uint32_t queries) {
+    vector<uint32_t> all = withBuiltin(sizes);
+    cout << "stations,metric,engine,preprocess_s,query_us,settled,mismatches\n";
+
+    for (uint32_t size : all) {
+        FrozenGraph g = size == 0 ? builtinNetwork() : randomNetwork(size, 42).freeze();
+        uint32_t n = g.numStations();
+        mt19937 rng(7);
+        vector<pair<uint32_t, uint32_t>> od(queries);
+        for (auto& q : od) {
+            q = {rng() % n, rng() % n};
+        }
+
+        for (uint32_t metric = 0; metric < 2; metric++) {
+            bool time = metric == 1;
+            vector<int> cost = time ? edgeCosts<TimeCost>(g) : edgeCosts<DistanceCost>(g);
+            SearchScratch fwd, bwd;
+            vector<int> expected(queries);
+            size_t bad = 0;
+
+            auto report = [&](const char* engine, double prep, double secs, uint64_t settled) {
+                cout << n << ',' << (time ? "time" : "distance") << ',' << engine << ',' << prep << ','
+                     << secs * 1e6 / queries << ',' << (double)settled / queries << ',' << bad << endl;
+            };
+
+            uint64_t settled = 0;
+            auto t0 = chrono::steady_clock::now();
+            for (uint32_t q = 0; q < queries; q++) {
+                RouteResult r = Graph_M::RouteQuery(g, od[q].first, od[q].second, time, fwd);
+                expected[q] = time ? r.time : r.distance;
+                settled += fwd.settled;
+            }
+            report("dijkstra", 0, secondsSince(t0), settled);
+
+            t0 = chrono::steady_clock::now();
+            LandmarkIndex lm = LandmarkIndex::build(g, cost, Graph_M::NUM_LANDMARKS);
+            double prep = secondsSince(t0);
+            settled = 0;
+            t0 = chrono::steady_clock::now();
+            for (uint32_t q = 0; q < queries; q++) {
+                RouteResult r = lm.route(g, cost, od[q].first, od[q].second, fwd, bwd);
+                settled += fwd.settled + bwd.settled;
+                if ((time ? r.time : r.distance) != expected[q]) bad++;
+            }
+            report("alt", prep, secondsSince(t0), settled);
+
+            t0 = chrono::steady_clock::now();
+            ContractionHierarchy ch = ContractionHierarchy::build(g, cost, metric);
+            prep = secondsSince(t0);
+            settled = 0;
+            t0 = chrono::steady_clock::now();
+            for (uint32_t q = 0; q < queries; q++) {
+                RouteResult r = ch.route(g, od[q].first, od[q].second, fwd, bwd);
+                settled += fwd.settled + bwd.settled;
+                if ((time ? r.time : r.distance) != expected[q]) bad++;
+            }
+            report("ch", prep, secondsSince(t0), settled);
+            if (bad) return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Compares one bounded search against one search per destination: a
+ * one-to-all isochrone from each of a few sources against a RouteQuery
+ * per destination, and an S x T matrix by the hierarchy's buckets and by
+ * one search per row against a search per pair. Per-destination calls
+ * are timed on a sample of destinations and scaled up. Every isochrone
+ * total and matrix cell is checked against RouteQuery.
+ */
+int runReachBench(const vector<uint32_t>& sizes, uint32_t sources) {
+    vector<uint32_t> all = withBuiltin(sizes);
+    cout << "stations,metric,query,method,preprocess_s,query_ms,mismatches\n";
+
+    for (uint32_t size : all) {
+        FrozenGraph g = size == 0 ? builtinNetwork() : randomNetwork(size, 42).freeze();
+        uint32_t n = g.numStations();
+        mt19937 rng(7);
+        vector<uint32_t> from(sources), sample(min(n, 200u));
+        for (uint32_t& u : from) {
+            u = rng() % n;
+        }
+        for (uint32_t& u : sample) {
+            u = rng() % n;
+        }
+        vector<uint32_t> rows(min(n, 64u)), cols(min(n, 64u));
+        for (uint32_t& u : rows) {
+            u = rng() % n;
+        }
+        for (uint32_t& u : cols) {
+            u = rng() % n;
+        }
+
+        for (uint32_t metric = 0; metric < 2; metric++) {
+            bool time = metric == 1;
+            SearchScratch s;
+            size_t bad = 0;
+            auto report = [&](const char* query, const char* method, double prep, double ms) {
+                cout << n << ',' << (time ? "time" : "distance") << ',' << query << ',' << method << ','
+                     << prep << ',' << ms << ',' << bad << endl;
+            };
+
+            // One-to-all: every station from each source
+            vector<Isochrone::Reach> reach, kept(n);
+            auto t0 = chrono::steady_clock::now();
+            uint64_t visited = 0;
+            for (uint32_t src : from) {
+                visited += Isochrone::run(g, src, time ? Isochrone::TIME : Isochrone::DISTANCE, INT_MAX, s,
+                                          reach, [](const Isochrone::Reach&) { return true; });
+            }
+            report("one-to-all", "isochrone", 0, secondsSince(t0) * 1e3 / sources);
+
+            t0 = chrono::steady_clock::now();
+            for (uint32_t src : from) {
+                for (uint32_t dst : sample) {
+                    RouteResult r = Graph_M::RouteQuery(g, src, dst, time, s);
+                    visited += r.found;
+                }
+            }
+            report("one-to-all", "route-per-station", 0, secondsSince(t0) * 1e3 / sources * n / sample.size());
+
+            for (uint32_t src : from) {
+                Isochrone::run(g, src, time ? Isochrone::TIME : Isochrone::DISTANCE, INT_MAX, s, reach,
+                               [&kept](const Isochrone::Reach& r) {
+                    kept[r.station] = r;
+                    return true;
+                });
+                for (uint32_t dst : sample) {
+                    RouteResult r = Graph_M::RouteQuery(g, src, dst, time, s);
+                    const Isochrone::Reach& k = kept[dst];
+                    if (r.found && (k.distance != r.distance || k.time != r.time || k.fare != r.fare ||
+                                    k.interchanges != (int)r.interchanges.size())) {
+                        bad++;
+                    }
+                }
+            }
+
+            // Bounded: exactly the stations within half the farthest cost, or within Rs. 30
+            vector<int> unit(g.targets.size(), 1);
+            for (uint32_t src : from) {
+                int budget = 0;
+                Isochrone::run(g, src, time ? Isochrone::TIME : Isochrone::DISTANCE, INT_MAX, s, reach,
+                               [&budget, time](const Isochrone::Reach& r) {
+                    budget = (time ? r.time : r.distance) / 2;
+                    return true;
+                });
+                uint32_t count = Isochrone::run(g, src, time ? Isochrone::TIME : Isochrone::DISTANCE, budget,
+                                                s, reach, [](const Isochrone::Reach&) { return true; });
+                uint32_t fares = Isochrone::run(g, src, Isochrone::FARE, 30, s, reach,
+                                                [](const Isochrone::Reach& r) { return r.fare <= 30; });
+                if (time) DijkstraEngine::run<TimeCost>(g, src, NO_STATION, s);
+                else DijkstraEngine::run<DistanceCost>(g, src, NO_STATION, s);
+                uint32_t expected = 0;
+                for (uint32_t v = 0; v < n; v++) {
+                    expected += s.dist[v] <= budget;
+                }
+                bad += count != expected;
+                DijkstraEngine::runCosts(g, unit.data(), src, NO_STATION, s);
+                expected = 0;
+                for (uint32_t v = 0; v < n; v++) {
+                    expected += s.dist[v] != INT_MAX && RouteResult::fareForStations(s.dist[v] + 1) <= 30;
+                }
+                bad += fares != expected;
+            }
+
+            // S x T matrix
+            vector<int> expected(rows.size() * cols.size());
+            t0 = chrono::steady_clock::now();
+            for (size_t i = 0; i < rows.size(); i++) {
+                for (size_t j = 0; j < cols.size(); j++) {
+                    expected[i * cols.size() + j] = time ? DijkstraEngine::run<TimeCost>(g, rows[i], cols[j], s)
+                                                         : DijkstraEngine::run<DistanceCost>(g, rows[i], cols[j], s);
+                }
+            }
+            report("matrix", "search-per-pair", 0, secondsSince(t0) * 1e3);
+
+            ManyToMany::Scratch ms;
+            CostMatrix m;
+            t0 = chrono::steady_clock::now();
+            if (time) ManyToMany::rows<TimeCost>(g, rows, cols, ms, m);
+            else ManyToMany::rows<DistanceCost>(g, rows, cols, ms, m);
+            double secs = secondsSince(t0);
+            bad += m.cost != expected;
+            report("matrix", "search-per-row", 0, secs * 1e3);
+
+            t0 = chrono::steady_clock::now();
+            ContractionHierarchy ch = ContractionHierarchy::build(
+                g, time ? edgeCosts<TimeCost>(g) : edgeCosts<DistanceCost>(g), metric);
+            double prep = secondsSince(t0);
+            ManyToMany::buckets(ch, rows, cols, ms, m);
+            t0 = chrono::steady_clock::now();
+            ManyToMany::buckets(ch, rows, cols, ms, m);
+            secs = secondsSince(t0);
+            bad += m.cost != expected;
+            report("matrix", "ch-buckets", prep, secs * 1e3);
+            if (bad) return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Measures what the Pareto search costs over the single-criterion line
+ * search it generalises: latency, states or labels taken per query,
+ * labels made, dominated and pruned, and routes returned, with any time
+ * budget and with routes at most 5 minutes slower than the fastest. The
+ * fastest Pareto route must match the line search.
+ */
+int runParetoBench(const vector<uint32_t>& sizes, uint32_t queries) {
+    vector<uint32_t> all = withBuiltin(sizes);
+    cout << "stations,engine,query_us,taken,labels,dominated,pruned,routes,mismatches\n";
+
+    for (uint32_t size : all) {
+        FrozenGraph g = size == 0 ? builtinNetwork() : SyntheticMetro::generate(size, 42).freeze();
+        LineGraph lg = LineGraph::build(g);
+        uint32_t n = g.numStations();
+        mt19937 rng(7);
+        vector<pair<uint32_t, uint32_t>> od(queries);
+        for (auto& q : od) {
+            q = {rng() % n, rng() % n};
+        }
+
+        SearchScratch s;
+        vector<int> fastest(queries);
+        uint64_t settled = 0;
+        auto t0 = chrono::steady_clock::now();
+        for (uint32_t q = 0; q < queries; q++) {
+            fastest[q] = lg.route<TimeCost>(g, od[q].first, od[q].second, 0, s).time;
+            settled += s.settled;
+        }
+        cout << n << ",lines," << secondsSince(t0) * 1e6 / queries << ',' << (double)settled / queries
+             << ",0,0,0,1,0" << endl;
+
+        for (int extra : {INT_MAX, 300}) {
+            ParetoRoutes::Scratch ps;
+            vector<RouteResult> routes;
+            uint64_t taken = 0, labels = 0, dominated = 0, pruned = 0, found = 0;
+            size_t bad = 0;
+            t0 = chrono::steady_clock::now();
+            for (uint32_t q = 0; q < queries; q++) {
+                ParetoRoutes::find(g, lg, od[q].first, od[q].second, extra, ps, routes);
+                taken += ps.taken;
+                labels += ps.created;
+                dominated += ps.dominated;
+                pruned += ps.pruned;
+                found += routes.size();
+                if (routes.empty() || routes[0].time != fastest[q]) bad++;
+            }
+            double secs = secondsSince(t0);
+            cout << n << ',' << (extra == INT_MAX ? "pareto" : "pareto-5min") << ',' << secs * 1e6 / queries
+                 << ',' << (double)taken / queries << ',' << (double)labels / queries << ','
+                 << (double)dominated / queries << ',' << (double)pruned / queries << ','
+                 << (double)found / queries << ',' << bad << endl;
+            if (bad) return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Measures output throughput: a dump of the given number of route
+ * results and repeated dumps of the map, in each Renderer format through
+ * one BufferedWriter, against the per-line ostream and endl formatting
+ * the menu used to do. Everything goes to the null device, so the rates
+ * are formatting and write-call costs only.
+ */
+int runRenderBench(const vector<uint32_t>& sizes, uint32_t records) {
+    const char* sink = "/dev/null";
+    vector<uint32_t> all = withBuiltin(sizes);
+    cout << "stations,dump,format,records,mb,seconds,mb_per_s\n";
+
+    for (uint32_t size : all) {
+        FrozenGraph g = size == 0 ? builtinNetwork() : SyntheticMetro::generate(size, 42).freeze();
+        uint32_t n = g.numStations();
+        mt19937 rng(7);
+        vector<pair<string, string>> names(1024);
+        vector<RouteResult> routes(names.size());
+        QueryContext ctx;
+        for (size_t i = 0; i < routes.size(); i++) {
+            uint32_t s = rng() % n, d = rng() % n;
+            ctx.route(g, s, d, true);
+            routes[i] = ctx.result;
+            names[i] = {g.name(s), g.name(d)};
+        }
+        // Enough map dumps for a steady rate
+        uint32_t maps = max(1u, 2000000u / max(1u, g.numEdges()));
+
+        auto report = [&](const char* dump, const char* format, uint64_t count, uint64_t bytes, double secs) {
+            cout << n << ',' << dump << ',' << format << ',' << count << ',' << bytes / 1e6 << ',' << secs << ','
+                 << (secs > 0 ? bytes / 1e6 / secs : 0) << endl;
+        };
+
+        // The old way: one ostream insertion per field and a flush per line
+        {
+            ofstream out(sink);
+            uint64_t bytes = 0;
+            auto t0 = chrono::steady_clock::now();
+            for (uint32_t i = 0; i < records; i++) {
+                const RouteResult& r = routes[i % routes.size()];
+                const auto& p = names[i % names.size()];
+                stringstream line;
+                line << p.first << ',' << p.second << ',' << r.distance << ',' << r.time << ',' << r.numStations()
+                     << ',' << r.interchanges.size() << ',' << r.fare;
+                string text = line.str();
+                bytes += text.size() + 1;
+                out << text << endl;
+            }
+            report("routes", "ostream", records, bytes, secondsSince(t0));
+
+            bytes = 0;
+            t0 = chrono::steady_clock::now();
+            for (uint32_t m = 0; m < maps; m++) {
+                for (uint32_t u = 0; u < n; u++) {
+                    string str = g.name(u) + " =>\n";
+                    for (uint32_t e = g.offsets[u]; e < g.offsets[u + 1]; e++) {
+                        const string& nbr = g.name(g.targets[e]);
+                        str += "\t" + nbr + "\t";
+                        if (nbr.length() < 16) str += "\t";
+                        if (nbr.length() < 8) str += "\t";
+                        str += to_string(g.weights[e]) + "\n";
+                    }
+                    bytes += str.size() + 1;
+                    out << str << endl;
+                }
+            }
+            report("map", "ostream", (uint64_t)maps * n, bytes, secondsSince(t0));
+        }
+
+        for (Renderer::Format format : {Renderer::TEXT, Renderer::JSONL, Renderer::BINARY}) {
+            const char* label = format == Renderer::TEXT ? "text" : format == Renderer::JSONL ? "jsonl" : "binary";
+            FILE* f = fopen(sink, "wb");
+            if (!f) {
+                cerr << "Cannot open " << sink << "\n";
+                return 1;
+            }
+            Renderer render(format);
+            uint64_t bytes = 0;
+            {
+                BufferedWriter out(f);
+                string& buf = out.data();
+                auto t0 = chrono::steady_clock::now();
+                render.routesHeader(buf, g);
+                for (uint32_t i = 0; i < records; i++) {
+                    const RouteResult& r = routes[i % routes.size()];
+                    const auto& p = names[i % names.size()];
+                    bytes -= buf.size();
+                    render.route(buf, g, p.first, p.second, r.stations.front(), r.stations.back(), 0,
+                                 Renderer::FOUND, r);
+                    bytes += buf.size();
+                    out.endRecord();
+                }
+                out.flush();
+                report("routes", label, records, bytes, secondsSince(t0));
+
+                bytes = 0;
+                t0 = chrono::steady_clock::now();
+                for (uint32_t m = 0; m < maps; m++) {
+                    render.mapHeader(buf, g);
+                    for (uint32_t u = 0; u < n; u++) {
+                        bytes -= buf.size();
+                        render.mapStation(buf, g, u);
+                        bytes += buf.size();
+                        out.endRecord();
+                    }
+                    render.mapFooter(buf);
+                }
+                out.flush();
+                report("map", label, (uint64_t)maps * n, bytes, secondsSince(t0));
+            }
+            fclose(f);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Measures customizable route planning on the built-in map and generated
+ * metro networks: the partition once per network, then for each metric
+ * the customization time and the query latency, checking every query
+ * against Dijkstra on the same edge costs.
+ */
+int runCrpBench(const vector<uint32_t>& sizes, uint32_t queries, unsigned threads) {
+    WorkStealingPool pool(threads ? threads : max(1u, thread::hardware_concurrency()));
+    vector<uint32_t> all = withBuiltin(sizes);
+    cout << "stations,partition_ms,metric,customize_ms,query_us,settled,dijkstra_us,mismatches\n";
+
+    for (uint32_t size : all) {
+        FrozenGraph g = size == 0 ? builtinNetwork() : SyntheticMetro::generate(size, 42).freeze();
+        uint32_t n = g.numStations();
+        mt19937 rng(7);
+        vector<pair<uint32_t, uint32_t>> od(queries);
+        for (auto& q : od) {
+            q = {rng() % n, rng() % n};
+        }
+
+        auto t0 = chrono::steady_clock::now();
+        CrpPartition part = CrpPartition::build(g, Graph_M::CRP_CELL_SIZES);
+        double partitionMs = secondsSince(t0) * 1e3;
+
+        char line = 'A' + __builtin_ctz(g.lineMask[0] ? g.lineMask[0] : 1);
+        vector<pair<string, vector<int>>> metrics = {
+            {"distance", edgeCosts<DistanceCost>(g)},
+            {"time", edgeCosts<TimeCost>(g)},
+            {"peak_time", CrpMetrics::peakTime(g, 180)},
+            {string("closed_") + line, CrpMetrics::lineClosed(g, line)},
+            {"fare", CrpMetrics::fareWeighted(g)},
+        };
+
+        for (auto& metric : metrics) {
+            t0 = chrono::steady_clock::now();
+            CrpMetric m = CrpMetric::customize(g, part, metric.second, pool);
+            double customizeMs = secondsSince(t0) * 1e3;
+
+            SearchScratch s, unpack;
+            vector<int> expected(queries);
+            t0 = chrono::steady_clock::now();
+            for (uint32_t q = 0; q < queries; q++) {
+                expected[q] = DijkstraEngine::runCosts(g, m.cost.data(), od[q].first, od[q].second, s);
+            }
+            double dijkstraSecs = secondsSince(t0);
+
+            size_t bad = 0;
+            uint64_t settled = 0;
+            t0 = chrono::steady_clock::now();
+            for (uint32_t q = 0; q < queries; q++) {
+                RouteResult r = m.route(g, part, od[q].first, od[q].second, s, unpack);
+                settled += s.settled;
+                int got = r.found ? s.dist[od[q].second] : INT_MAX;
+                if (got != expected[q]) bad++;
+
+                // The unpacked path must cost what the overlay search said
+                int sum = 0;
+                for (size_t i = 1; i < r.stations.size(); i++) {
+                    uint32_t a = r.stations[i - 1], b = r.stations[i];
+                    int best = INT_MAX;
+                    for (uint32_t e = g.offsets[a]; e < g.offsets[a + 1]; e++) {
+                        if (g.targets[e] == b) best = min(best, m.cost[e]);
+                    }
+                    sum += best;
+                }
+                if (r.found && sum != got) bad++;
+            }
+            double crpSecs = secondsSince(t0);
+
+            cout << n << ',' << partitionMs << ',' << metric.first << ',' << customizeMs << ','
+                 << crpSecs * 1e6 / queries << ',' << (double)settled / queries << ','
+                 << dijkstraSecs * 1e6 / queries << ',' << bad << endl;
+            if (bad) return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Times loading generated networks of the given sizes from both file
+ * formats, reporting file size and load time per million connections.
+ */
+int runLoadBench(const vector<uint32_t>& sizes) {
+    string dir = filesystem::temp_directory_path().string();
+
+    cout << "stations,connections,format,file_mb,load_s,s_per_million_edges\n";
+    for (uint32_t size : sizes) {
+        FrozenGraph g = SyntheticMetro::generate(size, 42).freeze();
+        for (const char* format : {"csv", "bin"}) {
+            string path = dir + "/delhimetro_load_bench." + format;
+            if (!NetworkFile::save(g, path)) {
+                cerr << "Cannot write " << path << "\n";
+                return 1;
+            }
+
+            GraphBuilder b;
+            auto t0 = chrono::steady_clock::now();
+            string err = NetworkFile::load(path, b);
+            FrozenGraph loaded = b.freeze();
+            double secs = secondsSince(t0);
+            double mb = filesystem::file_size(path) / 1e6;
+            filesystem::remove(path);
+            if (!err.empty() || loaded.fingerprint() != g.fingerprint()) {
+                cerr << "Reloading " << path << " failed: " << (err.empty() ? "network differs" : err) << "\n";
+                return 1;
+            }
+            cout << g.numStations() << ',' << g.numEdges() << ',' << format << ',' << mb << ','
+                 << secs << ',' << secs * 1e6 / max(1u, g.numEdges()) << endl;
+        }
+    }
+    return 0;
+}
+
+#ifdef DELHIMETRO_BENCH
+/**
+ * Microbenchmarks of the public routing and parsing calls (dijkstra,
+ * Get_Minimum_Distance, Get_Minimum_Time, get_Interchanges and
+ * Get_Minimum_Fare) on the built-in map and on generated networks of the
+ * given sizes. Each call runs over a fixed random set of OD pairs after
+ * a warmup pass; the median and fastest of the repetitions are reported
+ * with settled stations and heap allocations per query, as JSON.
+ */
+int runMicroBench(const vector<uint32_t>& sizes, uint32_t repetitions) {
+    vector<uint32_t> all = withBuiltin(sizes);
 
-        while (!st.empty()) {
-            Pair rp = st.top();
-            st.pop();
+    cout << "{\"benchmarks\": [";
+    bool first = true;
+    for (uint32_t size : all) {
+        Graph_M g;
+        if (size == 0) {
+            Graph_M::Create_Metro_Map(g);
+        } else {
+            g.load(SyntheticMetro::generate(size, 42));
+        }
+        const FrozenGraph& fg = g.frozen();
+        uint32_t n = fg.numStations();
+        // Uncached timings, so repeated pairs still search
+        g.routeCache.setCapacity(0);
 
-            if (processed.count(rp.vname)) continue;
-            processed[rp.vname] = true;
+        // Fewer queries on large networks keep each repetition to a few seconds
+        uint32_t queries = max(20u, min(2000u, (uint32_t)(20000000ull / n)));
+        mt19937 rng(7);
+        vector<pair<string, string>> od(queries);
+        for (auto& q : od) {
+            q = {fg.name(rng() % n), fg.name(rng() % n)};
+        }
+        vector<string> paths(queries);
+        for (uint32_t q = 0; q < queries; q++) {
+            paths[q] = g.Get_Minimum_Distance(od[q].first, od[q].second);
+        }
 
-            // If destination reached, check if it's the fastest path
-            if (rp.vname == dst) {
-                if (rp.min_time < min) {
-                    ans = rp.psf;
-                    min = rp.min_time;
-                }
-                continue;
+        auto bench = [&](const char* name, auto&& call) {
+            uint64_t settled = 0;
+            size_t sink = 0;
+            for (uint32_t q = 0; q < min(queries, 100u); q++) {
+                sink += call(q);
             }
 
-            Vertex rpvtx = vtces[rp.vname];
-            for (auto& neighbour : rpvtx.neighbours) {
-                string nbr = neighbour.first;
-                if (!processed.count(nbr)) {
-                    Pair np;
-                    np.vname = nbr;
-                    np.psf = rp.psf + nbr + "  ";
-                    // Time calculation: 2 minutes per km + 2 minutes per station
-                    np.min_time = rp.min_time + 120 + 40 * rpvtx.neighbours[nbr];
-                    st.push(np);
+            vector<double> ns;
+            uint64_t allocs = AllocationCounter::count, bytes = AllocationCounter::bytes;
+            for (uint32_t r = 0; r < repetitions; r++) {
+                auto t0 = chrono::steady_clock::now();
+                for (uint32_t q = 0; q < queries; q++) {
+                    sink += call(q);
+                    settled += g.context.forward.settled;
                 }
+                ns.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / queries);
             }
+            allocs = AllocationCounter::count - allocs;
+            bytes = AllocationCounter::bytes - bytes;
+            sort(ns.begin(), ns.end());
+
+            double runs = (double)queries * repetitions;
+            cout << (first ? "\n" : ",\n") << "  {\"network\": \"" << (size == 0 ? "builtin" : "synthetic")
+                 << "\", \"stations\": " << n << ", \"connections\": " << fg.numEdges()
+                 << ", \"name\": \"" << name << "\", \"queries\": " << queries
+                 << ", \"repetitions\": " << repetitions << ", \"ns_per_query\": " << ns[ns.size() / 2]
+                 << ", \"ns_per_query_min\": " << ns[0] << ", \"settled_per_query\": " << settled / runs
+                 << ", \"allocations_per_query\": " << allocs / runs << ", \"bytes_per_query\": " << bytes / runs
+                 << ", \"checksum\": " << sink << "}";
+            first = false;
+        };
+
+        bench("dijkstra", [&](uint32_t q) {
+            return (size_t)g.dijkstra(od[q].first, od[q].second, q & 1);
+        });
+        bench("Get_Minimum_Distance", [&](uint32_t q) {
+            return g.Get_Minimum_Distance(od[q].first, od[q].second).size();
+        });
+        bench("Get_Minimum_Time", [&](uint32_t q) {
+            return g.Get_Minimum_Time(od[q].first, od[q].second).size();
+        });
+        g.context.forward.settled = 0;
+        bench("get_Interchanges", [&](uint32_t q) {
+            return g.get_Interchanges(paths[q]).size();
+        });
+        bench("Get_Minimum_Fare", [&](uint32_t q) {
+            return (size_t)g.Get_Minimum_Fare(od[q].first, od[q].second, 7 + (q & 1))[1];
+        });
+        vector<pair<uint32_t, uint32_t>> ids(queries);
+        for (uint32_t q = 0; q < queries; q++) {
+            ids[q] = {fg.findId(od[q].first), fg.findId(od[q].second)};
         }
-        // Convert seconds to minutes
-        double minutes = ceil((double)min / 60);
-        ans = ans + to_string(minutes);
-        return ans;
+        bench("QueryContext::route", [&](uint32_t q) {
+            const RouteResult& r = g.context.route(fg, ids[q].first, ids[q].second, q & 1);
+            return r.stations.size() + g.context.pathText(fg).size();
+        });
+        bench("AlternativeRoutes k=3", [&](uint32_t q) {
+            return g.AlternativeRouteQuery(od[q].first, od[q].second, q & 1, 3).size();
+        });
+        g.routeCache.setCapacity(Graph_M::DEFAULT_CACHE_BYTES);
+        bench("Get_Minimum_Distance cached", [&](uint32_t q) {
+            return g.Get_Minimum_Distance(od[q].first, od[q].second).size();
+        });
+
+        if (size == 0) {
+            bench("Create_Metro_Map", [&](uint32_t) {
+                Graph_M fresh;
+                Graph_M::Create_Metro_Map(fresh);
+                return (size_t)fresh.numEdges();
+            });
+        }
+
+        // What people type: lower case without the line suffix, a prefix, and a typo
+        vector<string> typed(queries), prefixes(queries), typos(queries);
+        for (uint32_t q = 0; q < queries; q++) {
+            NameIndex::normalise(od[q].first, typed[q]);
+            prefixes[q] = typed[q].substr(0, 3);
+            typos[q] = typed[q];
+            typos[q][typos[q].size() / 2] = 'x';
+        }
+        const NameIndex& names = fg.stations->search();
+        NameIndex::Scratch ns;
+        vector<uint32_t> completions;
+        vector<NameIndex::Match> matches;
+        g.context.forward.settled = 0;
+        bench("NameIndex::resolve", [&](uint32_t q) {
+            return (size_t)names.resolve(typed[q], ns);
+        });
+        bench("NameIndex::complete", [&](uint32_t q) {
+            names.complete(prefixes[q], 10, completions, ns);
+            return completions.size();
+        });
+        bench("NameIndex::fuzzy", [&](uint32_t q) {
+            names.fuzzy(typos[q], 2, 10, matches, ns);
+            return matches.size();
+        });
     }
+    cout << "\n]}" << endl;
+    return 0;
+}
 
-    /**
-     * Parses the path string to identify interchanges between metro lines.
-     * @param str Path string containing stations and distances/times
-     * @return Vector containing stations and interchange information
-     */
-    vector<string> get_Interchanges(string str) {
-        vector<string> arr;
-        vector<string> tokens;
-        stringstream ss(str);
-        string token;
-        
-        // Split the path string into tokens
-        while (getline(ss, token, ' ')) {
-            if (!token.empty()) {
-                tokens.push_back(token);
-            }
+/**
+ * Checks that route queries through a warmed-up QueryContext make no heap
+ * allocations, on the built-in map and a generated network, for both
+ * metrics. Returns non-zero if any query allocated.
+ */
+int runAllocationCheck() {
+    int status = 0;
+    for (uint32_t size : {0u, 10000u}) {
+        FrozenGraph g = size == 0 ? builtinNetwork() : SyntheticMetro::generate(size, 42).freeze();
+        uint32_t n = g.numStations();
+        mt19937 rng(7);
+        vector<pair<uint32_t, uint32_t>> od(2000);
+        for (auto& q : od) {
+            q = {rng() % n, rng() % n};
         }
-        
-        if (tokens.empty()) return arr;
-        
-        arr.push_back(tokens[0]);
-        int interchange_count = 0;
 
-        for (size_t i = 1; i < tokens.size() - 1; i++) {
-            size_t index = tokens[i].find('~');
-            if (index == string::npos) continue;
-            
-            string line = tokens[i].substr(index + 1);
-            
-            if (line.length() == 2) {
-                // Check if this is an interchange station
-                string prev_line = tokens[i-1].substr(tokens[i-1].find('~') + 1);
-                string next_line = tokens[i+1].substr(tokens[i+1].find('~') + 1);
-                
-                if (prev_line != next_line) {
-                    // Add interchange information
-                    arr.push_back(tokens[i] + " ==> " + tokens[i + 1]);
-                    i++; // Skip next station as we've already processed it
-                    interchange_count++;
-                } else {
-                    arr.push_back(tokens[i]);
+        for (int metric = 0; metric < 2; metric++) {
+            QueryContext ctx;
+            size_t sink = 0;
+            auto runAll = [&]() {
+                for (const auto& q : od) {
+                    sink += ctx.route(g, q.first, q.second, metric == 1).distance;
+                    sink += ctx.pathText(g).size();
                 }
-            } else {
-                arr.push_back(tokens[i]);
-            }
+            };
+            runAll();
+
+            uint64_t before = AllocationCounter::count;
+            runAll();
+            uint64_t allocs = AllocationCounter::count - before;
+            cout << n << " stations, " << (metric ? "time" : "distance") << ": " << allocs
+                 << " allocations in " << od.size() << " queries (checksum " << sink << ")\n";
+            if (allocs) status = 1;
         }
-        
-        arr.push_back(tokens.back());
-        arr.push_back(to_string(interchange_count));
-        return arr;
     }
+    cout << (status ? "FAILED" : "OK") << endl;
+    return status;
+}
+#endif
 
-    /**
-     * Calculates the fare based on number of stations traveled.
-     * @param src Source station
-     * @param dst Destination station
-     * @param x 7 for distance-wise, 8 for time-wise
-     * @return Vector containing number of stations and fare
-     */
-    vector<int> Get_Minimum_Fare(string src, string dst, int x) {
-        int stations = 0;
-        int fare = 0;
-        
-        // Get the number of stations in the path
-        if (x == 7) {
-            stations = get_Interchanges(Get_Minimum_Distance(src, dst)).size() - 1;
-        } else {
-            stations = get_Interchanges(Get_Minimum_Time(src, dst)).size() - 1;
-        }
-
-        // Calculate fare based on number of stations
-        if (stations <= 3) {
-            fare = 10;
-        } else if (stations <= 7) {
-            fare = 20;
-        } else if (stations <= 11) {
-            fare = 30;
-        } else if (stations <= 20) {
-            fare = 40;
-        } else {
-            fare = 40 + (stations - 20) * 10;
+/**
+ * Times repairing shortest-path trees after closures against rebuilding
+ * them, for single and batched closures of random connections, then
+ * reopening them. Every repair is checked against the rebuild.
+ */
+int runRepairBench(const vector<uint32_t>& sizes, uint32_t trials) {
+    vector<uint32_t> all = withBuiltin(sizes);
+    cout << "stations,trees,batch,close_ms,reopen_ms,rebuild_ms,resettled_pct,changed_pairs,mismatches\n";
+
+    for (uint32_t size : all) {
+        FrozenGraph g = size == 0 ? builtinNetwork() : SyntheticMetro::generate(size, 42).freeze();
+        uint32_t n = g.numStations();
+        uint32_t trees = min(n, 256u);
+        vector<uint32_t> sources;
+        for (uint32_t i = 0; i < trees; i++) {
+            sources.push_back((uint64_t)i * n / trees);
         }
+        DynamicRoutes dr = DynamicRoutes::build(g, sources, true);
+        mt19937 rng(7);
 
-        return {stations, fare};
-    }
+        for (uint32_t batch : {1u, 8u, 64u}) {
+            double closeSecs = 0, reopenSecs = 0, rebuildSecs = 0, resettled = 0;
+            size_t changedPairs = 0, bad = 0;
+            vector<DynamicRoutes::Changed> changed;
 
-    /**
-     * Creates the Delhi Metro map with stations and connections.
-     */
-    static void Create_Metro_Map(Graph_M &g) {
-        // Add all stations
-        vector<string> stations = {
-            "Noida_Sector_62~B", "Botanical_Garden~B", "Yamuna_Bank~B", 
-            "Rajiv_Chowk~BY", "Vaishali~B", "Moti_Nagar~B", 
-            "Janak_Puri_West~BO", "Dwarka_Sector_21~B", "Huda_City_Center~Y", 
-            "Saket~Y", "AIIMS~Y", "Rajiv_Chowk~BY", "New_Delhi~YO", 
-            "Chandni_Chowk~Y", "Vishwavidyalaya~Y", "Shivaji_Stadium~O", 
-            "DDS_Campus~O", "IGI_Airport~O", "Rajouri_Garden~BP", 
-            "Netaji_Subhash_Place~PR", "Punjabi_Bagh_West~P"
-        };
-        
-        for (const auto& station : stations) {
-            g.addVertex(station);
-        }
-
-        // Add all connections
-        vector<tuple<string, string, int>> connections = {
-            {"Noida_Sector_62~B", "Botanical_Garden~B", 8},
-            {"Botanical_Garden~B", "Yamuna_Bank~B", 10},
-            {"Yamuna_Bank~B", "Vaishali~B", 8},
-            {"Yamuna_Bank~B", "Rajiv_Chowk~BY", 6},
-            {"Rajiv_Chowk~BY", "Moti_Nagar~B", 9},
-            {"Moti_Nagar~B", "Janak_Puri_West~BO", 7},
-            {"Janak_Puri_West~BO", "Dwarka_Sector_21~B", 6},
-            {"Huda_City_Center~Y", "Saket~Y", 15},
-            {"Saket~Y", "AIIMS~Y", 6},
-            {"AIIMS~Y", "Rajiv_Chowk~BY", 7},
-            {"Rajiv_Chowk~BY", "New_Delhi~YO", 1},
-            {"New_Delhi~YO", "Chandni_Chowk~Y", 2},
-            {"Chandni_Chowk~Y", "Vishwavidyalaya~Y", 5},
-            {"New_Delhi~YO", "Shivaji_Stadium~O", 2},
-            {"Shivaji_Stadium~O", "DDS_Campus~O", 7},
-            {"DDS_Campus~O", "IGI_Airport~O", 8},
-            {"Moti_Nagar~B", "Rajouri_Garden~BP", 2},
-            {"Punjabi_Bagh_West~P", "Rajouri_Garden~BP", 2},
-            {"Punjabi_Bagh_West~P", "Netaji_Subhash_Place~PR", 3}
-        };
-        
-        for (const auto& conn : connections) {
-            g.addEdge(get<0>(conn), get<1>(conn), get<2>(conn));
+            for (uint32_t t = 0; t < trials; t++) {
+                vector<DynamicRoutes::Change> close, reopen;
+                for (uint32_t k = 0; k < batch; k++) {
+                    uint32_t e = rng() % g.targets.size();
+                    uint32_t u = upper_bound(g.offsets.begin(), g.offsets.end(), e) - g.offsets.begin() - 1;
+                    close.push_back({u, g.targets[e], DynamicRoutes::CLOSED});
+                    reopen.push_back({u, g.targets[e], g.weights[e]});
+                }
+
+                auto t0 = chrono::steady_clock::now();
+                dr.update(g, close, &changed);
+                closeSecs += secondsSince(t0);
+                resettled += dr.resettled;
+                changedPairs += changed.size();
+
+                DynamicRoutes full = dr;
+                t0 = chrono::steady_clock::now();
+                full.rebuild(g);
+                rebuildSecs += secondsSince(t0);
+                if (full.dist != dr.dist) bad++;
+
+                t0 = chrono::steady_clock::now();
+                dr.update(g, reopen);
+                reopenSecs += secondsSince(t0);
+                resettled += dr.resettled;
+
+                full = dr;
+                full.rebuild(g);
+                if (full.dist != dr.dist) bad++;
+            }
+
+            cout << n << ',' << trees << ',' << batch << ',' << closeSecs * 1e3 / trials << ','
+                 << reopenSecs * 1e3 / trials << ',' << rebuildSecs * 1e3 / trials << ','
+                 << resettled * 100 / (2.0 * trials * trees * n) << ',' << changedPairs / trials << ','
+                 << bad << endl;
+            if (bad) return 1;
         }
     }
-};
-
-// Initialize static member
-unordered_map<string, Graph_M::Vertex> Graph_M::vtces;
+    return 0;
+}
 
 /**
- * Prints the list of stations with their codes.
- * @return Array of station codes
+ * Times publishing a closure as a patched snapshot against refreezing
+ * the whole network, and measures query throughput of reader threads
+ * with and without a writer publishing closures and reopenings under them.
  */
-vector<string> printCodelist() {
-    cout << "\n***********************************************************************\n";
-    cout << "*                STATION CODES IN THE MAP                             *\n";
-    cout << "***********************************************************************\n";
-    
-    vector<string> codes;
-    int i = 1;
-    
-    for (auto& station : Graph_M::vtces) {
-        string key = station.first;
-        string code;
-        
-        // Generate code from station name
-        for (char c : key) {
-            if (isalpha(c)) {
-                code += toupper(c);
-                break;
+int runPublishBench(const vector<uint32_t>& sizes, unsigned threads) {
+    unsigned readers = threads ? threads : max(1u, thread::hardware_concurrency());
+    cout << "stations,freeze_ms,patch_ms,readers,queries_per_s,queries_per_s_updating,publishes_per_s,stale_reads\n";
+
+    for (uint32_t size : sizes) {
+        Graph_M g;
+        g.load(SyntheticMetro::generate(size, 42));
+        vector<pair<string, string>> edges;
+        const FrozenGraph& fg = g.frozen();
+        for (uint32_t u = 0; u < fg.numStations(); u++) {
+            for (uint32_t e = fg.offsets[u]; e < fg.offsets[u + 1]; e++) {
+                if (u < fg.targets[e]) edges.push_back({fg.name(u), fg.name(fg.targets[e])});
             }
         }
-        
-        // Add numbers from station name
-        for (char c : key) {
-            if (isdigit(c)) {
-                code += c;
-            }
+        mt19937 rng(7);
+
+        auto t0 = chrono::steady_clock::now();
+        FrozenGraph full = g.builder.freeze();
+        double freezeMs = secondsSince(t0) * 1e3;
+
+        const int rounds = 20;
+        t0 = chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            const pair<string, string>& e = edges[rng() % edges.size()];
+            g.removeEdge(e.first, e.second);
+            g.publish();
+            g.addEdge(e.first, e.second, 2);
+            g.publish();
         }
-        
-        // If code is too short, add more characters
-        if (code.length() < 2) {
-            for (char c : key) {
-                if (isalpha(c)) {
-                    code += toupper(c);
-                    if (code.length() >= 2) break;
+        double patchMs = secondsSince(t0) * 1e3 / (2 * rounds);
+
+        // Readers pin a snapshot per query; versions they see must never go backwards
+        auto measure = [&](bool updating) {
+            atomic<bool> stop{false};
+            atomic<uint64_t> queries{0}, stale{0}, publishes{0};
+            vector<thread> pool;
+            for (unsigned t = 0; t < readers; t++) {
+                pool.emplace_back([&, t]() {
+                    QueryContext ctx;
+                    mt19937 r(t);
+                    uint64_t last = 0, done = 0;
+                    while (!stop.load(memory_order_relaxed)) {
+                        Graph_M::Reader reader(g);
+                        if (reader.version() < last) stale++;
+                        last = reader.version();
+                        uint32_t n = reader.graph().numStations();
+                        ctx.route(reader.graph(), r() % n, r() % n, true);
+                        done++;
+                    }
+                    queries += done;
+                });
+            }
+            auto start = chrono::steady_clock::now();
+            mt19937 r(11);
+            while (secondsSince(start) < 1.0) {
+                if (!updating) {
+                    this_thread::sleep_for(chrono::milliseconds(10));
+                    continue;
                 }
+                const pair<string, string>& e = edges[r() % edges.size()];
+                g.removeEdge(e.first, e.second);
+                g.publish();
+                g.addEdge(e.first, e.second, 2);
+                g.publish();
+                publishes += 2;
             }
-        }
-        
-        codes.push_back(code);
-        
-        // Format output
-        cout << i << ". " << key;
-        if (key.length() < 22) cout << "\t";
-        if (key.length() < 14) cout << "\t";
-        if (key.length() < 6) cout << "\t";
-        cout << code << endl;
-        i++;
+            stop = true;
+            for (thread& t : pool) {
+                t.join();
+            }
+            double secs = secondsSince(start);
+            return make_tuple(queries / secs, publishes / secs, stale.load());
+        };
+        auto quiet = measure(false);
+        auto busy = measure(true);
+
+        cout << full.numStations() << ',' << freezeMs << ',' << patchMs << ',' << readers << ','
+             << get<0>(quiet) << ',' << get<0>(busy) << ',' << get<1>(busy) << ','
+             << get<2>(quiet) + get<2>(busy) << endl;
+        if (get<2>(quiet) + get<2>(busy)) return 1;
     }
-    
-    cout << "***********************************************************************\n";
-    return codes;
+    return 0;
 }
 
 /**
  * Displays the application menu and handles user input.
  */
-void displayMenu() {
-    Graph_M g;
-    Graph_M::Create_Metro_Map(g);
-
+void displayMenu(Graph_M& g) {
     cout << "\n\n\t***********************************************************************\n";
     cout << "\t*                   WELCOME TO DELHI METRO APP                         *\n";
     cout << "\t***********************************************************************\n";
@@ -564,13 +8097,19 @@ void displayMenu() {
         cout << "\t*   6. Get shortest path (time-wise)                                  *\n";
         cout << "\t*   7. Get fare for shortest path (distance-wise)                     *\n";
         cout << "\t*   8. Get fare for shortest path (time-wise)                         *\n";
-        cout << "\t*   9. Exit                                                          *\n";
+        cout << "\t*   9. Exit                                                           *\n";
+        cout << "\t*  10. Get alternative routes (time-wise)                             *\n";
+        cout << "\t*  11. Get earliest arrival by timetable                              *\n";
+        cout << "\t*  12. Get stations reachable within a budget                         *\n";
+        cout << "\t*  13. Get route trade-offs (time, fare, interchanges)                *\n";
+        cout << "\t*  14. Get route with fewer line changes (line by line)               *\n";
         cout << "\t=======================================================================\n";
 
         int choice;
-        cout << "\nEnter your choice (1-9): ";
-        cin >> choice;
+        cout << "\nEnter your choice (1-14): ";
+        if (!(cin >> choice)) break;
 
+        // Exit stays on 9 for scripts that drive the menu; later options follow it
         if (choice == 9) {
             cout << "\nThank you for using Delhi Metro App!\n";
             break;
@@ -586,180 +8125,665 @@ void displayMenu() {
                 break;
 
             case 3: {
-                vector<string> codes = printCodelist();
+                printCodelist(g.frozen());
                 string src, dest;
                 
-                cout << "\nEnter source station: ";
                 cin.ignore();
-                getline(cin, src);
-                
-                cout << "Enter destination station: ";
-                getline(cin, dest);
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
 
-                unordered_map<string, bool> processed;
-                if (!g.containsVertex(src) || !g.containsVertex(dest) || !g.hasPath(src, dest, processed)) {
+                RouteResult res = g.RouteQuery(src, dest, false);
+                if (!res.found) {
                     cout << "\nInvalid stations or no path exists!\n";
                 } else {
-                    cout << "\nShortest distance: " << g.dijkstra(src, dest, false) << " KM\n";
+                    cout << "\nShortest distance: " << res.distance << " KM\n";
                 }
                 break;
             }
 
             case 4: {
-                vector<string> codes = printCodelist();
+                printCodelist(g.frozen());
                 string src, dest;
                 
-                cout << "\nEnter source station: ";
                 cin.ignore();
-                getline(cin, src);
-                
-                cout << "Enter destination station: ";
-                getline(cin, dest);
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
 
-                unordered_map<string, bool> processed;
-                if (!g.containsVertex(src) || !g.containsVertex(dest) || !g.hasPath(src, dest, processed)) {
+                RouteResult res = g.RouteQuery(src, dest, true);
+                if (!res.found) {
                     cout << "\nInvalid stations or no path exists!\n";
                 } else {
-                    int time = g.dijkstra(src, dest, true);
+                    int time = res.time;
                     cout << "\nShortest time: " << time / 60 << " minutes (" << time % 60 << " seconds)\n";
                 }
                 break;
             }
 
             case 5: {
-                vector<string> codes = printCodelist();
+                printCodelist(g.frozen());
                 string src, dest;
                 
-                cout << "\nEnter source station: ";
                 cin.ignore();
-                getline(cin, src);
-                
-                cout << "Enter destination station: ";
-                getline(cin, dest);
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
 
-                unordered_map<string, bool> processed;
-                if (!g.containsVertex(src) || !g.containsVertex(dest) || !g.hasPath(src, dest, processed)) {
+                RouteResult res = g.RouteQuery(src, dest, false);
+                if (!res.found) {
                     cout << "\nInvalid stations or no path exists!\n";
                 } else {
-                    vector<string> path = g.get_Interchanges(g.Get_Minimum_Distance(src, dest));
-                    if (path.size() < 2) {
-                        cout << "\nNo path found!\n";
-                        break;
-                    }
-                    
                     cout << "\n===============================================================\n";
                     cout << "   Shortest Path (Distance-wise) from " << src << " to " << dest;
                     cout << "\n===============================================================\n";
-                    cout << "Total distance: " << path.back() << " KM\n";
-                    cout << "Number of interchanges: " << path[path.size()-2] << "\n";
+                    cout << "Total distance: " << res.distance << " KM\n";
+                    cout << "Number of interchanges: " << res.interchanges.size() << "\n";
                     cout << "Route:\n";
-                    
-                    for (size_t i = 0; i < path.size()-2; i++) {
-                        cout << i+1 << ". " << path[i] << "\n";
-                    }
-                    
+                    g.printRoute(res);
                     cout << "===============================================================\n";
                 }
                 break;
             }
 
             case 6: {
-                vector<string> codes = printCodelist();
+                printCodelist(g.frozen());
                 string src, dest;
                 
-                cout << "\nEnter source station: ";
                 cin.ignore();
-                getline(cin, src);
-                
-                cout << "Enter destination station: ";
-                getline(cin, dest);
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
 
-                unordered_map<string, bool> processed;
-                if (!g.containsVertex(src) || !g.containsVertex(dest) || !g.hasPath(src, dest, processed)) {
+                RouteResult res = g.RouteQuery(src, dest, true);
+                if (!res.found) {
                     cout << "\nInvalid stations or no path exists!\n";
                 } else {
-                    vector<string> path = g.get_Interchanges(g.Get_Minimum_Time(src, dest));
-                    if (path.size() < 2) {
-                        cout << "\nNo path found!\n";
-                        break;
-                    }
-                    
                     cout << "\n===============================================================\n";
                     cout << "   Shortest Path (Time-wise) from " << src << " to " << dest;
                     cout << "\n===============================================================\n";
-                    cout << "Estimated time: " << path.back() << " minutes\n";
-                    cout << "Number of interchanges: " << path[path.size()-2] << "\n";
+                    cout << "Estimated time: " << (res.time + 59) / 60 << " minutes\n";
+                    cout << "Number of interchanges: " << res.interchanges.size() << "\n";
                     cout << "Route:\n";
-                    
-                    for (size_t i = 0; i < path.size()-2; i++) {
-                        cout << i+1 << ". " << path[i] << "\n";
-                    }
-                    
+                    g.printRoute(res);
                     cout << "===============================================================\n";
                 }
                 break;
             }
 
             case 7: {
-                vector<string> codes = printCodelist();
+                printCodelist(g.frozen());
                 string src, dest;
                 
-                cout << "\nEnter source station: ";
                 cin.ignore();
-                getline(cin, src);
-                
-                cout << "Enter destination station: ";
-                getline(cin, dest);
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
 
-                unordered_map<string, bool> processed;
-                if (!g.containsVertex(src) || !g.containsVertex(dest) || !g.hasPath(src, dest, processed)) {
+                RouteResult res = g.RouteQuery(src, dest, false);
+                if (!res.found) {
                     cout << "\nInvalid stations or no path exists!\n";
                 } else {
-                    vector<int> fareInfo = g.Get_Minimum_Fare(src, dest, 7);
                     cout << "\n===============================================================\n";
                     cout << "   Fare Information (Distance-wise) from " << src << " to " << dest;
                     cout << "\n===============================================================\n";
-                    cout << "Number of stations: " << fareInfo[0] << "\n";
-                    cout << "Total fare: Rs. " << fareInfo[1] << "\n";
+                    cout << "Number of stations: " << res.numStations() << "\n";
+                    cout << "Total fare: Rs. " << res.fare << "\n";
                     cout << "===============================================================\n";
                 }
                 break;
             }
 
             case 8: {
-                vector<string> codes = printCodelist();
+                printCodelist(g.frozen());
                 string src, dest;
                 
-                cout << "\nEnter source station: ";
                 cin.ignore();
-                getline(cin, src);
-                
-                cout << "Enter destination station: ";
-                getline(cin, dest);
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
 
-                unordered_map<string, bool> processed;
-                if (!g.containsVertex(src) || !g.containsVertex(dest) || !g.hasPath(src, dest, processed)) {
+                RouteResult res = g.RouteQuery(src, dest, true);
+                if (!res.found) {
                     cout << "\nInvalid stations or no path exists!\n";
                 } else {
-                    vector<int> fareInfo = g.Get_Minimum_Fare(src, dest, 8);
                     cout << "\n===============================================================\n";
                     cout << "   Fare Information (Time-wise) from " << src << " to " << dest;
                     cout << "\n===============================================================\n";
-                    cout << "Number of stations: " << fareInfo[0] << "\n";
-                    cout << "Total fare: Rs. " << fareInfo[1] << "\n";
+                    cout << "Number of stations: " << res.numStations() << "\n";
+                    cout << "Total fare: Rs. " << res.fare << "\n";
                     cout << "===============================================================\n";
                 }
                 break;
             }
 
+            case 10: {
+                printCodelist(g.frozen());
+                string src, dest;
+                int k;
+
+                cin.ignore();
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
+
+                cout << "Number of routes (1-5): ";
+                if (!(cin >> k)) break;
+                k = min(5, max(1, k));
+
+                vector<RouteResult> routes = g.AlternativeRouteQuery(src, dest, true, k);
+                if (routes.empty()) {
+                    cout << "\nInvalid stations or no path exists!\n";
+                    break;
+                }
+                cout << "\n===============================================================\n";
+                cout << "   Alternative Routes (Time-wise) from " << src << " to " << dest;
+                cout << "\n===============================================================\n";
+                for (size_t i = 0; i < routes.size(); i++) {
+                    const RouteResult& res = routes[i];
+                    cout << "Route " << i + 1 << ": " << (res.time + 59) / 60 << " minutes, "
+                         << res.distance << " KM, " << res.interchanges.size() << " interchanges, Rs. "
+                         << res.fare << "\n";
+                    g.printRoute(res);
+                    cout << "---------------------------------------------------------------\n";
+                }
+                if (routes.size() < (size_t)k) cout << "No other distinct routes exist.\n";
+                cout << "===============================================================\n";
+                break;
+            }
+
+            case 11: {
+                printCodelist(g.frozen());
+                string src, dest, when;
+
+                cin.ignore();
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
+
+                cout << "Departure time (HH:MM): ";
+                getline(cin, when);
+                int depart = parseClock(when);
+                if (depart < 0) {
+                    cout << "\nInvalid time!\n";
+                    break;
+                }
+
+                RouteResult res = g.EarliestArrivalQuery(src, dest, depart);
+                if (!res.found) {
+                    cout << "\nInvalid stations or no train gets there after " << formatClock(depart) << "!\n";
+                    break;
+                }
+                cout << "\n===============================================================\n";
+                cout << "   Earliest Arrival from " << src << " to " << dest << " leaving " << formatClock(depart);
+                cout << "\n===============================================================\n";
+                cout << "Arrive at " << formatClock(depart + res.time) << " (" << (res.time + 59) / 60
+                     << " minutes, " << res.interchanges.size() << " interchanges, Rs. " << res.fare << ")\n";
+                g.printRoute(res);
+                cout << "---------------------------------------------------------------\n";
+                cout << "Best departures in the next hour:\n";
+                for (const pair<int, int>& trip : g.DepartureProfile(src, dest, depart, depart + 3600)) {
+                    cout << "  Leave " << formatClock(trip.first) << ", arrive " << formatClock(trip.second) << "\n";
+                }
+                cout << "===============================================================\n";
+                break;
+            }
+
+            case 12: {
+                printCodelist(g.frozen());
+                string src;
+                int kind, budget;
+
+                cin.ignore();
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                uint32_t s = g.frozen().resolve(src);
+                if (s == NO_STATION) {
+                    cout << "\nInvalid station!\n";
+                    break;
+                }
+                cout << "Budget in 1. KM  2. minutes  3. Rs.: ";
+                if (!(cin >> kind) || kind < 1 || kind > 3) {
+                    cout << "\nInvalid choice!\n";
+                    break;
+                }
+                cout << "Budget: ";
+                if (!(cin >> budget) || budget < 0) {
+                    cout << "\nInvalid budget!\n";
+                    break;
+                }
+
+                Isochrone::Metric metric = kind == 1 ? Isochrone::DISTANCE
+                                         : kind == 2 ? Isochrone::TIME : Isochrone::FARE;
+                const char* unit = kind == 1 ? " KM" : kind == 2 ? " minutes" : " Rs.";
+                if (metric == Isochrone::TIME) budget = budget > INT_MAX / 60 ? INT_MAX : budget * 60;
+                const FrozenGraph& fg = g.frozen();
+                cout << "\n===============================================================\n";
+                cout << "   Stations within " << (kind == 2 ? budget / 60 : budget) << unit << " of " << fg.name(s);
+                cout << "\n===============================================================\n";
+                uint32_t count = g.ReachableQuery(s, metric, budget, [&fg](const Isochrone::Reach& r) {
+                    cout << fg.name(r.station) << ": " << r.distance << " KM, " << (r.time + 59) / 60
+                         << " minutes, " << r.interchanges << " interchanges, Rs. " << r.fare << "\n";
+                    return true;
+                });
+                cout << "---------------------------------------------------------------\n";
+                cout << count << " stations\n";
+                cout << "===============================================================\n";
+                break;
+            }
+
+            case 13: {
+                printCodelist(g.frozen());
+                string src, dest;
+                int extra;
+
+                cin.ignore();
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
+
+                cout << "Most extra minutes over the fastest route (-1 for any): ";
+                if (!(cin >> extra)) break;
+                extra = extra < 0 || extra > INT_MAX / 60 ? INT_MAX : extra * 60;
+
+                vector<RouteResult> routes = g.ParetoRouteQuery(src, dest, extra);
+                if (routes.empty()) {
+                    cout << "\nInvalid stations or no path exists!\n";
+                    break;
+                }
+                cout << "\n===============================================================\n";
+                cout << "   Route Trade-offs from " << src << " to " << dest;
+                cout << "\n===============================================================\n";
+                for (size_t i = 0; i < routes.size(); i++) {
+                    const RouteResult& res = routes[i];
+                    cout << "Route " << i + 1 << ": " << (res.time + 59) / 60 << " minutes, Rs. " << res.fare
+                         << ", " << res.interchanges.size() << " interchanges, " << res.distance << " KM\n";
+                    g.printRoute(res);
+                    cout << "---------------------------------------------------------------\n";
+                }
+                cout << "Each route is faster, cheaper or has fewer interchanges than every other.\n";
+                cout << "===============================================================\n";
+                break;
+            }
+
+            case 14: {
+                printCodelist(g.frozen());
+                string src, dest;
+                int unit;
+
+                cin.ignore();
+                src = readStation(g.frozen(), "\nEnter source station: ");
+                dest = readStation(g.frozen(), "Enter destination station: ");
+
+                cout << "Minimise 1. KM 2. minutes: ";
+                if (!(cin >> unit)) break;
+                bool byTime = unit == 2;
+
+                RouteResult res = g.RouteQuery(src, dest, byTime, Graph_M::LINES);
+                if (!res.found) {
+                    cout << "\nInvalid stations or no path exists!\n";
+                    break;
+                }
+                cout << "\n===============================================================\n";
+                cout << "   Route with Fewer Line Changes from " << src << " to " << dest;
+                cout << "\n===============================================================\n";
+                cout << "Total distance: " << res.distance << " KM\n";
+                cout << "Estimated time: " << (res.time + 59) / 60 << " minutes\n";
+                cout << "Number of interchanges: " << res.interchanges.size() << "\n";
+                cout << "Each line change counts as " << g.transferPenalty[byTime]
+                     << (byTime ? " seconds" : " KM") << " more than the ride itself.\n";
+                cout << "Route:\n";
+                g.printRoute(res);
+                cout << "===============================================================\n";
+                break;
+            }
+
             default:
-                cout << "\nInvalid choice! Please enter a number between 1-9.\n";
+                cout << "\nInvalid choice! Please enter a number between 1-14.\n";
                 break;
         }
     }
 }
 
-int main() {
-    displayMenu();
-    return 0;
+static constexpr long MAX_GENERATED = 10000000;    // Largest network --generate and the benchmarks build
+
+// Parses a whole decimal argument within [low, high] into value; false if it is not one
+static bool parseNumber(const char* text, long low, long high, long& value) {
+    char* rest;
+    errno = 0;
+    value = strtol(text, &rest, 10);
+    return rest != text && *rest == '\0' && errno == 0 && value >= low && value <= high;
+}
+
+// Prints the command line options
+void printUsage(const char* prog) {
+    cerr << "Usage: " << prog << " [options]\n"
+         << "  (no options)          interactive menu\n"
+         << "  --batch FILE          answer source,destination pairs from FILE (- for stdin)\n"
+         << "  --metric distance|time  route by distance (default) or time\n"
+         << "  --out FILE            write batch results to FILE (default stdout)\n"
+         << "  --threads N           batch worker threads, 1-256 (default: all cores)\n"
+         << "  --table FILE          serve batch queries from a prebuilt route table\n"
+         << "  --build-table FILE    precompute all routes into FILE and exit\n"
+         << "  --build-ch FILE       build a contraction hierarchy for --metric into FILE and exit\n"
+         << "  --ch FILE             answer batch queries (and served matrices) with a contraction hierarchy\n"
+         << "  --engine dijkstra|alt|crp  answer batch queries with Dijkstra, landmark A* or the CRP overlay\n"
+         << "  --alternatives K      list up to K (1-100) distinct routes per batch pair, best first\n"
+         << "  --closures FILE       apply closures from FILE to a distance table and list changed pairs\n"
+         << "  --serve [HOST:]PORT   answer route queries over TCP (default host 127.0.0.1)\n"
+         << "  --repair-bench N,N,... time repairing routes after closures against rebuilding them\n"
+         << "  --publish-bench N,N,... time publishing closures and query throughput while they apply\n"
+         << "  --depart HH:MM        answer batch pairs by the timetable, leaving at HH:MM\n"
+         << "  --timetable FILE      use the schedule in FILE instead of one generated from the lines\n"
+         << "  --cache MB            route cache size, 0-65536 (menu default 8, batch default 0 = off)\n"
+         << "  --transfer-penalty KM,SECONDS  cost of a line change for line-aware routes (default 1,300)\n"
+         << "  --route-bench N,N,... compare Dijkstra, ALT and hierarchy query latency\n"
+         << "  --crp-bench N,N,...   time CRP customization and queries per metric\n"
+         << "  --reach-bench N,N,... time one-to-all and matrix queries against a search per destination\n"
+         << "  --pareto-bench N,N,... time time/fare/interchange trade-off routing against the line search\n"
+         << "  --render-bench N,N,... time dumping a million routes and the map in each output format\n"
+         << "  --format text|jsonl|binary  batch and --show output as text/CSV, JSON Lines or binary records\n"
+         << "  --show map|stations   print the map or the station list and exit\n"
+         << "  --load FILE           use the network in FILE (CSV or binary) instead of the built-in map\n"
+         << "  --generate N          use a synthetic metro network of about N stations\n"
+         << "  --seed N              seed for --generate (default 42)\n"
+         << "  --save FILE           write the network to FILE (.csv for CSV, else binary) and exit\n"
+         << "  --load-bench N,N,...  time loading generated networks from both file formats\n"
+         << "  --micro-bench N,N,... time each routing and parsing call, as JSON (needs -DDELHIMETRO_BENCH)\n"
+         << "  --alloc-check         check that warmed-up route queries make no heap allocations (needs -DDELHIMETRO_BENCH)\n"
+         << "  --stats               print query counters and latencies on exit (needs -DDELHIMETRO_STATS)\n"
+         << "  --stats-json FILE     also write them to FILE as JSON\n";
+}
+
+int main(int argc, char* argv[]) {
+    BatchOptions batch;
+    bool batchMode = false;
+    string buildTable;
+    vector<uint32_t> routeSizes;
+    vector<uint32_t> crpSizes;
+    vector<uint32_t> loadSizes;
+    vector<uint32_t> microSizes;
+    vector<uint32_t> repairSizes;
+    vector<uint32_t> publishSizes;
+    vector<uint32_t> reachSizes;
+    vector<uint32_t> paretoSizes;
+    vector<uint32_t> renderSizes;
+    string show;
+    bool micro = false;
+    string buildCh;
+    string loadFile, saveFile;
+    uint32_t generate = 0, seed = 42;
+    bool menu = true;   // No options beyond choosing the network
+    bool stats = false;
+    string statsJson;
+    string timetableFile;
+    long cacheMb = -1;  // Route cache budget, -1 for the default
+    long transferKm = Graph_M::DEFAULT_TRANSFER_KM, transferSeconds = Graph_M::DEFAULT_TRANSFER_SECONDS;
+    string serveAddress;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--load" && hasValue) {
+            loadFile = argv[++i];
+            continue;
+        } else if (arg == "--generate" && hasValue) {
+            long stations;
+            if (!parseNumber(argv[++i], 1, MAX_GENERATED, stations)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            generate = stations;
+            continue;
+        } else if (arg == "--seed" && hasValue) {
+            long value;
+            if (!parseNumber(argv[++i], 0, UINT32_MAX, value)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            seed = value;
+            continue;
+        } else if (arg == "--stats") {
+            stats = true;
+            continue;
+        } else if (arg == "--stats-json" && hasValue) {
+            statsJson = argv[++i];
+            continue;
+        } else if (arg == "--timetable" && hasValue) {
+            timetableFile = argv[++i];
+            continue;
+        } else if (arg == "--cache" && hasValue) {
+            if (!parseNumber(argv[++i], 0, 65536, cacheMb)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            continue;
+        } else if (arg == "--transfer-penalty" && hasValue) {
+            string value = argv[++i];
+            size_t comma = value.find(',');
+            if (comma == string::npos || !parseNumber(value.substr(0, comma).c_str(), 0, 100, transferKm)
+                || !parseNumber(value.substr(comma + 1).c_str(), 0, 3600, transferSeconds)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            continue;
+        }
+
+        menu = false;
+        if (arg == "--batch" && hasValue) {
+            batchMode = true;
+            batch.input = argv[++i];
+        } else if (arg == "--metric" && hasValue) {
+            string metric = argv[++i];
+            if (metric != "distance" && metric != "time") {
+                printUsage(argv[0]);
+                return 1;
+            }
+            batch.time = metric == "time";
+        } else if (arg == "--out" && hasValue) {
+            batch.output = argv[++i];
+        } else if (arg == "--threads" && hasValue) {
+            long threads;
+            if (!parseNumber(argv[++i], 1, 256, threads)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            batch.threads = threads;
+        } else if (arg == "--table" && hasValue) {
+            batch.table = argv[++i];
+        } else if (arg == "--build-table" && hasValue) {
+            buildTable = argv[++i];
+        } else if ((arg == "--route-bench" || arg == "--crp-bench"
+                    || arg == "--load-bench" || arg == "--micro-bench" || arg == "--repair-bench"
+                    || arg == "--publish-bench" || arg == "--reach-bench" || arg == "--pareto-bench"
+                    || arg == "--render-bench")
+                   && hasValue) {
+            micro = micro || arg == "--micro-bench";
+            vector<uint32_t>& sizes = arg == "--route-bench" ? routeSizes
+                                    : arg == "--crp-bench" ? crpSizes
+                                    : arg == "--load-bench" ? loadSizes
+                                    : arg == "--repair-bench" ? repairSizes
+                                    : arg == "--publish-bench" ? publishSizes
+                                    : arg == "--reach-bench" ? reachSizes
+                                    : arg == "--pareto-bench" ? paretoSizes
+                                    : arg == "--render-bench" ? renderSizes : microSizes;
+            stringstream ss(argv[++i]);
+            string size;
+            long stations;
+            while (getline(ss, size, ',')) {
+                if (!parseNumber(size.c_str(), 1, MAX_GENERATED, stations)) {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                sizes.push_back(stations);
+            }
+        } else if (arg == "--depart" && hasValue) {
+            batch.depart = parseClock(argv[++i]);
+            if (batch.depart < 0) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--closures" && hasValue) {
+            batch.closures = argv[++i];
+        } else if (arg == "--serve" && hasValue) {
+            serveAddress = argv[++i];
+        } else if (arg == "--alternatives" && hasValue) {
+            long k;
+            if (!parseNumber(argv[++i], 1, 100, k)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            batch.alternatives = k;
+        } else if (arg == "--format" && hasValue) {
+            if (!Renderer::parseFormat(argv[++i], batch.format)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--show" && hasValue) {
+            show = argv[++i];
+            if (show != "map" && show != "stations") {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--alloc-check") {
+#ifdef DELHIMETRO_BENCH
+            return runAllocationCheck();
+#else
+            cerr << "--alloc-check needs a build with -DDELHIMETRO_BENCH\n";
+            return 1;
+#endif
+        } else if (arg == "--save" && hasValue) {
+            saveFile = argv[++i];
+        } else if (arg == "--build-ch" && hasValue) {
+            buildCh = argv[++i];
+        } else if (arg == "--ch" && hasValue) {
+            batch.ch = argv[++i];
+        } else if (arg == "--engine" && hasValue) {
+            string engine = argv[++i];
+            if (engine != "dijkstra" && engine != "alt" && engine != "crp") {
+                printUsage(argv[0]);
+                return 1;
+            }
+            batch.alt = engine == "alt";
+            batch.crp = engine == "crp";
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!routeSizes.empty()) return runRoutingBench(routeSizes, 10000);
+    if (!crpSizes.empty()) return runCrpBench(crpSizes, 10000, batch.threads);
+    if (!loadSizes.empty()) return runLoadBench(loadSizes);
+#ifdef DELHIMETRO_BENCH
+    if (micro) return runMicroBench(microSizes, 5);
+#else
+    if (micro) {
+        cerr << "--micro-bench needs a build with -DDELHIMETRO_BENCH\n";
+        return 1;
+    }
+#endif
+    if (!repairSizes.empty()) return runRepairBench(repairSizes, 20);
+    if (!publishSizes.empty()) return runPublishBench(publishSizes, batch.threads);
+    if (!reachSizes.empty()) return runReachBench(reachSizes, 10);
+    if (!paretoSizes.empty()) return runParetoBench(paretoSizes, 1000);
+    if (!renderSizes.empty()) return runRenderBench(renderSizes, 1000000);
+
+    Graph_M g;
+    if (!loadFile.empty()) {
+        auto t0 = chrono::steady_clock::now();
+        GraphBuilder b;
+        string err = NetworkFile::load(loadFile, b);
+        if (!err.empty()) {
+            cerr << "Cannot load " << loadFile << ": " << err << "\n";
+            return 1;
+        }
+        g.load(b);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        cerr << "Loaded " << g.numVetex() << " stations and " << g.numEdges() << " connections in "
+             << secs << " s (" << secs * 1e6 / max(1, g.numEdges()) << " s per million connections)\n";
+    } else if (generate > 0) {
+        g.load(SyntheticMetro::generate(generate, seed));
+    } else {
+        Graph_M::Create_Metro_Map(g);
+    }
+    g.transferPenalty[0] = transferKm;
+    g.transferPenalty[1] = transferSeconds;
+    if (cacheMb >= 0) {
+        batch.cacheBytes = (size_t)cacheMb << 20;
+        g.routeCache.setCapacity(batch.cacheBytes);
+    }
+    if (!timetableFile.empty()) {
+        string err = g.loadTimetable(timetableFile);
+        if (!err.empty()) {
+            cerr << "Cannot load timetable " << timetableFile << ": " << err << "\n";
+            return 1;
+        }
+    }
+
+    // Dumps the query statistics gathered by the menu or a batch run
+    auto reportStats = [&]() {
+#ifdef DELHIMETRO_STATS
+        QueryStats::Snapshot snap = QueryStats::snapshot();
+        if (stats) QueryStats::printText(cerr, snap, g.frozen());
+        if (!statsJson.empty()) {
+            ofstream out(statsJson);
+            QueryStats::printJson(out, snap, g.frozen());
+        }
+#else
+        if (stats || !statsJson.empty()) cerr << "Query statistics need a build with -DDELHIMETRO_STATS\n";
+#endif
+        if (stats && menu && g.routeCache.enabled()) RouteCache::printStats(cerr, g.routeCache.stats());
+    };
+
+    if (menu) {
+        displayMenu(g);
+        reportStats();
+        return 0;
+    }
+
+    if (!saveFile.empty()) {
+        if (!NetworkFile::save(g.frozen(), saveFile)) {
+            cerr << "Cannot write " << saveFile << "\n";
+            return 1;
+        }
+        cerr << "Network with " << g.numVetex() << " stations written to " << saveFile << "\n";
+        return 0;
+    }
+
+    if (!buildTable.empty()) {
+        if (!RouteTable::build(g.frozen(), buildTable)) {
+            cerr << "Cannot write " << buildTable << "\n";
+            return 1;
+        }
+        cerr << "Route table for " << g.numVetex() << " stations written to " << buildTable << "\n";
+        return 0;
+    }
+
+    if (!buildCh.empty()) {
+        const FrozenGraph& fg = g.frozen();
+        ContractionHierarchy ch = ContractionHierarchy::build(
+            fg, batch.time ? edgeCosts<TimeCost>(fg) : edgeCosts<DistanceCost>(fg), batch.time ? 1 : 0);
+        if (!ch.save(buildCh)) {
+            cerr << "Cannot write " << buildCh << "\n";
+            return 1;
+        }
+        cerr << "Contraction hierarchy with " << ch.upTargets.size() << " upward arcs written to "
+             << buildCh << "\n";
+        return 0;
+    }
+
+    if (!show.empty()) {
+        if (show == "map") g.display_Map(batch.format);
+        else g.display_Stations(batch.format);
+        return 0;
+    }
+
+    if (!batch.closures.empty()) return runClosures(g, batch);
+
+    if (!serveAddress.empty()) {
+        int status = runServer(g, serveAddress, batch.threads, batch.ch);
+        reportStats();
+        return status;
+    }
+
+    if (batchMode) {
+        int status = runBatch(g, batch);
+        reportStats();
+        return status;
+    }
+
+    printUsage(argv[0]);
+    return 1;
 }